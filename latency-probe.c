@@ -0,0 +1,508 @@
+/***
+ latency-probe: times how long the instruments here take to make a sound,
+ from the moment a trigger goes in to the first sample of it coming out of
+ JACK. It's a JACK client of its own: it sends the trigger, listens to the
+ instrument's output, and times each onset in JACK frames.
+ --
+
+ To compile this:
+    gcc latency-probe.c -lpthread -lm -ljack -lasound -lutil -O2 -o latency-probe
+
+ To use it, start JACK (the dummy backend is fine, and it keeps the sound
+ card out of the numbers), then give it the program to measure:
+    jackd -d dummy -r 48000 -p 256 &
+    ./latency-probe -- ./snappy-drums
+    ./latency-probe -t audio -c SnoKoder:output -i SnoKoder:input -- ./snokoder
+
+ It starts the program in a pseudo-terminal (so it can type at it), waits
+ for its ports, connects to them, and then measures each trigger path:
+    jack    a note on the program's JACK MIDI input, on a frame it picks
+    alsa    a note through the ALSA sequencer (WaitOnMIDI() in the program)
+    key     a key typed at the program's terminal (getch() in its main())
+    audio   a click into the program's audio input. snokoder's notes only
+            change what it does to the sound coming in, so this is the
+            one to use for it
+ For each path, it triggers a sound many times, at random points in the
+ period, with the output quiet before each one, and prints the min, median,
+ p99 and max latency. Without "-- program ...", it measures a program that's
+ already running.
+
+ Options:
+    -t path      measure this trigger path: jack, alsa, key or audio. more
+                 than one -t measures each in turn (default: jack, alsa
+                 and key, or just the ones there's a way in for)
+    -n count     triggers per path (default 200)
+    -m port      the program's JACK MIDI input (default snappy:midi_in)
+    -a client    the program's ALSA sequencer client (default snappy)
+    -i port      the program's audio input, for -t audio
+    -c port      the program's output to listen to (default snappy:out)
+    -N note      the MIDI note to play, on channel 1 (default 60)
+    -k key       the key to type (default z)
+    -l level     the onset threshold (default 0.001)
+    -q ms        how long the output has to stay quiet before each
+                 trigger (default 100)
+    -o file      also write every measurement to this file, as CSV
+
+ The jack and audio paths are exact to the frame. The alsa and key paths
+ are timed from JACK's estimate of the current frame when the trigger goes
+ out, which is good to a few frames.
+
+ On the jack and audio paths, the trigger goes around a loop in the JACK
+ graph: out of the probe into the program, and out of the program back
+ into the probe. JACK can only run a loop by having one of its
+ connections a period late, which would add a period to every
+ measurement that the program isn't to blame for. So the probe first
+ measures its own delay around a loop (its output straight into its
+ input) and takes that off those two paths, and it only connects its
+ output to the program while measuring the path that uses it, so the
+ alsa and key paths don't go around a loop at all. The first lines of
+ the output say what was taken off.
+
+
+ Copyright 2019, Elie Goldman Smith
+
+ This program is FREE SOFTWARE: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+***/
+
+#include <alsa/asoundlib.h>
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <math.h>
+#include <pthread.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef jack_default_audio_sample_t sample_t;
+
+// trigger paths
+#define PATH_JACK  0
+#define PATH_ALSA  1
+#define PATH_KEY   2
+#define PATH_AUDIO 3
+#define NUM_PATHS  4
+const char *g_pathNames[NUM_PATHS] = {"jack", "alsa", "key", "audio"};
+
+#define CLICK_FRAMES 64  // length of the click for the audio path
+#define HEAR_TIMEOUT 1.0 // seconds to wait for a trigger to be heard
+#define QUIET_TIMEOUT 5.0 // seconds to wait for the output to go quiet
+
+// settings, from the command line
+const char *g_midiPort = "snappy:midi_in";
+const char *g_alsaClient = "snappy";
+const char *g_inputPort = NULL;
+const char *g_capturePort = "snappy:out";
+int g_note = 60;
+int g_key = 'z';
+sample_t g_threshold = 0.001;
+int g_quietMs = 100;
+
+jack_client_t *g_client;
+jack_port_t *g_midiOut;  // the probe's
+jack_port_t *g_audioOut; // own
+jack_port_t *g_audioIn;  // ports
+jack_nframes_t g_sampleRate, g_period;
+snd_seq_t *g_seq = NULL;
+int g_seqPort;
+int g_pty = -1; // the program's terminal, if the probe started it
+
+// one trigger at a time, handed between the main thread and the JACK
+// thread. the main thread sets it up, then sets 'send' or 'listening'
+// (with release); the JACK thread sets 'heard' (with release)
+typedef struct {
+ int path;
+ jack_nframes_t at;         // jack & audio paths: the frame to send it on
+ int send;                  // 1 until the JACK thread has sent it
+ int clickLeft;             // frames of the click still to send
+ int soundOff;              // 1: send all sound off on the next period
+ jack_nframes_t listenFrom; // an onset only counts from this frame on
+ int listening;
+ jack_nframes_t onset;
+ int heard;
+ jack_nframes_t lastLoud;   // the last frame over the threshold
+} Probe;
+Probe g_probe;
+
+
+
+// the JACK thread: sends what the main thread asked for, and listens
+int My_Process (jack_nframes_t nframes, void *arg)
+{
+ Probe *p = &g_probe;
+ jack_nframes_t start = jack_last_frame_time(g_client);
+ void *midi = jack_port_get_buffer(g_midiOut, nframes);
+ sample_t *out = (sample_t *) jack_port_get_buffer(g_audioOut, nframes);
+ const sample_t *in = (const sample_t *) jack_port_get_buffer(g_audioIn, nframes);
+ int i;
+ jack_midi_clear_buffer(midi);
+ memset(out, 0, nframes*sizeof(sample_t));
+
+ if (__atomic_load_n(&p->soundOff, __ATOMIC_ACQUIRE)) {
+  unsigned char noteOff[3] = {0x80, g_note, 0};
+  unsigned char soundOff[3] = {0xB0, 120, 0};
+  jack_midi_event_write(midi, 0, noteOff, 3);
+  jack_midi_event_write(midi, 0, soundOff, 3);
+  __atomic_store_n(&p->soundOff, 0, __ATOMIC_RELAXED);
+ }
+
+ if (__atomic_load_n(&p->send, __ATOMIC_ACQUIRE)) {
+  int offset = p->at - start;
+  if (offset < 0) { // (too late for that frame: it goes now, and counts from now)
+   offset = 0;
+   p->at = p->listenFrom = start;
+  }
+  if (offset < nframes) {
+   if (p->path == PATH_JACK) {
+    unsigned char noteOn[3] = {0x90, g_note, 127};
+    jack_midi_event_write(midi, offset, noteOn, 3);
+   }
+   else p->clickLeft = CLICK_FRAMES;
+   __atomic_store_n(&p->listening, 1, __ATOMIC_RELEASE);
+   __atomic_store_n(&p->send, 0, __ATOMIC_RELAXED);
+  }
+ }
+ if (p->clickLeft) {
+  int offset = (int)(p->at - start) > 0 ? p->at - start : 0;
+  for (i=offset; i<nframes && p->clickLeft; i++, p->clickLeft--) out[i] = 0.5;
+ }
+
+ int listening = __atomic_load_n(&p->listening, __ATOMIC_ACQUIRE);
+ for (i=0; i<nframes; i++) {
+  if (fabsf(in[i]) <= g_threshold) continue;
+  __atomic_store_n(&p->lastLoud, start+i, __ATOMIC_RELAXED);
+  if (listening && !p->heard && (int)(start+i - p->listenFrom) >= 0) {
+   p->onset = start+i;
+   __atomic_store_n(&p->heard, 1, __ATOMIC_RELEASE);
+  }
+ }
+ return 0;
+}
+
+// function for dealing with jack shutting down on you
+void My_JackShutdown (void *arg)
+{
+ fprintf (stderr, "JACK shut down\n");
+ exit (1);
+}
+
+
+
+// empties the program's terminal, so it never blocks writing to it
+void* DrainPty (void *arg)
+{
+ char junk[4096];
+ while (read(g_pty, junk, sizeof(junk)) > 0);
+ return NULL;
+}
+
+// starts the program in a pseudo-terminal. returns its pid, or -1
+pid_t StartProgram(char *argv[])
+{
+ pid_t pid = forkpty(&g_pty, NULL, NULL, NULL);
+ if (pid < 0) { perror("forkpty"); return -1; }
+ if (pid == 0) {
+  setenv("TERM", "xterm", 0); // (snappy-drums opens an xterm if there's no TERM)
+  execvp(argv[0], argv);
+  perror(argv[0]);
+  _exit(127);
+ }
+ pthread_t drainThread;
+ pthread_create(&drainThread, NULL, DrainPty, NULL);
+ return pid;
+}
+
+// waits up to 'seconds' for a JACK port to show up. returns 0 if it did
+int WaitForPort(const char *name, double seconds)
+{
+ int i;
+ for (i=0; i<seconds*100; i++) {
+  if (jack_port_by_name(g_client, name)) return 0;
+  usleep(10000);
+ }
+ return -1;
+}
+
+// a sequencer port, connected to the program's. returns 0 if it worked
+int OpenAlsa()
+{
+ snd_seq_addr_t dest;
+ int i;
+ if (snd_seq_open(&g_seq, "default", SND_SEQ_OPEN_OUTPUT, 0) < 0) {
+  g_seq = NULL;
+  return -1;
+ }
+ snd_seq_set_client_name(g_seq, "latency-probe");
+ g_seqPort = snd_seq_create_simple_port(g_seq, "latency-probe",
+  SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ, SND_SEQ_PORT_TYPE_APPLICATION);
+ for (i=0; i<200; i++) { // (the program makes its port after its JACK ports)
+  if (snd_seq_parse_address(g_seq, &dest, g_alsaClient) == 0
+      && snd_seq_connect_to(g_seq, g_seqPort, dest.client, dest.port) == 0) return 0;
+  usleep(10000);
+ }
+ snd_seq_close(g_seq);
+ g_seq = NULL;
+ return -1;
+}
+
+static double Seconds(jack_nframes_t frames) { return (double)frames / g_sampleRate; }
+
+// connects the probe's way into the program for a path (none for alsa
+// and key), and disconnects the other one, so the graph only has a loop
+// in it when the path goes around one. returns 0 if it worked
+int ConnectPath(int path)
+{
+ if (g_midiPort && *g_midiPort) jack_disconnect(g_client, jack_port_name(g_midiOut), g_midiPort);
+ if (g_inputPort) jack_disconnect(g_client, jack_port_name(g_audioOut), g_inputPort);
+ if (path == PATH_JACK) return jack_connect(g_client, jack_port_name(g_midiOut), g_midiPort);
+ if (path == PATH_AUDIO) return jack_connect(g_client, jack_port_name(g_audioOut), g_inputPort);
+ return 0;
+}
+
+// waits until the output has been quiet for g_quietMs. returns 0 if it was
+int WaitForQuiet()
+{
+ jack_nframes_t quiet = g_quietMs * g_sampleRate / 1000;
+ jack_nframes_t began = jack_frame_time(g_client);
+ while (1) {
+  jack_nframes_t now = jack_frame_time(g_client);
+  if (now - __atomic_load_n(&g_probe.lastLoud, __ATOMIC_RELAXED) > quiet) return 0;
+  if (Seconds(now - began) > QUIET_TIMEOUT) return -1;
+  usleep(1000);
+ }
+}
+
+// sends one trigger and waits for it to be heard. returns the latency in
+// frames, or -1 if nothing came out
+long Trigger(int path)
+{
+ Probe *p = &g_probe;
+ p->path = path;
+ p->heard = 0;
+ usleep(rand() % (1000000 * g_period / g_sampleRate)); // (somewhere in the period)
+ jack_nframes_t now = jack_frame_time(g_client);
+ if (path == PATH_JACK || path == PATH_AUDIO) {
+  p->at = p->listenFrom = now + 2*g_period + rand() % g_period;
+  __atomic_store_n(&p->send, 1, __ATOMIC_RELEASE);
+ }
+ else {
+  p->listenFrom = now;
+  __atomic_store_n(&p->listening, 1, __ATOMIC_RELEASE);
+  if (path == PATH_ALSA) {
+   snd_seq_event_t ev;
+   snd_seq_ev_clear(&ev);
+   snd_seq_ev_set_source(&ev, g_seqPort);
+   snd_seq_ev_set_subs(&ev);
+   snd_seq_ev_set_direct(&ev);
+   snd_seq_ev_set_noteon(&ev, 0, g_note, 127);
+   snd_seq_event_output_direct(g_seq, &ev);
+  }
+  else {
+   char key = g_key;
+   write(g_pty, &key, 1);
+  }
+ }
+ while (!__atomic_load_n(&p->heard, __ATOMIC_ACQUIRE)
+        && Seconds(jack_frame_time(g_client) - now) < HEAR_TIMEOUT) usleep(500);
+ __atomic_store_n(&p->listening, 0, __ATOMIC_RELAXED);
+ if (path == PATH_ALSA) {
+  snd_seq_event_t ev;
+  snd_seq_ev_clear(&ev);
+  snd_seq_ev_set_source(&ev, g_seqPort);
+  snd_seq_ev_set_subs(&ev);
+  snd_seq_ev_set_direct(&ev);
+  snd_seq_ev_set_noteoff(&ev, 0, g_note, 0);
+  snd_seq_event_output_direct(g_seq, &ev);
+ }
+ __atomic_store_n(&p->soundOff, 1, __ATOMIC_RELEASE);
+ if (!__atomic_load_n(&p->heard, __ATOMIC_ACQUIRE)) return -1;
+ return (int)(p->onset - p->listenFrom);
+}
+
+// the delay JACK puts on a loop in its graph, measured with a click from
+// the probe's output straight into its input (the program's output is
+// disconnected for it). returns the least of a few tries, in frames, or -1
+long LoopDelay()
+{
+ const char *in = jack_port_name(g_audioIn), *out = jack_port_name(g_audioOut);
+ long delay = -1;
+ int i;
+ jack_disconnect(g_client, g_capturePort, in);
+ if (jack_connect(g_client, out, in) == 0) {
+  for (i=0; i<5; i++) {
+   if (WaitForQuiet()) break;
+   long frames = Trigger(PATH_AUDIO);
+   if (frames >= 0 && (delay < 0 || frames < delay)) delay = frames;
+  }
+  jack_disconnect(g_client, out, in);
+ }
+ jack_connect(g_client, g_capturePort, in);
+ return delay;
+}
+
+static int CompareLongs(const void *a, const void *b)
+{
+ long d = *(const long*)a - *(const long*)b;
+ return (d > 0) - (d < 0);
+}
+
+// measures one path, and prints a line of results. 'loopDelay' comes off
+// each measurement
+void Measure(int path, int count, long loopDelay, FILE *csv)
+{
+ long latencies[count];
+ int i, n = 0, missed = 0;
+ for (i=0; i<count; i++) {
+  if (WaitForQuiet()) {
+   fprintf(stderr, "%s: the output never went quiet (try a higher -l)\n", g_pathNames[path]);
+   break;
+  }
+  long frames = Trigger(path);
+  if (frames < 0) { missed++; continue; }
+  frames -= loopDelay;
+  latencies[n++] = frames;
+  if (csv) fprintf(csv, "%s,%ld,%.3f\n", g_pathNames[path], frames, 1000*Seconds(frames));
+ }
+ printf("%-6s %5d", g_pathNames[path], n);
+ if (n) {
+  qsort(latencies, n, sizeof(long), CompareLongs);
+  long p99 = latencies[(int)ceil(0.99*n) - 1];
+  printf(" %8.3f %8.3f %8.3f %8.3f",
+         1000*Seconds(latencies[0]), 1000*Seconds(latencies[n/2]),
+         1000*Seconds(p99), 1000*Seconds(latencies[n-1]));
+ }
+ if (missed) printf("   (%d never heard)", missed);
+ printf("\n");
+ fflush(stdout);
+}
+
+
+
+int main (int argc, char *argv[])
+{
+ int paths[NUM_PATHS], npaths = 0;
+ int count = 200;
+ const char *csvFile = NULL;
+ int opt, i;
+ while ((opt = getopt(argc, argv, "t:n:m:a:i:c:N:k:l:q:o:")) != -1) switch (opt) {
+ case 't':
+  for (i=0; i<NUM_PATHS && strcmp(optarg, g_pathNames[i]); i++);
+  if (i == NUM_PATHS) { fprintf(stderr, "no trigger path called %s\n", optarg); return 1; }
+  if (npaths < NUM_PATHS) paths[npaths++] = i;
+ break;
+ case 'n': count = atoi(optarg); break;
+ case 'm': g_midiPort = optarg; break;
+ case 'a': g_alsaClient = optarg; break;
+ case 'i': g_inputPort = optarg; break;
+ case 'c': g_capturePort = optarg; break;
+ case 'N': g_note = atoi(optarg) & 127; break;
+ case 'k': g_key = optarg[0]; break;
+ case 'l': g_threshold = atof(optarg); break;
+ case 'q': g_quietMs = atoi(optarg); break;
+ case 'o': csvFile = optarg; break;
+ default:
+  fprintf(stderr, "usage: %s [-t jack|alsa|key|audio ...] [-n count] [-m midiport] [-a alsaclient]\n"
+                  "          [-i inputport] [-c outputport] [-N note] [-k key] [-l level] [-q ms]\n"
+                  "          [-o file.csv] [-- program [args ...]]\n", argv[0]);
+  return 1;
+ }
+ if (count < 1) count = 1;
+
+ // set up the probe's own JACK client
+ if ((g_client = jack_client_open("latency-probe", JackNullOption, NULL)) == 0) {
+  fprintf(stderr, "-- You must start JACK before running this program. --\n");
+  return 1;
+ }
+ jack_set_process_callback (g_client, My_Process, 0);
+ jack_on_shutdown (g_client, My_JackShutdown, 0);
+ g_midiOut = jack_port_register (g_client, "midi_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+ g_audioOut = jack_port_register (g_client, "out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+ g_audioIn = jack_port_register (g_client, "in", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+ g_sampleRate = jack_get_sample_rate(g_client);
+ g_period = jack_get_buffer_size(g_client);
+ if (jack_activate (g_client)) {
+  fprintf (stderr, "cannot activate client\n");
+  return 1;
+ }
+
+ // start the program, if there is one, and wait for its output
+ pid_t pid = 0;
+ if (optind < argc && (pid = StartProgram(argv + optind)) < 0) return 1;
+ if (WaitForPort(g_capturePort, 10)) {
+  fprintf(stderr, "no port called %s (see -c)\n", g_capturePort);
+  if (pid > 0) kill(pid, SIGTERM);
+  return 1;
+ }
+
+ // listen to the program, and see what ways in there are (the probe's
+ // outputs only get connected to it path by path: see ConnectPath)
+ int can[NUM_PATHS] = {0};
+ jack_connect(g_client, g_capturePort, jack_port_name(g_audioIn));
+ can[PATH_JACK] = g_midiPort && *g_midiPort && !WaitForPort(g_midiPort, 1);
+ can[PATH_AUDIO] = g_inputPort && !WaitForPort(g_inputPort, 1);
+ can[PATH_ALSA] = g_alsaClient && *g_alsaClient && !OpenAlsa();
+ can[PATH_KEY] = (g_pty >= 0);
+ if (npaths == 0) {
+  for (i=0; i<NUM_PATHS; i++) if (can[i] && i != PATH_AUDIO) paths[npaths++] = i;
+  if (npaths == 0 && can[PATH_AUDIO]) paths[npaths++] = PATH_AUDIO;
+ }
+ sleep(1); // (let the program finish starting up)
+
+ FILE *csv = NULL;
+ if (csvFile) {
+  if (!(csv = fopen(csvFile, "w"))) perror(csvFile);
+  else fprintf(csv, "path,frames,ms\n");
+ }
+ printf("# %u Hz, %u frames per period (%.3f ms); latency in ms\n",
+        g_sampleRate, g_period, 1000*Seconds(g_period));
+ long loopDelay = 0;
+ for (i=0; i<npaths; i++) if (paths[i] == PATH_JACK || paths[i] == PATH_AUDIO) {
+  loopDelay = LoopDelay();
+  if (loopDelay >= 0)
+   printf("# the probe's own loop delay, %ld frames (%.3f ms), is taken off the jack and audio paths\n",
+          loopDelay, 1000*Seconds(loopDelay));
+  else {
+   printf("# couldn't measure the probe's own loop delay: the jack and audio paths\n"
+          "# include it (usually a period)\n");
+   loopDelay = 0;
+  }
+  break;
+ }
+ printf("# path  count      min   median      p99      max\n");
+ for (i=0; i<npaths; i++) {
+  if (!can[paths[i]] || ConnectPath(paths[i])) {
+   printf("%-6s   (no way in: see the options)\n", g_pathNames[paths[i]]);
+   continue;
+  }
+  int loops = (paths[i] == PATH_JACK || paths[i] == PATH_AUDIO);
+  Measure(paths[i], count, loops ? loopDelay : 0, csv);
+ }
+ if (csv) fclose(csv);
+
+ // done: ask the program to quit, like a person would (ESC twice)
+ jack_client_close (g_client);
+ if (g_seq) snd_seq_close (g_seq);
+ if (pid > 0) {
+  write(g_pty, "\033\033", 2);
+  for (i=0; i<100 && waitpid(pid, NULL, WNOHANG) == 0; i++) usleep(10000);
+  if (i == 100) {
+   kill(pid, SIGTERM);
+   waitpid(pid, NULL, 0);
+  }
+ }
+ return 0;
+}
@@ -5,7 +5,65 @@
  --
 
  To compile this:
-    gcc snappy-drums.c -lpthread -lm -ljack -lcurses -lasound -O3 -ffast-math -o snappy-drums
+    gcc snappy-drums.c snappy-engine.c -lpthread -lm -ljack -lcurses -lasound -O3 -ffast-math -o snappy-drums
+
+ or, for a board without an FPU, with the sound generators in fixed point:
+    gcc -DSNAPPY_FIXED snappy-drums.c snappy-engine.c -lpthread -lm -ljack -lcurses -lasound -O3 -o snappy-drums
+
+ To render a MIDI file to a WAV file (no JACK needed):
+    ./snappy-drums --render [-r samplerate] [-b 16|24|32] [-p period] song.mid song.wav
+
+ To time each instrument (no JACK needed; prints CSV):
+    ./snappy-drums --bench [-r samplerate] [-b buffersize] [-d seconds] [-k kits] [generator ...]
+
+ To check that the sound hasn't changed, against reference renders
+ (no JACK needed; -w writes the references), or against their checksums:
+    ./snappy-drums --golden [-w] [-r samplerate] [-e tolerance] dir [case ...]
+    ./snappy-drums --golden golden-sums.txt
+
+ To export one-shots of every sound as WAV files, with an index.json
+ (no JACK needed):
+    ./snappy-drums --export [-r samplerate] [-b 24|32] [-j jobs] [-V velocities]
+                   [-C controller=values ...] [-n noteseconds] [-l maxseconds] dir [kind ...]
+
+ Options for any mode:
+    -v voices    how many tone drums/aux tones can ring at once (default 8)
+    -g all       tone drums cut each other off, so do aux tones (default)
+    -g channel   tone drums only cut off others on the same MIDI channel
+    -g none      nothing gets cut off, until all the voices are used up
+    -s seed      the same seed always gives the same noise (default 1)
+    -c ms        how much of each tone drum hit to keep pre-rendered
+                 (default 250; 0 turns the cache off)
+
+ Options for JACK mode:
+    -m           multi-out: besides "out" (the mix), each instrument family
+                 gets its own port: tonedrums, claps, hihats, auxtones,
+                 cowbell and cymbal
+    -S file      keep live stats (DSP load, xruns, voices) in this file,
+                 rewritten every second
+    -k kits      host this many independent kits (up to 16), each with its
+                 own ports (kit1_midi_in, kit1_out, ...), rendering in
+                 parallel on worker threads; "out" is the mix
+    -B           with -k, render all the kits together on the JACK thread,
+                 a kit in each lane of the vectors, instead of on threads
+                 (cheaper for lots of small kits on a few CPUs)
+    -P file      play the patterns in this file with the built-in step
+                 sequencer (space starts & stops it, tab picks the next
+                 pattern, backslash reloads the file)
+    -T           the sequencer follows JACK transport
+    -D socket    daemon mode: no xterm, no curses; take commands (notes,
+                 controllers, the sequencer, stats) from local programs
+                 through this Unix domain socket, and quit on SIGTERM
+    -R file.wav  record "out" to this file (32 bit float), and each of the
+                 other output ports to file-<port>.wav, until it quits
+    -A periods   render the first kit this many periods ahead (up to 31)
+                 on a worker thread, so the JACK thread only has to copy
+                 it, until MIDI or anything else the sequencer's patterns
+                 don't already say comes along
+    -F dir       flight recorder: always keep the last few seconds of
+                 "out", the MIDI and keys that came in, and how long each
+                 callback took, and write them all to dir (a WAV file and
+                 a JSON timeline) after an xrun, or on SIGUSR1
 
 
  Copyright 2019, Elie Goldman Smith
@@ -24,100 +82,484 @@
  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 ***/
 
+#define _GNU_SOURCE // for pthread_setaffinity_np()
 #include <alsa/asoundlib.h>
-#include <ctype.h>
 #include <curses.h>
 #include <jack/jack.h>
+#include <jack/midiport.h>
+#include <jack/thread.h>
+#include <ctype.h>
+#include <errno.h>
 #include <math.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/times.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc()
+#endif
+#include "snappy-engine.h" // the sound engine
 
 // macros etc to make code look cleaner
-typedef jack_default_audio_sample_t sample_t;
 #define STATE(b)   ((b)?"ON":"OFF")
-#define MIDI_TO_FREQ(m)  (440*pow(2, 0.08333333333333333*((m)-69)))
-#define isSubnormalF(f)  ((*(unsigned*)&(f) & 0x7F800000) == 0)
 
 // constants
 #define CLIENT_NAME "snappy"
-#define LOW_FREQUENCY_ROLLOFF 46 // hz    
-#define LOW_FREQUENCY_CUTOFF 39 // hz        or try 48.8hz and 41.4hz
-// default controller values
-// note: most globals don't reset to these, but rather to a number based on these.
-#define DCV_CLAP 0.00025 // or try 0.0004 but comment out //ca *= g_clapDecayFactor;
-#define DCV_HH 0.001
-#define DCV_DECAY 0.04
-#define DCV_SWEEP_SPEED 7
-#define DCV_AUX_DECAY 0.02
-#define DCV_AUX_RELEASE 0.14
-#define DCV_CYMBAL 0.001
-#define DCV_COWBELL 0.004
 
 // Important Globals
 
 snd_seq_t* g_seqHandle; // ALSA midi handle
 jack_client_t* g_client;   // JACK
 jack_port_t* g_outputPort; // globals
+jack_port_t* g_midiPort;   // JACK MIDI input (ALSA MIDI works too)
+
+const char *g_busNames[NUM_BUSES] = {"tonedrums", "claps", "hihats", "auxtones", "cowbell", "cymbal"};
+jack_port_t* g_busPorts[NUM_BUSES];
+int g_multiOut = 0; // boolean
+
+// live stats, for a monitor to read from a file (see StatsThread).
+// only the audio threads write the timings (each kit its own), with relaxed
+// atomic stores, so they cost a few clock reads and nothing else.
+#define LOAD_BUCKETS  12 // callback time in steps of 10% of the period; the last is 110%+
+const char *g_statsNames[NUM_STATS] = {"voices", "claps_hats", "cowbell", "cymbal"};
+typedef struct {
+ unsigned long long callbacks;
+ unsigned long long frames;
+ unsigned long long sectionNs[NUM_STATS]; // totals, over all the kits
+ unsigned long long callbackNs;           // total
+ unsigned long long maxCallbackNs;
+ unsigned long long load[LOAD_BUCKETS];   // histogram
+ unsigned long long xruns;
+ unsigned long long jackErrors;
+ unsigned long long recordDropped;        // frames the disk recorder had no room for
+ unsigned long long flightNs;             // total time the flight recorder took
+ int activeVoices, maxActiveVoices;
+ int period;
+} Stats;
+Stats g_stats;
+const char *g_statsFile = NULL; // the stats file, if any
+int g_keepStats = 0; // no timing at all unless this is set (by -S, -D or -F)
+const char *g_recordFile = NULL; // set with -R
+int g_aheadPeriods = 0; // set with -A (0 is off)
+const char *g_flightDir = NULL; // set with -F
 
 long g_sampleRate = -1;
-char g_keys[128]; // keyboard character -> midi note
-int g_qw[128]; // midi note -> quarter wavelength
-int g_quarterWaveFade = 275; // used for removing frequencies that are too low
-int g_quarterWaveMax = 300;  //
 int g_initialized = 0; // flag to tell My_Process and WaitOnMIDI that we're ready
-sample_t g_masterVolume = 1.0;
-
-// tone drums
-volatile int g_newToneDrum = 0;
-volatile int g_tdQuarterWave = 100;
-volatile int g_tdSweepSpeed = DCV_SWEEP_SPEED;
-volatile sample_t g_tdDecayFactor = -1.0+DCV_DECAY;
-volatile sample_t g_tdNoisiness = 0;
-volatile sample_t g_tdVolume = 0.5;
-
-// claps
-volatile int g_newClap = 0; // boolean
-volatile sample_t g_clapDecayFactor = 1.0-DCV_CLAP;
-volatile sample_t g_clapVolume = 0.2;
-
-// high hats
-volatile int g_newHighHat = 0; // boolean
-volatile sample_t g_hhDecayFactor = 1.0-DCV_HH;
-volatile sample_t g_hhVolume = 0.2;
-
-// auxillary tones
-volatile int g_newAuxTone = 0; // boolean
-volatile int g_atQuarterWave = 50;
-volatile sample_t g_atDecayFactor = -1.0+DCV_AUX_DECAY;
-volatile sample_t g_atVolume = 0.2;
-
-// cowbells
-volatile int g_newCowbell = 0; // boolean
-volatile int g_cbWaveScale = 4;
-volatile sample_t g_cbDecayFactor = 1.0-DCV_COWBELL;
-volatile sample_t g_cbVolume = 0.5;
-
-// cymbals
-#define CYMBAL_N 6 // number of tones (square waves)
-volatile int g_newCymbal = 0; // boolean
-volatile int g_cymTones[CYMBAL_N] = {3, 4, 7, 11, 18, 29}; // half wavelengths
-volatile sample_t g_cymDecayFactor = 1.0-DCV_CYMBAL;
-volatile sample_t g_cymVolume = 0.2;
 
+// the kits. each one is a whole drum machine (see snappy-engine.h):
+// normally there's just one, but with -k the program hosts several, each
+// with its own MIDI input and output ports
+#define MAX_KITS 16
+Kit g_kits[MAX_KITS];
+int g_numKits = 1; // set with -k
+KitSettings g_kitSettings = DEFAULT_KIT_SETTINGS; // from the command line
+
+
+
+// STEP SEQUENCER
+// plays patterns from a pattern file (-P) on the first kit. it runs in the
+// audio callback and counts frames, so each step lands on its exact sample,
+// with no MIDI thread in between. see the manpage for the file format.
+
+#define SEQ_MAX_PATTERNS 16
+#define SEQ_MAX_TRACKS   16 // per pattern
+#define SEQ_MAX_STEPS    64 // per pattern
+
+typedef struct {
+ int channel, note;
+ unsigned char velocity[SEQ_MAX_STEPS]; // 0 is a rest
+} SeqTrack;
+
+typedef struct {
+ int ntracks;
+ SeqTrack tracks[SEQ_MAX_TRACKS];
+} SeqPattern;
+
+// everything in a pattern file
+typedef struct {
+ double tempo;     // beats per minute
+ double swing;     // where the off-beat steps land: 0.5 is straight, 0.67 is triplets
+ int stepsPerBeat;
+ int steps;        // steps per pattern
+ int npatterns;
+ SeqPattern patterns[SEQ_MAX_PATTERNS];
+} PatternBank;
+
+// a new pattern bank (from reloading the file) or a new pattern (from the
+// keyboard or a program change) gets handed over to the audio thread, which
+// switches to it at the start of the next bar, so nothing gets cut short
+typedef struct {
+ const char *fileName;
+ int followTransport; // -T: play along with JACK transport
+ PatternBank *bank;    // playing now (only the audio thread touches these,
+ int pattern;          // up to the next comment)
+ int playing;
+ long long frame;      // frames since the sequencer started, or the transport frame
+ long long origin;     // the frame where step 0 is (or was)
+ long long step;       // the next step to play, counted from step 0
+ double tempo;
+ double framesPerStep;
+ int nreleases;        // aux tones that get a note-off at the next step
+ unsigned char releases[SEQ_MAX_TRACKS];
+ PatternBank *newBank; // handed over to the audio thread,
+ PatternBank *oldBank; // and handed back when it's done with it
+ int nextPattern;
+ int run;              // the keyboard (or the control socket) starts & stops it
+} Sequencer;
+Sequencer g_seq;
+
+// returns NULL (after saying what's wrong) if the file is no good
+PatternBank* LoadPatterns(const char *fileName)
+{
+ FILE *file = fopen(fileName, "r");
+ if (!file) {
+  perror(fileName);
+  return NULL;
+ }
+ PatternBank *pb = calloc(1, sizeof(PatternBank));
+ pb->tempo = 120;
+ pb->swing = 0.5;
+ pb->stepsPerBeat = 4;
+ pb->steps = 16;
+ SeqPattern *p = NULL;
+ char line[256];
+ int lineNo = 0, bad = 0;
+ while (!bad && fgets(line, sizeof(line), file)) {
+  lineNo++;
+  char *comment = strchr(line, '#');
+  if (comment) *comment = '\0';
+  char word[32];
+  int len;
+  if (sscanf(line, " %31s%n", word, &len) < 1) continue; // blank line
+  char *rest = line + len;
+  if      (!strcmp(word, "tempo")) bad = (pb->tempo = atof(rest)) < 1;
+  else if (!strcmp(word, "swing")) bad = (pb->swing = atof(rest)) < 0.25 || pb->swing > 0.75;
+  else if (!strcmp(word, "beat"))  bad = (pb->stepsPerBeat = atoi(rest)) < 1;
+  else if (!strcmp(word, "steps"))
+   bad = (pb->steps = atoi(rest)) < 1 || pb->steps > SEQ_MAX_STEPS;
+  else if (!strcmp(word, "pattern")) {
+   if (pb->npatterns >= SEQ_MAX_PATTERNS) bad = 1;
+   else p = &pb->patterns[pb->npatterns++];
+  }
+  else if (isdigit(word[0])) {
+   // a track: "note" or "channel:note", then one character per step
+   int channel = 1, note;
+   if (sscanf(word, "%d:%d", &channel, &note) < 2) { note = channel; channel = 1; }
+   if (channel < 1 || channel > 16 || note < 0 || note > 127) { bad = 1; continue; }
+   if (!p) p = &pb->patterns[pb->npatterns++];
+   if (p->ntracks >= SEQ_MAX_TRACKS) { bad = 1; continue; }
+   SeqTrack *t = &p->tracks[p->ntracks++];
+   t->channel = channel-1;
+   t->note = note;
+   int step = 0;
+   for (; *rest && !bad; rest++) {
+    if (isspace(*rest)) continue;
+    if (step >= SEQ_MAX_STEPS) bad = 1;
+    else if (*rest == '.' || *rest == '-') t->velocity[step++] = 0;
+    else if (*rest == 'x') t->velocity[step++] = 100;
+    else if (*rest == 'X') t->velocity[step++] = 127;
+    else if (*rest >= '1' && *rest <= '9') t->velocity[step++] = ((*rest-'0')*127 + 4) / 9;
+    else bad = 1;
+   }
+  }
+  else bad = 1;
+ }
+ fclose(file);
+ if (bad) fprintf(stderr, "%s, line %d: can't make sense of this\n", fileName, lineNo);
+ else if (pb->npatterns == 0) {
+  fprintf(stderr, "%s: no patterns in here\n", fileName);
+  bad = 1;
+ }
+ if (bad) {
+  free(pb);
+  return NULL;
+ }
+ return pb;
+}
+
+static PatternBank* AheadDroppedBank(void); // (render ahead)
+
+// loads the pattern file again (from the keyboard's thread). the audio
+// thread picks up the new patterns at the next bar. returns -1 on error
+int ReloadPatterns(Sequencer *sq)
+{
+ PatternBank *pb = LoadPatterns(sq->fileName);
+ if (!pb) return -1;
+ // the old bank, once nothing plays it: with -A, the worker's plan can
+ // still be using it after the audio thread has moved on
+ free(g_aheadPeriods ? AheadDroppedBank() : __atomic_exchange_n(&sq->oldBank, NULL, __ATOMIC_ACQUIRE));
+ free(__atomic_exchange_n(&sq->newBank, pb, __ATOMIC_ACQ_REL)); // (if never picked up)
+ return 0;
+}
+
+// picks the pattern to play from the next bar on (0 is the first)
+void SelectPattern(Sequencer *sq, int pattern)
+{
+ __atomic_store_n(&sq->nextPattern, pattern, __ATOMIC_RELAXED);
+}
+
+// starts (run=1) or stops (run=0) the sequencer, or JACK transport if the
+// sequencer follows it
+void SeqRun(Sequencer *sq, int run)
+{
+ if (!sq->followTransport) __atomic_store_n(&sq->run, run, __ATOMIC_RELAXED);
+ else if (run) jack_transport_start(g_client);
+ else jack_transport_stop(g_client);
+}
+
+static long long SeqStepFrame(const Sequencer *sq, long long step)
+{
+ double f = step * sq->framesPerStep;
+ if (step & 1) f += (2*sq->bank->swing - 1) * sq->framesPerStep; // swing
+ return sq->origin + (long long)(f + 0.5);
+}
+
+static void SeqSetTempo(Sequencer *sq, double tempo)
+{
+ sq->tempo = tempo;
+ sq->framesPerStep = g_sampleRate * 60.0 / (tempo * sq->bank->stepsPerBeat);
+}
+
+static void SeqReleaseNotes(Sequencer *sq, Kit *k, int frame)
+{
+ int i;
+ for (i=0; i<sq->nreleases; i++) ScheduleMIDI(k, frame, MIDI_NOTEOFF, 15, sq->releases[i], 0);
+ sq->nreleases = 0;
+}
+
+// copies the part of the sequencer that only the audio thread touches
+static void SeqCopyPlaying(Sequencer *to, const Sequencer *from)
+{
+ to->bank = from->bank;
+ to->pattern = from->pattern;
+ to->playing = from->playing;
+ to->frame = from->frame;
+ to->origin = from->origin;
+ to->step = from->step;
+ to->tempo = from->tempo;
+ to->framesPerStep = from->framesPerStep;
+ to->nreleases = from->nreleases;
+ memcpy(to->releases, from->releases, sizeof(to->releases));
+}
+
+// whether the sequencer should be running this period: its run flag, or
+// JACK transport (with where it is in pos) if it's following that
+static int SeqQuery(Sequencer *sq, jack_position_t *pos)
+{
+ if (!sq->followTransport) return __atomic_load_n(&sq->run, __ATOMIC_RELAXED);
+ return jack_transport_query(g_client, pos) == JackTransportRolling;
+}
+
+static double SeqTransportTempo(const Sequencer *sq, const jack_position_t *pos)
+{
+ return (pos->valid & JackPositionBBT) ? pos->beats_per_minute : sq->bank->tempo;
+}
+
+// starts or stops playing, and keeps in step with JACK transport if it's
+// following it. called at the start of each period with what SeqQuery()
+// said (audio thread only)
+static void SeqStartPeriod(Sequencer *sq, Kit *k, int run, const jack_position_t *pos)
+{
+ if (!sq->followTransport) {
+  if (run && !sq->playing) { // step 0 is the first frame of this period
+   sq->origin = sq->frame;
+   sq->step = 0;
+   SeqSetTempo(sq, sq->bank->tempo);
+  }
+ }
+ else {
+  double tempo = SeqTransportTempo(sq, pos);
+  if (run && (!sq->playing || pos->frame != sq->frame || tempo != sq->tempo)) {
+   // the transport started, jumped or changed tempo, so find out which
+   // step it's at: from bars & beats if it has them, else from the frame
+   SeqSetTempo(sq, tempo);
+   double steps = pos->frame / sq->framesPerStep;
+   if (pos->valid & JackPositionBBT)
+    steps = ((pos->bar-1)*pos->beats_per_bar + (pos->beat-1) + pos->tick/pos->ticks_per_beat)
+            * sq->bank->stepsPerBeat;
+   sq->origin = pos->frame - (long long)(steps * sq->framesPerStep + 0.5);
+   sq->step = ceil(steps - 0.001);
+   sq->frame = pos->frame;
+  }
+ }
+ if (!run && sq->playing) SeqReleaseNotes(sq, k, 0);
+ sq->playing = run;
+}
+
+// returns where the next step is in this period, or nframes if it isn't
+static int SeqNextFrame(const Sequencer *sq, int nframes)
+{
+ if (!sq->playing) return nframes;
+ long long f = SeqStepFrame(sq, sq->step) - sq->frame;
+ if (f < 0) f = 0;
+ return f < nframes ? f : nframes;
+}
+
+// plays the next step on kit k, at this frame of the period (audio thread only)
+static void SeqPlayStep(Sequencer *sq, Kit *k, int frame)
+{
+ SeqReleaseNotes(sq, k, frame);
+ if (sq->step % sq->bank->steps == 0) {
+  // a new bar: time for any new patterns
+  PatternBank *pb = __atomic_exchange_n(&sq->newBank, NULL, __ATOMIC_ACQ_REL);
+  if (pb) {
+   __atomic_store_n(&sq->oldBank, sq->bank, __ATOMIC_RELEASE);
+   sq->origin = SeqStepFrame(sq, sq->step); // (the tempo might change)
+   sq->step = 0;
+   sq->bank = pb;
+   SeqSetTempo(sq, sq->followTransport ? sq->tempo : pb->tempo);
+  }
+  sq->pattern = __atomic_load_n(&sq->nextPattern, __ATOMIC_RELAXED) % sq->bank->npatterns;
+ }
+
+ const SeqPattern *p = &sq->bank->patterns[sq->pattern];
+ int i, s = sq->step % sq->bank->steps;
+ for (i=0; i<p->ntracks; i++) {
+  const SeqTrack *t = &p->tracks[i];
+  if (!t->velocity[s]) continue;
+  ScheduleMIDI(k, frame, MIDI_NOTEON, t->channel, t->note, t->velocity[s]);
+  if (t->channel == 15) sq->releases[sq->nreleases++] = t->note;
+ }
+ sq->step++;
+}
+
+
+
+
+// each kit's JACK ports, and the buffers they have this period. with one
+// kit these are just the global ports; with -k each kit has its own.
+// kits after the first render on their own worker threads (see KitThread),
+// unless -B renders them all together
+typedef struct {
+ jack_port_t *outPort, *midiPort;
+ jack_port_t *busPorts[NUM_BUSES]; // multi-out
+ int alsaPort; // ALSA MIDI input port number
+ sample_t *out, *bus[NUM_BUSES];
+ void *midi;
+ pthread_t thread;
+ sem_t go, done; // My_Process posts go, the kit's thread posts done
+} KitIO;
+KitIO g_kitIO[MAX_KITS];
+int g_batch = 0; // -B: all the kits render together on the JACK thread (see SynthesizeBatch)
+jack_nframes_t g_nframes; // size of the period the kit threads are working on
+jack_nframes_t g_periodFrame; // JACK's frame time at the start of it (for the flight recorder)
+
+// the flight recorder (see FLIGHT RECORDER): what set off a dump, and
+// what it calls the sequencer starting & stopping (MIDI's start & stop)
+#define FLIGHT_XRUN   1
+#define FLIGHT_SIGNAL 2
+#define FLIGHT_ASKED  4 // (a daemon command)
+#define FLIGHT_START  0xFA
+#define FLIGHT_STOP   0xFC
+static void FlightMIDI(int kit, jack_nframes_t frame, const unsigned char *msg, size_t size);
+static void FlightNote(int kit, int source, int status, int channel, int param, int value);
+static void FlightTrigger(int reason);
+
+// schedules a period's MIDI on a kit: the JACK MIDI events (if any), and
+// the sequencer's steps (if it plays on this kit; SeqStartPeriod() has to
+// be called first), right at their frame, in the order they happen
+static void SchedulePeriod(Kit *k, Sequencer *sq, void *midi, jack_nframes_t nframes)
+{
+ int nevents = midi ? jack_midi_get_event_count(midi) : 0;
+ int i;
+ for (i=0; i<=nevents; i++) {
+  jack_midi_event_t ev;
+  jack_nframes_t until = nframes;
+  if (i < nevents) {
+   if (jack_midi_event_get(&ev, midi, i)) continue;
+   if (ev.time < nframes) until = ev.time;
+  }
+  while (sq) { // the steps up to the event (a step on its frame goes first)
+   jack_nframes_t step = SeqNextFrame(sq, nframes);
+   if (step > until || step == nframes) break;
+   SeqPlayStep(sq, k, step);
+  }
+  if (i < nevents) {
+   if (g_flightDir) FlightMIDI(k - g_kits, g_periodFrame + until, ev.buffer, ev.size);
+   if ((ev.buffer[0] & 0xF0) == 0xC0 && ev.size > 1 && k == &g_kits[0]) // (the sequenced kit's input only)
+    SelectPattern(&g_seq, ev.buffer[1]);
+   ScheduleMIDIMessage(k, until, ev.buffer, ev.size);
+  }
+ }
+ if (sq) sq->frame += nframes;
+}
+
+// schedules one kit's part of the period, from the buffers in its KitIO
+// (the sequencer plays on the first kit)
+static void ScheduleKit(int n, jack_nframes_t nframes)
+{
+ Kit *k = &g_kits[n];
+ Sequencer *sq = (n == 0 && g_seq.bank) ? &g_seq : NULL;
+ if (sq) {
+  jack_position_t pos;
+  int run = SeqQuery(sq, &pos);
+  SeqStartPeriod(sq, k, run, &pos);
+ }
+ SchedulePeriod(k, sq, g_kitIO[n].midi, nframes);
+}
+
+// multi-out: each instrument family went straight into its own port,
+// so the kit's mix is the sum of them
+static void MixKit(int n, jack_nframes_t nframes)
+{
+ KitIO *io = &g_kitIO[n];
+ int i, j;
+ if (g_multiOut) for (i=0; i<nframes; i++) {
+  sample_t sum = 0;
+  for (j=0; j<NUM_BUSES; j++) sum += io->bus[j][i];
+  io->out[i] = sum;
+ }
+}
+
+// renders one kit's part of the period
+static void ProcessKit(int n, jack_nframes_t nframes)
+{
+ ScheduleKit(n, nframes);
+ SynthesizeBuses(&g_kits[n], g_kitIO[n].bus, nframes);
+ MixKit(n, nframes);
+}
+
+// a worker thread for one kit. it's pinned to a CPU, so the kit's state
+// stays in that CPU's cache from one period to the next
+void* KitThread (void *arg)
+{
+ int n = (KitIO*)arg - g_kitIO;
+ cpu_set_t cpus;
+ CPU_ZERO(&cpus);
+ CPU_SET(n % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+ pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+ ClaimKit(&g_kits[n]);
+ while (1) {
+  sem_wait(&g_kitIO[n].go);
+  ProcessKit(n, g_nframes);
+  sem_post(&g_kitIO[n].done);
+ }
+ return NULL;
+}
 
+static void RecordPeriod(const sample_t *out, unsigned nframes); // (the disk recorder)
+static void FlightPeriod(const sample_t *out, unsigned nframes, unsigned long long ns, int voices); // (the flight recorder)
+static void AheadProcess(jack_nframes_t nframes); // (render ahead)
+static const KitState* AheadKit(void);            //
 
 // all AUDIO INPUT AND OUTPUT code in this next function:
 int My_Process (jack_nframes_t nframes, void *arg)
 {
- // get the pointers to the in[] and out[] audio buffers
+ // get the pointer to the out[] audio buffer
  sample_t *out = (sample_t *) jack_port_get_buffer(g_outputPort, nframes);
- int i;
 
  // make sure we're ready
  if (!g_initialized) {
@@ -125,289 +567,75 @@ int My_Process (jack_nframes_t nframes, void *arg)
   return 0;
  }
 
- // make sure parameters are valid
- if (g_hhDecayFactor < 0) g_hhDecayFactor = -g_hhDecayFactor;
- if (g_hhDecayFactor > 1) g_hhDecayFactor = 1;
- if (g_clapDecayFactor < 0) g_clapDecayFactor = -g_clapDecayFactor;
- if (g_clapDecayFactor > 1) g_clapDecayFactor = 1;
- if (g_tdDecayFactor > 0) g_tdDecayFactor = -g_tdDecayFactor;
- if (g_tdDecayFactor < -1) g_tdDecayFactor = -1;
- if (g_tdQuarterWave < 1) g_tdQuarterWave = 1;
- if (g_tdNoisiness > g_tdQuarterWave-1) g_tdNoisiness = g_tdQuarterWave-1;
- if (g_tdSweepSpeed < 1) g_tdSweepSpeed = 1;
- if (g_atQuarterWave < 1) g_atQuarterWave = 1;
- if (g_atDecayFactor > 0) g_atDecayFactor = -g_atDecayFactor;
- if (g_atDecayFactor < -1) g_atDecayFactor = -1;
- if (g_cbDecayFactor < -1) g_cbDecayFactor = -1;
- if (g_cbDecayFactor > 1) g_cbDecayFactor = 1;
- if (g_cbWaveScale < 1) g_cbWaveScale = 1;
- if (g_cymDecayFactor < 0) g_cymDecayFactor = -g_cymDecayFactor;
- if (g_cymDecayFactor > 1) g_cymDecayFactor = 1;
-
-
- // Tone Drums
- static sample_t s = 0; // audio signal
- static sample_t ds = 0;// rate of change
- static int n = 1; // current number of samples in a line
- static int count = 1; // sample counter within a line
- static int lines = 6; // line counter (resets every few lines)
- static int plateau = 1; // boolean state: is line a plateau or a slope
- static int attack = 1; // boolean state: are we in the attack stage or the tone stage
- static sample_t a = 0; // current peak amplitude of wave; oscillates between + and -
- static sample_t fm = 0; // frequency modulation for noisiness
- static sample_t dfm = 0;// rate of change
- static sample_t lfRolloffSlope = 0.04;// used for removing frequencies that are too low
- static sample_t attf = 0; // for calcuating decays during sweep
-
- if (g_newToneDrum) {
-  g_newToneDrum = -1;
-  if      (s > 0) s = a = -g_tdVolume;   // polarity
-  else if (s < 0) s = a =  g_tdVolume;   //
-  else            s = a =  (rand()&1) ? -g_tdVolume : g_tdVolume;
-  ds = 0;
-  plateau = 1;
-  attack = 1;
-  lines = 6;
-  fm = dfm = 0;
-  lfRolloffSlope = 1.0 / (g_quarterWaveMax - g_quarterWaveFade);
-
-  count = n = g_tdSweepSpeed*2;
-  if (g_tdQuarterWave > g_quarterWaveMax) g_tdQuarterWave = g_quarterWaveMax;
-  attf = (g_tdDecayFactor + 1.0) / g_tdQuarterWave;
-
-  if (n < g_tdQuarterWave) {
-   // this is to correct for amplitude decay during sweep
-   a *= pow(-g_tdDecayFactor, 0.25 - 0.25 * g_tdQuarterWave / g_tdSweepSpeed);
-   s = a;
-  }
-  else count = n = g_tdQuarterWave;
- }
-
- // output loop
- if (a != 0 || s != 0 || ds != 0) {
-  for (i=0; i<nframes; i++) {
-   s += ds;
-   out[i] = s;
-   
-   /* uncomment this to add some nasty grit:
-   if      (s > fabs(a)*0.001) out[i] += fabs(a)*0.25;
-   else if (s < fabs(a)*0.001) out[i] -= fabs(a)*0.25; */
-
-   if (--count <= 0) {
-    if (attack) {
-     n += g_tdSweepSpeed;
-     if (n >= g_tdQuarterWave) attack = 0;
-    }
-    if (!attack) {
-     n = g_tdQuarterWave;
-     if (g_tdNoisiness) {
-      fm += dfm;
-      n += fm + 0.5;
-      if (n < 1) n = 1;
-      if (--lines <= 0) {
-       lines = 6;
-       dfm = (1.0/6.0) * (g_tdNoisiness*(rand()*(2.0/RAND_MAX)-1.0) - fm);
-      }
-     }
-    }
-    if (plateau) {
-     plateau = 0;
-
-     if (attack) a *= -1.0 + n*attf;
-     else a *= g_tdDecayFactor;
-
-     if    (n <= g_quarterWaveFade) ds = (a - s) / n;
-     else if (n < g_quarterWaveMax) ds = (a*(g_quarterWaveMax-n)*lfRolloffSlope - s) / n;
-     else ds = -s / n;
+ unsigned long long start = g_keepStats ? NowNs() : 0;
+
+ // every kit renders into its own buffers: its out port, or each of its
+ // bus ports in multi-out mode. (with one kit, its out port is "out")
+ int i, j, n;
+ for (n=0; n<g_numKits; n++) {
+  KitIO *io = &g_kitIO[n];
+  io->out = (sample_t *) jack_port_get_buffer(io->outPort, nframes);
+  for (j=0; j<NUM_BUSES; j++)
+   io->bus[j] = g_multiOut ? (sample_t *) jack_port_get_buffer(io->busPorts[j], nframes) : io->out;
+  io->midi = io->midiPort ? jack_port_get_buffer(io->midiPort, nframes) : NULL;
+ }
 
-     if (isSubnormalF(a)) a = 0;
-     if (isSubnormalF(s)) s = 0;
-     if (isSubnormalF(ds)) ds = 0;
-    }
-    else {
-     plateau = 1;
-     ds = 0;
-     if (isSubnormalF(s)) s = 0;
-    }
-    count = n;
-   }
+ // the other kits' threads get the whole period, same as this one,
+ // or with -B they all render right here, in the lanes of the vectors;
+ // then "out" is the mix of all the kits
+ g_nframes = nframes;
+ if (g_flightDir) g_periodFrame = jack_last_frame_time(g_client);
+ if (g_batch) {
+  Kit *kits[MAX_KITS];
+  sample_t **buses[MAX_KITS];
+  int first = g_aheadPeriods ? 1 : 0;
+  if (first) AheadProcess(nframes);
+  for (n=first; n<g_numKits; n++) {
+   ScheduleKit(n, nframes);
+   kits[n-first] = &g_kits[n];
+   buses[n-first] = g_kitIO[n].bus;
   }
+  SynthesizeBatch(kits, buses, g_numKits-first, nframes);
+  for (n=first; n<g_numKits; n++) MixKit(n, nframes);
  }
- else memset(out, 0, nframes*sizeof(sample_t));
-
-
- // Claps and High Hats
- static sample_t n0 = 0; // white noise buffer: 3 samples for simple convolutions
- static sample_t n1 = 0; //
- static sample_t n2 = 0; //
- static sample_t f1s = 0; // filter stage for clap noise
- static sample_t f2s = 0; // another filter stage for clap noise
- static sample_t f2c = 1; // filter coefficient for clap noise
- static int clapTicks = 0; // clap starts with some decaying 'ticks', each 512 samples
- static int clapTime = 512; // sample position within a clap tick
- static sample_t ca = 0; // clap amplitude
- static sample_t ha = 0; // high hat amplitude
-
- if (g_newClap) {
-  g_newClap = 0;
-  ca = g_clapVolume;
-  f2c = 1;
-  if (g_newToneDrum == -1) clapTicks = 0;
-  else                     clapTicks = 2;
-  clapTime = 512;
- }
- if (g_newHighHat) {
-  g_newHighHat = 0;
-  ha = g_hhVolume;
- }
-
- // output loop
- if (ca != 0 || ha != 0) {
-  for (i=0; i<nframes; i++) {
-   n2 = n1;
-   n1 = n0;
-   n0 = rand() * (2.0/RAND_MAX) - 1.0;
-
-   // clap
-   sample_t clapNoise = n0 + 2*n1 + n2 - f1s;
-   f1s += clapNoise * 0.008;
-   f2s += (clapNoise - f2s) * f2c;
-
-   if (clapTicks <= 0) {
-    out[i] += ca * f2s;
-    ca *= g_clapDecayFactor;
-   }
-   else {
-    out[i] += ca * f2s * (2.0/512.0/512.0/512.0)*clapTime*clapTime*clapTime;
-    if (--clapTime <= 0) {
-     clapTime = 512;
-     clapTicks--;
-    }
-   }
-   f2c *= g_clapDecayFactor;
-
-   // high hats
-   out[i] -= ha * (n0 - 2*n1 + n2);
-   ha *= g_hhDecayFactor;
-
-   // avoid subnormal numbers, because they could waste CPU cycles
-   if (isSubnormalF(ca)) ca = 0;
-   if (isSubnormalF(ha)) ha = 0;
-   if (isSubnormalF(f2c)) f2c = 0;
-  }
- }
-
- // Auxillary Tones
- static sample_t as = 0;
- static sample_t ads = 0;
- static sample_t aa = 0;
- static int acount = 0;
- static int aplateau = 0;
- if (g_newAuxTone) {
-  g_newAuxTone = 0;
-  if      (as > 0) aa =  g_atVolume;   // polarity
-  else if (as < 0) aa = -g_atVolume;   //
-  else             aa =  (rand()&1) ? -g_atVolume : g_atVolume;
-  acount = 0;
-  aplateau = 1;
- }
- if (aa != 0 || as != 0 || ads != 0) {
-  for (i=0; i<nframes; i++) {
-   as += ads;
-   out[i] += as;
-
-   if (--acount <= 0) {
-    acount = g_atQuarterWave;
-    if (aplateau) {
-     aplateau = 0;
-     aa *= g_atDecayFactor;
-     if (g_atQuarterWave < g_quarterWaveMax) ads = (aa - as) / acount;
-     else ads = -as / acount;
-     if (isSubnormalF(aa)) aa = 0;
-     if (isSubnormalF(as)) as = 0;
-     if (isSubnormalF(ads)) ads = 0;
-    }
-    else {
-     aplateau = 1;
-     ads = 0;
-     if (isSubnormalF(as)) as = 0;
-    }
-   }
-  }
+ else {
+  for (n=1; n<g_numKits; n++) sem_post(&g_kitIO[n].go);
+  if (g_aheadPeriods) AheadProcess(nframes);
+  else ProcessKit(0, nframes);
+  for (n=1; n<g_numKits; n++) sem_wait(&g_kitIO[n].done);
  }
- 
- // Cowbell
- {
-  // A mix of two slanted triangle-waves, with a frequency ratio of 2/3
-  // This is implemented as a line graph.
-  static const int N = 9;
-  static const int lengths[] = {2,1,5,2,2,3,1,2,6};
-  static const int slopes[] = {15, 3, -5, 7, -5, 3, -5, 7, -5};
-  static const int DC = 18;
-  static int s = -DC;
-  static int p = 0;
-  static int count = 2;
-  static sample_t a = 0;
-  if (g_newCowbell) {
-   g_newCowbell = 0;
-   p = 0;
-   count = lengths[0] * g_cbWaveScale;
-   s = -DC * g_cbWaveScale;
-   a = 0.04 * g_cbVolume / g_cbWaveScale; if (rand()&1) a = -a;
-  }
-  // output loop
-  if (a != 0 && g_cbWaveScale > 0 && g_cbWaveScale*3 <= g_quarterWaveFade) {
-   for (i=0; i<nframes; i++) {
-    out[i] += s*a;
-    s += slopes[p];
-    if (--count <= 0) {
-     if (++p >= N) p = 0;
-     count = lengths[p] * g_cbWaveScale;
-    }
-    a *= g_cbDecayFactor;
-    if (isSubnormalF(a)) a=0;
-   }
-  }
+ if (g_numKits > 1) for (i=0; i<nframes; i++) {
+  sample_t sum = 0;
+  for (n=0; n<g_numKits; n++) sum += g_kitIO[n].out[i];
+  out[i] = sum;
  }
 
- // Cymbal
- {
-  static int phases[CYMBAL_N];
-  static sample_t a = 0; // amplitude
-  static sample_t f = 1; // lowpass filter coefficient
-  static sample_t s = 0; // lowpass filter state
-  static sample_t s2 = 0; // highpass filter state
-  if (g_newCymbal) {
-   g_newCymbal = 0;
-   a = s = s2 = 0;
-   f = 1;
-   for (i=0; i<CYMBAL_N; i++) {
-    //phases[i] = 0;
-    a += g_cymTones[i];
-   }
-   if (rand()&1) a = -a;
-   if (a != 0) a = 0.4*g_cymVolume / a; // 'a' should never be zero here tho
-  }
-  if (a != 0 && f != 0) { // here, 'a' can be zero if the cymbal is done ringing.
-   for (i=0; i<nframes; i++) {
-    int v=0, j=0;
-    for (; j<CYMBAL_N; j++) {
-     if (phases[j] < 0) v += g_cymTones[j]; else v -= g_cymTones[j];
-     if (++phases[j] >= g_cymTones[j]) phases[j] = -g_cymTones[j];
-    }
-    s += (v*a-s)*f;
-    s2 += (s-s2)*0.1;
-    out[i] += s - s2;
-
-    //a *= g_cymDecayFactor;
-    f *= g_cymDecayFactor;
-    if (isSubnormalF(a)) a = 0;
-    if (isSubnormalF(f)) f = 0;
-   }
+ if (g_recordFile) RecordPeriod(out, nframes);
+
+ if (g_keepStats) {
+  Stats *st = &g_stats;
+  unsigned long long ns = NowNs() - start;
+  unsigned long long deadline = nframes * 1000000000ULL / g_sampleRate;
+  int bucket = deadline ? ns * 10 / deadline : LOAD_BUCKETS-1;
+  int voices = 0;
+  for (n=0; n<g_numKits; n++)
+   voices += (n == 0 && g_aheadPeriods) ? AheadKit()->activeVoices : g_kits[n].state.activeVoices;
+  if (bucket >= LOAD_BUCKETS) bucket = LOAD_BUCKETS-1;
+  __atomic_store_n(&st->load[bucket], st->load[bucket]+1, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->callbackNs, st->callbackNs + ns, __ATOMIC_RELAXED);
+  if (ns > st->maxCallbackNs) __atomic_store_n(&st->maxCallbackNs, ns, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->frames, st->frames + nframes, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->period, (int)nframes, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->activeVoices, voices, __ATOMIC_RELAXED);
+  if (voices > st->maxActiveVoices)
+   __atomic_store_n(&st->maxActiveVoices, voices, __ATOMIC_RELAXED);
+  if (g_flightDir) { // (its own time, apart from callback_ns)
+   unsigned long long flightStart = NowNs();
+   FlightPeriod(out, nframes, ns, voices);
+   __atomic_store_n(&st->flightNs, st->flightNs + NowNs() - flightStart, __ATOMIC_RELAXED);
   }
+  __atomic_store_n(&st->callbacks, st->callbacks+1, __ATOMIC_RELEASE);
  }
- 
- if (g_newToneDrum == -1) g_newToneDrum = 0;
  return 0;
 }
 
@@ -416,14 +644,25 @@ int My_Process (jack_nframes_t nframes, void *arg)
 
 // function for dealing with any errors
 void My_ErrorHandler (const char *desc)
- { fprintf (stderr, "JACK error: %s\n", desc); }
+{
+ __atomic_add_fetch(&g_stats.jackErrors, 1, __ATOMIC_RELAXED);
+ fprintf (stderr, "JACK error: %s\n", desc);
+}
+
+// function for counting xruns (JACK calls this outside the process callback)
+int My_Xrun (void *arg)
+{
+ __atomic_add_fetch(&g_stats.xruns, 1, __ATOMIC_RELAXED);
+ if (g_flightDir) FlightTrigger(FLIGHT_XRUN);
+ return 0;
+}
 
 // function for dealing with sample-rate changes
 int My_SampleRateChange (jack_nframes_t nframes, void *arg)
 {
  if (g_sampleRate > 0) {
   // Maybe it's safe to handle a sample rate change just by
-  // calling SetUpNotes() again, but I'm not sure.
+  // calling SetUpKits() again, but I'm not sure.
   // For now, just leave it.
   fprintf(stderr,"sample rate changed ... I QUIT!!!");
   return 1;
@@ -442,21 +681,76 @@ void My_JackShutdown (void *arg)
 // END OF JACK FUNCTIONS
 
 
+// writes the live stats to f as "name value" lines. the audio thread keeps
+// counting while this runs, so it takes a snapshot first
+void WriteStats(FILE *f)
+{
+ Stats st;
+ int i, n;
+ // read the counter first; everything it was released with comes along
+ st.callbacks = __atomic_load_n(&g_stats.callbacks, __ATOMIC_ACQUIRE);
+ st.frames = __atomic_load_n(&g_stats.frames, __ATOMIC_RELAXED);
+ for (i=0; i<NUM_STATS; i++) {
+  st.sectionNs[i] = 0;
+  for (n=0; n<g_numKits; n++)
+   st.sectionNs[i] += __atomic_load_n(&g_kits[n].sectionNs[i], __ATOMIC_RELAXED);
+ }
+ st.callbackNs = __atomic_load_n(&g_stats.callbackNs, __ATOMIC_RELAXED);
+ st.maxCallbackNs = __atomic_load_n(&g_stats.maxCallbackNs, __ATOMIC_RELAXED);
+ for (i=0; i<LOAD_BUCKETS; i++)
+  st.load[i] = __atomic_load_n(&g_stats.load[i], __ATOMIC_RELAXED);
+ st.xruns = __atomic_load_n(&g_stats.xruns, __ATOMIC_RELAXED);
+ st.jackErrors = __atomic_load_n(&g_stats.jackErrors, __ATOMIC_RELAXED);
+ st.recordDropped = __atomic_load_n(&g_stats.recordDropped, __ATOMIC_RELAXED);
+ st.flightNs = __atomic_load_n(&g_stats.flightNs, __ATOMIC_RELAXED);
+ st.activeVoices = __atomic_load_n(&g_stats.activeVoices, __ATOMIC_RELAXED);
+ st.maxActiveVoices = __atomic_load_n(&g_stats.maxActiveVoices, __ATOMIC_RELAXED);
+ st.period = __atomic_load_n(&g_stats.period, __ATOMIC_RELAXED);
+
+ fprintf(f, "# snappy-drums live stats; times are totals in ns since startup\n");
+ fprintf(f, "time %ld\n", (long)time(NULL));
+ fprintf(f, "sample_rate %ld\n", g_sampleRate);
+ fprintf(f, "period %d\n", st.period);
+ fprintf(f, "callbacks %llu\n", st.callbacks);
+ fprintf(f, "frames %llu\n", st.frames);
+ fprintf(f, "xruns %llu\n", st.xruns);
+ fprintf(f, "jack_errors %llu\n", st.jackErrors);
+ if (g_recordFile) fprintf(f, "record_dropped %llu\n", st.recordDropped);
+ fprintf(f, "voices_active %d\n", st.activeVoices);
+ fprintf(f, "voices_max %d\n", st.maxActiveVoices);
+ fprintf(f, "callback_ns %llu\n", st.callbackNs);
+ fprintf(f, "callback_max_ns %llu\n", st.maxCallbackNs);
+ if (g_flightDir) fprintf(f, "flight_ns %llu\n", st.flightNs);
+ for (i=0; i<NUM_STATS; i++)
+  fprintf(f, "%s_ns %llu\n", g_statsNames[i], st.sectionNs[i]);
+ fprintf(f, "# callbacks by time taken, in steps of 10%% of the period (the last is 110%%+)\n");
+ fprintf(f, "load_histogram");
+ for (i=0; i<LOAD_BUCKETS; i++) fprintf(f, " %llu", st.load[i]);
+ fprintf(f, "\n");
+}
+
+// rewrites the stats file once a second, so a monitor can read it at any
+// time. it's written to a temporary file first, then renamed over the old
+// one, so a reader never sees half a file.
+void* StatsThread (void *arg)
+{
+ char tmpName[strlen(g_statsFile)+8];
+ sprintf(tmpName, "%s.tmp", g_statsFile);
+ while (1) {
+  sleep(1);
+  FILE *f = fopen(tmpName, "w");
+  if (!f) continue;
+  WriteStats(f);
+  fclose(f);
+  rename(tmpName, g_statsFile);
+ }
+ return NULL;
+}
+
+
 // function that starts a loop that responds to ALSA MIDI input
 void* WaitOnMIDI(void* ptr)
 {
- int tdQW = 100;
- int atQW = 100;
- // values affected by controllers:
- sample_t tdBend = 1;
- sample_t atBend = 1;
- sample_t clapTweak = DCV_CLAP;
- sample_t hhTweak = DCV_HH;
- sample_t atDecay = -1.0+DCV_AUX_DECAY;
- sample_t atRelease = -1.0+DCV_AUX_RELEASE;
- sample_t cbTweak = DCV_COWBELL;
- sample_t cymTweak = DCV_CYMBAL;
-
  while (!g_initialized) sleep(1);
 
  int npfd;
@@ -468,237 +762,38 @@ void* WaitOnMIDI(void* ptr)
   snd_seq_event_t *ev;
   do {
    snd_seq_event_input(g_seqHandle, &ev);
+   int n; // which kit it's for, by the port it came in on
+   for (n=g_numKits-1; n>0 && g_kitIO[n].alsaPort != ev->dest.port; n--);
+   Kit *k = &g_kits[n];
    switch (ev->type) {
    case SND_SEQ_EVENT_NOTEON:
-   {
-    // XXX: should i put a mutex to make sure jack process isnt running?
-    // XXX: can i somehow tell the kernel "dont interrupt the thread until all these lines of code are executed"?
-    int qw = g_qw[ev->data.note.note];
-    sample_t v = (1.0/127.0) * ev->data.note.velocity; v *= v * g_masterVolume;
-    if (v > 0) {
-     if (ev->data.control.channel != 15) {
-      if (qw > 0) {                    // Tone Drums
-       tdQW = qw;
-       qw = 0.5+qw*tdBend;
-       if (!g_newToneDrum) {
-        g_newToneDrum = 1;
-        g_tdQuarterWave = qw;
-        g_tdVolume = v;
-        g_tdNoisiness = 0;
-       }
-       else { // if another tone drum was already received, do a ghost drum
-        g_tdNoisiness = (qw - g_tdQuarterWave)*0.5;
-        g_tdQuarterWave = (qw + g_tdQuarterWave)*0.5;
-        g_tdVolume = (v+g_tdVolume)*0.5;
-       }
-      }
-      else if (qw == 0 || qw == -1) { // Claps
-       sample_t cdf;
-       if (qw == 0) cdf = 1.0-clapTweak;
-       else         cdf = 1.0-clapTweak*0.5;
-       v *= 0.3;
-       if (!g_newClap) {
-        g_newClap = 1;
-        g_clapVolume = v;
-        g_clapDecayFactor = cdf;
-       }
-       else { // if another clap was already received, pick the loudest and longest
-        if (g_clapVolume < v) g_clapVolume = v;
-        if (g_clapDecayFactor < cdf) g_clapDecayFactor = cdf;
-       }
-      }
-      else if (qw == -2 || qw == -3) { // High Hats
-       sample_t hdf;
-       if (qw == -3) hdf = 1.0-hhTweak;
-       else          hdf = 1.0-hhTweak*0.25;
-       v *= 0.2;
-       if (!g_newHighHat) {
-        g_newHighHat = 1;
-        g_hhVolume = v;
-        g_hhDecayFactor = hdf;
-       }
-       else { // if another hihat was already received, pick the loudest and longest
-        if (g_hhVolume < v) g_hhVolume = v;
-        if (g_hhDecayFactor < hdf) g_hhDecayFactor = hdf;
-       }
-      }
-     } 
-     else {
-      if (qw > 0) {                     // Aux Tones
-       atQW = qw;
-       qw = 0.5+qw*atBend;
-       g_newAuxTone = 1;
-       g_atQuarterWave = qw;
-       g_atVolume = v*0.4;
-       g_atDecayFactor = atDecay;
-      }
-      else switch(ev->data.note.note) { // Cymbals
-       case 127:
-        g_newCymbal = 1;
-        g_cymVolume = v*0.5;
-        g_cymDecayFactor = 1.0-cymTweak;
-        g_cymTones[0] = 9;
-        g_cymTones[1] = 17;
-        g_cymTones[2] = 26;
-        g_cymTones[3] = 43;
-        g_cymTones[4] = 69;
-        g_cymTones[5] = 112; // fibonacci 1
-       break;
-       case 126:
-        g_newCymbal = 1;
-        g_cymVolume = v;
-        g_cymDecayFactor = 1.0-cymTweak*0.1;
-        g_cymTones[1] = 17;
-        g_cymTones[2] = 26;
-        g_cymTones[3] = 43;
-        g_cymTones[4] = 69;
-        g_cymTones[5] = 112;
-        g_cymTones[0] = 181; // same as above, but deeper
-       break;
-       case 125:
-        g_newCymbal = 1;
-        g_cymVolume = v*0.5;
-        g_cymDecayFactor = 1.0-cymTweak;
-        g_cymTones[0] = 11;
-        g_cymTones[1] = 19;
-        g_cymTones[2] = 30;
-        g_cymTones[3] = 49;
-        g_cymTones[4] = 79;
-        g_cymTones[5] = 128; // fibonacci 2
-       break;
-       case 124:
-        g_newCymbal = 1;
-        g_cymVolume = v;
-        g_cymDecayFactor = 1.0-cymTweak*0.1;
-        g_cymTones[1] = 19;
-        g_cymTones[2] = 30;
-        g_cymTones[3] = 49;
-        g_cymTones[4] = 79;
-        g_cymTones[5] = 128;
-        g_cymTones[0] = 207; // same as above, but deeper
-       break;
-       case 123:
-        g_newCymbal = 1;
-        g_cymVolume = v*0.5;
-        g_cymDecayFactor = 1.0-cymTweak;
-        g_cymTones[0] = 13;
-        g_cymTones[1] = 21;
-        g_cymTones[2] = 34;
-        g_cymTones[3] = 55;
-        g_cymTones[4] = 89;
-        g_cymTones[5] = 144; // fibonacci 3
-       break;
-       case 122:
-        g_newCymbal = 1;
-        g_cymVolume = v;
-        g_cymDecayFactor = 1.0-cymTweak*0.1;
-        g_cymTones[1] = 21;
-        g_cymTones[2] = 34;
-        g_cymTones[3] = 55;
-        g_cymTones[4] = 89;
-        g_cymTones[5] = 144;
-        g_cymTones[0] = 233; // same as above, but deeper
-       break;
-       case 121:
-        g_newCymbal = 1;
-        g_cymVolume = v*0.5;
-        g_cymDecayFactor = 1.0-cymTweak;
-        g_cymTones[0] = 48;
-        g_cymTones[1] = 59;
-        g_cymTones[2] = 71;
-        g_cymTones[3] = 85;
-        g_cymTones[4] = 101;
-        g_cymTones[5] = 121; // coprime evenly spaced spectrum 1
-       break;
-       case 120:
-        g_newCymbal = 1;
-        g_cymVolume = v;
-        g_cymDecayFactor = 1.0-cymTweak*0.1;
-        g_cymTones[3] = 85;
-        g_cymTones[4] = 101;
-        g_cymTones[5] = 121;
-        g_cymTones[0] = 148; // same as above, but deeper
-        g_cymTones[1] = 177;
-        g_cymTones[2] = 211;
-       break;
-       default:                         // Cowbells
-        g_cbVolume = v;
-        g_cbWaveScale = 120 - ev->data.note.note;
-        g_cbDecayFactor = 1.0-cbTweak/g_cbWaveScale;
-        g_newCowbell = 1;
-      }
-     }
-    }
-   }
+    FlightNote(n, 'a', MIDI_NOTEON, ev->data.note.channel,
+                  ev->data.note.note, ev->data.note.velocity);
+    HandleMIDI(k, MIDI_NOTEON, ev->data.note.channel,
+                  ev->data.note.note, ev->data.note.velocity);
    break;
    case SND_SEQ_EVENT_NOTEOFF:
-    if (ev->data.control.channel == 15 &&
-     g_qw[ev->data.note.note] == atQW)
-      g_atDecayFactor = atRelease;
+    FlightNote(n, 'a', MIDI_NOTEOFF, ev->data.note.channel,
+                  ev->data.note.note, ev->data.note.velocity);
+    HandleMIDI(k, MIDI_NOTEOFF, ev->data.note.channel,
+                  ev->data.note.note, ev->data.note.velocity);
    break;
    case SND_SEQ_EVENT_PITCHBEND:
-   {
-    sample_t bend = exp(ev->data.control.value*(-M_LN2/8192.0));
-    if (ev->data.control.channel == 15) {
-     g_atQuarterWave = 0.5+atQW*bend;
-     atBend = bend;
-    }
-    else {
-     g_tdQuarterWave = 0.5+tdQW*bend;
-     tdBend = bend;
-    }
-   }
+    FlightNote(n, 'a', MIDI_PITCHBEND, ev->data.control.channel,
+                  0, ev->data.control.value);
+    HandleMIDI(k, MIDI_PITCHBEND, ev->data.control.channel,
+                  0, ev->data.control.value);
    break;
    case SND_SEQ_EVENT_CONTROLLER:
-    if (ev->data.control.param == 7) {       // Master Volume (all channels)
-     g_masterVolume = (1.0/127.0/127.0)*ev->data.control.value*ev->data.control.value;
-    }
-    else if (ev->data.control.param == 70 && ev->data.control.channel != 15) {
-                                             // Sound Variation
-     g_tdSweepSpeed = (127-ev->data.control.value)*((DCV_SWEEP_SPEED-1)/63.0)+1.5;
-    }
-    else if (ev->data.control.param == 71) { // Sound Timbre
-     if (ev->data.control.channel == 15) atDecay = -1.0 + (127-ev->data.control.value)*(DCV_AUX_DECAY/63.0);
-    }
-    else if (ev->data.control.param == 72) { // Sound Release Time
-     if (ev->data.control.channel == 15) atRelease = -1.0 + DCV_AUX_RELEASE*1.5 - ev->data.control.value * (DCV_AUX_RELEASE*0.5 / 64.0);
-     else g_tdDecayFactor = -1.0 + (127-ev->data.control.value) * (DCV_DECAY/63.0);
-    }
-    else if (ev->data.control.param == 75) { // Sound Control 6 (clap)
-     if (ev->data.control.channel == 15)
-      cbTweak = DCV_COWBELL*1.5-ev->data.control.value*(DCV_COWBELL*0.5/64.0);
-     else clapTweak = DCV_CLAP*1.5-ev->data.control.value*(DCV_CLAP*0.5/64.0);
-    }
-    else if (ev->data.control.param == 76) { // Sound Control 7 (high hats)
-     if (ev->data.control.channel == 15)
-      cymTweak = DCV_CYMBAL*1.5-ev->data.control.value*(DCV_CYMBAL*0.5/64.0);
-     else hhTweak = DCV_HH*1.5 - ev->data.control.value * (DCV_HH*0.5 / 64.0);
-    }
-    else if (ev->data.control.param == 121) { // All Controllers Off (all channels)
-     g_masterVolume = 1.0;
-     g_tdSweepSpeed = DCV_SWEEP_SPEED;
-     g_tdDecayFactor = -1.0 + DCV_DECAY;
-     tdBend = 1;
-     atBend = 1;
-     clapTweak = DCV_CLAP;
-     hhTweak = DCV_HH;
-     atDecay = -1.0+DCV_AUX_DECAY;
-     atRelease = -1.0+DCV_AUX_RELEASE;
-     cbTweak = DCV_COWBELL;
-     cymTweak = DCV_CYMBAL;
-    }
-    else if (ev->data.control.param == 120) { // All Sound Off (all channels)
-     g_tdVolume = g_clapVolume = g_hhVolume = g_atVolume = g_cbVolume = g_cymVolume = 0;
-     g_newToneDrum = g_newClap = g_newHighHat = g_newAuxTone = g_newCowbell = g_newCymbal = 1;
-    }
-    if (ev->data.control.param == 123) {      // All Notes Off (all channels)
-     g_tdQuarterWave = g_quarterWaveMax+1;
-     g_clapDecayFactor = 0.999;           
-     g_hhDecayFactor = 0.998;
-     g_atDecayFactor = -0.8;
-     g_cbDecayFactor = 0.996;
-     g_cymDecayFactor = 0.998;
-    }
+    FlightNote(n, 'a', MIDI_CONTROLLER, ev->data.control.channel,
+                  ev->data.control.param, ev->data.control.value);
+    HandleMIDI(k, MIDI_CONTROLLER, ev->data.control.channel,
+                  ev->data.control.param, ev->data.control.value);
+   break;
+   case SND_SEQ_EVENT_PGMCHANGE:
+    FlightNote(n, 'a', 0xC0, ev->data.control.channel,
+                  ev->data.control.value, 0);
+    if (n == 0) SelectPattern(&g_seq, ev->data.control.value); // (the sequenced kit's input only)
    break;
    }
    snd_seq_free_event(ev);
@@ -706,145 +801,2505 @@ void* WaitOnMIDI(void* ptr)
  }
 }
 
-int SetUpNotes() {
- if (g_sampleRate < 1) return -1;
- int i; for (i=0; i<128; i++) g_keys[i] = -1;
- char *row1l = "zsxdcvgbhnjm,l.;/";
- char *row1u = "ZSXDCVGBHNJM<L>:?";
- char *row2l = "q2w3er5t6y7ui9o0p[=]\n";
- char *row2u = "Q@W#ER%T^Y&UI(O)P{+}";
- for (i=0; row1l[i] != '\0'; i++) g_keys[row1l[i]] = i+24;
- for (i=0; row2l[i] != '\0'; i++) g_keys[row2l[i]] = i+36;
- for (i=0; row1u[i] != '\0'; i++) g_keys[row1u[i]] = i+48;
- for (i=0; row2u[i] != '\0'; i++) g_keys[row2u[i]] = i+60;
- g_keys[' '] = -1;
- for (i=0; i<128; i++) {
-  int qw = 0.5 + 0.25 * g_sampleRate / MIDI_TO_FREQ(i);
-  g_qw[i] = qw;
-  if (qw <= 21) {
-   do {
-    g_qw[++i] = --qw;   
-   } while (qw > 0);
+// sets up all the kits for g_sampleRate, with the settings from the
+// command line (each kit gets its own noise). returns -1 if there's no
+// sample rate yet
+int SetUpKits()
+{
+ int i;
+ for (i=0; i<g_numKits; i++) {
+  KitSettings settings = g_kitSettings;
+  settings.sampleRate = g_sampleRate;
+  settings.seed += i;
+  settings.timing = g_keepStats;
+  if (SetUpKit(&g_kits[i], &settings)) return -1;
+ }
+ g_initialized = 1;
+ return 0;
+}
+
+
+
+// command line options that work in every mode (see the manpage).
+// returns 0 if the option was good, -1 if not
+#define COMMON_OPTIONS "v:g:s:c:"
+#define COMMON_USAGE "[-v voices] [-g all|channel|none] [-s seed] [-c cachems]"
+int CommonOption(int opt, const char *arg)
+{
+ switch (opt) {
+ case 'v':
+  g_kitSettings.voices = atoi(arg); // (SetUpKit keeps it in range)
+  return 0;
+ case 'g':
+  if      (!strcmp(arg, "all"))     g_kitSettings.chokeMode = CHOKE_ALL;
+  else if (!strcmp(arg, "channel")) g_kitSettings.chokeMode = CHOKE_CHANNEL;
+  else if (!strcmp(arg, "none"))    g_kitSettings.chokeMode = CHOKE_NONE;
+  else return -1;
+  return 0;
+ case 's':
+  g_kitSettings.seed = strtoul(arg, NULL, 0);
+  return 0;
+ case 'c':
+  g_kitSettings.toneCacheMs = atoi(arg);
+  if (g_kitSettings.toneCacheMs < 0) g_kitSettings.toneCacheMs = 0;
+  return 0;
+ }
+ return -1;
+}
+
+
+
+// OFFLINE RENDERING
+// plays a Standard MIDI File through HandleMIDI() and Synthesize(),
+// as fast as the CPU allows, and writes the result to a WAV file.
+
+#define RENDER_BLOCK 4096 // max frames per Synthesize() call when rendering
+
+typedef struct {
+ long tick;   // position in MIDI ticks
+ long order;  // keeps simultaneous events in file order
+ long tempo;  // microseconds per quarter note (only for tempo changes)
+ unsigned char status, data1, data2; // status 0xFF means tempo change
+} SmfEvent;
+
+// reads a variable-length quantity from a MIDI file
+static long ReadVarLen(const unsigned char **p, const unsigned char *end)
+{
+ long value = 0, i;
+ for (i=0; i<4 && *p < end; i++) { // (the standard allows 4 bytes at most)
+  unsigned char c = *(*p)++;
+  value = (value << 7) | (c & 0x7F);
+  if (!(c & 0x80)) break;
+ }
+ return value;
+}
+
+static int CompareSmfEvents(const void *a, const void *b)
+{
+ const SmfEvent *x = a, *y = b;
+ if (x->tick != y->tick) return x->tick < y->tick ? -1 : 1;
+ return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// loads all tracks of a MIDI file into one time-sorted list of events.
+// returns the number of events, or -1 if the file can't be read.
+long ReadMidiFile(const char *filename, SmfEvent **events, int *division)
+{
+ FILE *file = fopen(filename, "rb");
+ if (!file) { perror(filename); return -1; }
+ fseek(file, 0, SEEK_END);
+ long size = ftell(file);
+ fseek(file, 0, SEEK_SET);
+ unsigned char *data = (size < 0) ? NULL : malloc(size ? size : 1);
+ if (!data || fread(data, 1, size, file) != size) {
+  fprintf(stderr, "%s: read error\n", filename);
+  fclose(file); free(data);
+  return -1;
+ }
+ fclose(file);
+
+ if (size < 14 || memcmp(data, "MThd", 4)) {
+  fprintf(stderr, "%s: not a standard MIDI file\n", filename);
+  free(data);
+  return -1;
+ }
+ int ntracks = data[10]<<8 | data[11];
+ *division   = data[12]<<8 | data[13];
+
+ const unsigned char *end = data + size;
+ unsigned long hlen = (unsigned long)data[4]<<24 | data[5]<<16 | data[6]<<8 | data[7];
+ // (ticks per quarter note, or for SMPTE time, frames per second and
+ // ticks per frame: none of them can be 0)
+ int smpte = *division & 0x8000;
+ if (hlen > size - 8 || *division == 0 || (smpte && !(*division & 0xFF))) {
+  fprintf(stderr, "%s: broken header chunk\n", filename);
+  free(data);
+  return -1;
+ }
+ // every 2 bytes in the file can be at most one event; that's our upper bound
+ long n = 0;
+ SmfEvent *ev = malloc((size/2+1) * sizeof(SmfEvent));
+ if (!ev) { fprintf(stderr, "%s: out of memory\n", filename); free(data); return -1; }
+ const unsigned char *p = data + 8 + hlen;
+ int track;
+ for (track=0; track<ntracks && end-p >= 8; track++) {
+  unsigned long len = (unsigned long)p[4]<<24 | p[5]<<16 | p[6]<<8 | p[7];
+  const unsigned char *t = p + 8;
+  if (len > end - t) {
+   fprintf(stderr, "%s: chunk runs past the end of the file, ignoring the rest\n", filename);
    break;
   }
+  const unsigned char *tend = t + len;
+  p = tend;
+  if (memcmp(t-8, "MTrk", 4)) continue; // unknown chunk type, skip it
+
+  long tick = 0;
+  unsigned char running = 0;
+  while (t < tend) {
+   tick += ReadVarLen(&t, tend);
+   if (t >= tend) break;
+   unsigned char status = *t;
+   if (status & 0x80) t++;
+   else status = running; // running status: reuse the last status byte
+   if (status == 0xFF) {           // meta event
+    if (t >= tend) break;
+    unsigned char type = *t++;
+    long mlen = ReadVarLen(&t, tend);
+    if (type == 0x51 && mlen == 3 && t+3 <= tend) {
+     ev[n].tick = tick; ev[n].order = n; ev[n].status = 0xFF;
+     ev[n].tempo = t[0]<<16 | t[1]<<8 | t[2];
+     n++;
+    }
+    else if (type == 0x2F) break;  // end of track
+    if (mlen > tend - t) break;
+    t += mlen;
+   }
+   else if (status == 0xF0 || status == 0xF7) { // sysex
+    long slen = ReadVarLen(&t, tend);
+    if (slen > tend - t) break;
+    t += slen;
+   }
+   else if (status >= 0x80) {      // channel message
+    running = status;
+    int nbytes = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+    if (t + nbytes > tend) break;
+    ev[n].tick = tick; ev[n].order = n; ev[n].status = status;
+    ev[n].data1 = t[0] & 0x7F;
+    ev[n].data2 = (nbytes == 2) ? t[1] & 0x7F : 0;
+    t += nbytes;
+    n++;
+   }
+   else break; // garbage: no status byte to run with
+  }
  }
- if (i>124) i=124;
- for (; i<128; i++) g_qw[i] = -(i&3);
+ free(data);
+ qsort(ev, n, sizeof(SmfEvent), CompareSmfEvents);
+ *events = ev;
+ return n;
+}
 
- g_quarterWaveFade = 0.5 + g_sampleRate * (0.25 / LOW_FREQUENCY_ROLLOFF);
- g_quarterWaveMax = 0.5 + g_sampleRate * (0.25 / LOW_FREQUENCY_CUTOFF);
- /*
- fprintf(stderr, "sweep speed %d; ", g_tdSweepSpeed);
- fprintf(stderr, "decay/release factor %f; ", g_tdDecayFactor);
- fprintf(stderr, "short clap decay factor %f; ", g_clapDecayFactor);
- fprintf(stderr, "short hihat decay factor %f; ", g_hhDecayFactor);
- fprintf(stderr, "aux tone decay factor %f; ", -1.0+DCV_AUX_DECAY);
- fprintf(stderr, "aux tone release factor %f\n", -1.0+DCV_AUX_RELEASE);
- */
 
- g_initialized = 1;
+// WAV file output, for the offline renderer. bits = 16 or 24 (integer PCM),
+// or 32 (floating point)
+typedef struct {
+ FILE *file;
+ int channels;
+ int bits;
+ long frames;
+ int junk; // size of a JUNK chunk before the format, to move the data along
+} WavFile;
+
+static void PutLE(FILE *file, unsigned long value, int nbytes)
+ { while (nbytes-- > 0) { fputc(value & 0xFF, file); value >>= 8; } }
+
+static void WriteWavHeader(WavFile *wav)
+{
+ long dataSize = wav->frames * wav->channels * (wav->bits/8);
+ long junkSize = wav->junk ? 8 + wav->junk : 0;
+ fwrite("RIFF", 1, 4, wav->file);
+ PutLE(wav->file, 36 + junkSize + dataSize, 4); // ChunkSize
+ fwrite("WAVE", 1, 4, wav->file);            // Format
+ if (wav->junk) {
+  fwrite("JUNK", 1, 4, wav->file);
+  PutLE(wav->file, wav->junk, 4);
+  PutLE(wav->file, 0, wav->junk); // (all zeros)
+ }
+ fwrite("fmt ", 1, 4, wav->file);            // Subchunk1ID
+ PutLE(wav->file, 16, 4);                    // Subchunk1Size
+ PutLE(wav->file, wav->bits==32 ? 3 : 1, 2); // AudioFormat (3 = float)
+ PutLE(wav->file, wav->channels, 2);         // NumChannels
+ PutLE(wav->file, g_sampleRate, 4);          // SampleRate
+ PutLE(wav->file, g_sampleRate * wav->channels * (wav->bits/8), 4); // ByteRate
+ PutLE(wav->file, wav->channels * (wav->bits/8), 2); // BlockAlign
+ PutLE(wav->file, wav->bits, 2);             // BitsPerSample
+ fwrite("data", 1, 4, wav->file);            // Subchunk2ID
+ PutLE(wav->file, dataSize, 4);              // Subchunk2Size
+}
+
+int WavOpen(WavFile *wav, const char *filename, int channels, int bits)
+{
+ if (bits != 16 && bits != 24 && bits != 32) {
+  fprintf(stderr, "WAV files can be 16, 24 or 32 bits, not %d\n", bits);
+  return -1;
+ }
+ wav->file = fopen(filename, "wb");
+ if (!wav->file) { perror(filename); return -1; }
+ wav->channels = channels;
+ wav->bits = bits;
+ wav->frames = 0;
+ wav->junk = 0;
+ WriteWavHeader(wav); // sizes get filled in by WavClose()
  return 0;
 }
 
+// writes nframes of interleaved samples
+void WavWrite(WavFile *wav, const sample_t *data, int nframes)
+{
+ int i, n = nframes * wav->channels;
+ if (wav->bits == 32) {
+  for (i=0; i<n; i++) {
+   union { float f; unsigned long u; } x; x.u = 0;
+   x.f = data[i];
+   PutLE(wav->file, x.u, 4);
+  }
+ }
+ else {
+  long max = (wav->bits == 16) ? 32767 : 8388607;
+  for (i=0; i<n; i++) {
+   sample_t v = data[i];
+   if (v < -1) v = -1;
+   if (v >  1) v =  1;
+   PutLE(wav->file, lrintf(v*max), wav->bits/8);
+  }
+ }
+ wav->frames += nframes;
+}
 
+#ifdef SNAPPY_FIXED
+// writes nframes of fixed point samples: integer PCM gets rounded
+// straight from the levels, and only 32-bit output goes through floats
+void WavWriteLevels(WavFile *wav, const level_t *data, int nframes)
+{
+ int i, n = nframes * wav->channels;
+ if (wav->bits == 32) {
+  for (i=0; i<n; i++) {
+   union { float f; unsigned long u; } x; x.u = 0;
+   x.f = LEVEL_FLOAT(data[i]);
+   PutLE(wav->file, x.u, 4);
+  }
+ }
+ else {
+  long max = (wav->bits == 16) ? 32767 : 8388607;
+  for (i=0; i<n; i++) {
+   long v = ((int64_t)data[i]*max + (1<<(LEVEL_BITS-1))) >> LEVEL_BITS;
+   if (v < -max) v = -max;
+   if (v >  max) v =  max;
+   PutLE(wav->file, v, wav->bits/8);
+  }
+ }
+ wav->frames += nframes;
+}
+#else
+#define WavWriteLevels WavWrite
+#endif
 
-// main() handles the user interface and the startup/shutdown
-int main (int argc, char *argv[])
+void WavClose(WavFile *wav)
 {
- // first make sure it's run in a terminal
- if (!getenv("TERM")) execlp("xterm","xterm","-hold","-e",argv[0],NULL);
+ fseek(wav->file, 0, SEEK_SET);
+ WriteWavHeader(wav);
+ fclose(wav->file);
+}
 
- // display the basic program info
- printf("-- JACK + ALSA MIDI instrument --\n");
 
- // set up the everything to work with JACK
- if ((g_client = jack_client_new(CLIENT_NAME)) == 0) {
-  char name[32];sprintf(name,"%s_%d",CLIENT_NAME,getpid());// try another name
-  if ((g_client = jack_client_new(name)) == 0) {// or is jackd not running?
-   fprintf(stderr,"-- You must start JACK before running this program. --\n");
-   return 1; }
- }
- jack_set_error_function (My_ErrorHandler);
- jack_set_process_callback (g_client, My_Process, 0);
- jack_set_sample_rate_callback (g_client, My_SampleRateChange, 0);
- jack_on_shutdown (g_client, My_JackShutdown, 0);
- g_outputPort = jack_port_register (g_client, "out",
-                 JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
- // activate the client
- if (jack_activate (g_client))
- { fprintf (stderr, "cannot activate client\n");
-  return 1; }
- // find some output ports to connect to
- const char **ports;
- int i;
- ports=jack_get_ports(g_client,NULL,NULL,JackPortIsPhysical|JackPortIsInput);
- if (ports == NULL) {
-  fprintf(stderr, "cannot find any playback ports (speakers?)\n");
- } else {
-  for (i=0; ports[i]!=NULL; i++) {
-    if (jack_connect (g_client, jack_port_name(g_outputPort), ports[i]))
-      fprintf (stderr, "cannot connect output ports\n");
+// renders a MIDI file to a WAV file. g_sampleRate must already be set.
+// if period > 0, events only take effect at multiples of that many frames,
+// which is what a live JACK run with that buffer size would sound like.
+// otherwise each event starts on its exact sample.
+int RenderMidiFile(const char *midiName, const char *wavName,
+                   int bits, int period, double tail)
+{
+ SmfEvent *events;
+ int division;
+ long nevents = ReadMidiFile(midiName, &events, &division);
+ if (nevents < 0) return 1;
+
+ WavFile wav;
+ if (WavOpen(&wav, wavName, 1, bits)) { free(events); return 1; }
+ SetUpKits();
+ Kit *k = &g_kits[0];
+ ClaimKit(k); // (this thread renders, so MIDI applies right away)
+
+ // with SMPTE timing, ticks are a fixed length; otherwise they follow tempo
+ double secondsPerTick;
+ int smpte = division & 0x8000;
+ if (smpte) secondsPerTick = 1.0 / (-(signed char)(division>>8) * (division&0xFF));
+ else       secondsPerTick = 0.5 / division; // 120 bpm until told otherwise
+
+ static level_t buf[RENDER_BLOCK];
+ struct timespec start, stop;
+ clock_gettime(CLOCK_MONOTONIC, &start);
+
+ long frame = 0;    // frames rendered so far
+ long lastTick = 0; // for converting ticks to seconds
+ double seconds = 0;
+ long e;
+ for (e=0; e<=nevents; e++) {
+  long until;
+  if (e < nevents) {
+   seconds += (events[e].tick - lastTick) * secondsPerTick;
+   lastTick = events[e].tick;
+   until = seconds * g_sampleRate + 0.5;
+   if (period > 0) until = (until + period - 1) / period * period;
   }
-  free (ports);
+  else until = (seconds + tail) * g_sampleRate;
+
+  while (frame < until) {
+   int len = (until - frame < RENDER_BLOCK) ? until - frame : RENDER_BLOCK;
+   SynthesizeLevels(k, buf, len);
+   WavWriteLevels(&wav, buf, len);
+   frame += len;
+  }
+  if (e == nevents) break;
+
+  unsigned char status = events[e].status;
+  if (status == 0xFF) {
+   if (!smpte) secondsPerTick = events[e].tempo * 1e-6 / division;
+   continue;
+  }
+  unsigned char msg[3] = {status, events[e].data1, events[e].data2};
+  HandleMIDIMessage(k, msg, 3);
  }
 
- // set up an ALSA midi port
- if (snd_seq_open(&g_seqHandle, "default", SND_SEQ_OPEN_INPUT, 0) < 0) {
-  fprintf(stderr, "Error opening ALSA sequencer.\n");
-  return 1;
+ clock_gettime(CLOCK_MONOTONIC, &stop);
+ WavClose(&wav);
+ free(events);
+
+ double elapsed = (stop.tv_sec - start.tv_sec) + 1e-9*(stop.tv_nsec - start.tv_nsec);
+ double length = (double)frame / g_sampleRate;
+ fprintf(stderr, "rendered %.1f seconds of audio in %.3f seconds (%.0fx real time)\n",
+         length, elapsed, elapsed > 0 ? length/elapsed : 0);
+ return 0;
+}
+
+// handles the command line for "snappy-drums --render ..."
+int RenderMain(int argc, char *argv[])
+{
+ int bits = 16;
+ int period = 0;
+ double tail = 3;
+ g_sampleRate = 48000;
+ int opt, bad = 0;
+ while ((opt = getopt(argc, argv, "r:b:p:t:" COMMON_OPTIONS)) != -1) switch (opt) {
+  case 'r': g_sampleRate = atol(optarg); break;
+  case 'b': bits = atoi(optarg); break;
+  case 'p': period = atoi(optarg); break;
+  case 't': tail = atof(optarg); break;
+  default: if (CommonOption(opt, optarg)) bad = 1;
  }
- snd_seq_set_client_name(g_seqHandle, CLIENT_NAME);
- if (snd_seq_create_simple_port(g_seqHandle, CLIENT_NAME,
-  SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
-  SND_SEQ_PORT_TYPE_APPLICATION) < 0) {
-  fprintf(stderr, "Error creating sequencer port.\n");
+ if (bad || optind != argc-2 || g_sampleRate < 8000) {
+  fprintf(stderr, "usage: %s --render [-r samplerate] [-b 16|24|32] "
+                  "[-p period] [-t tailseconds] " COMMON_USAGE
+                  " input.mid output.wav\n", argv[0]);
   return 1;
  }
- pthread_t MIDIthread; // automate midi handling
- pthread_create(&MIDIthread,NULL,WaitOnMIDI,NULL);
+ return RenderMidiFile(argv[optind], argv[optind+1], bits, period, tail);
+}
+
+
+// BENCHMARKS
+// times each generator on its own, driven by a repeating trigger pattern,
+// for a range of sample rates and buffer sizes. no JACK needed. each run
+// happens in a forked process, so it starts from silence and can't be
+// slowed down by whatever the previous run left ringing.
+
+typedef struct {
+ const char *name;
+ int channel, note;
+ int sweep;    // Sound Variation (CC70) value, or -1 to leave it alone
+ int ghost;    // nonzero: add a second note at the same time (a ghost drum)
+ int forceAux; // nonzero: note plays on channel 16's cymbal/cowbell switch,
+               // even at sample rates where it maps to an aux tone
+} BenchCase;
+
+static const BenchCase g_benchCases[] = {
+ {"idle",            0,   0, -1, 0, 0},
+ {"tonedrum",        0,  36, -1, 0, 0},
+ {"tonedrum-fast",   0,  36,  0, 0, 0},
+ {"tonedrum-slow",   0,  36, 127, 0, 0},
+ {"tonedrum-ghost",  0,  36, -1, 1, 0},
+ {"clap",            0, 125, -1, 0, 0},
+ {"hihat",           0, 126, -1, 0, 0},
+ {"auxtone",        15,  57, -1, 0, 0},
+ {"cowbell",        15, 112, -1, 0, 1},
+ {"cymbal-120",     15, 120, -1, 0, 1},
+ {"cymbal-121",     15, 121, -1, 0, 1},
+ {"cymbal-122",     15, 122, -1, 0, 1},
+ {"cymbal-123",     15, 123, -1, 0, 1},
+ {"cymbal-124",     15, 124, -1, 0, 1},
+ {"cymbal-125",     15, 125, -1, 0, 1},
+ {"cymbal-126",     15, 126, -1, 0, 1},
+ {"cymbal-127",     15, 127, -1, 0, 1},
+};
+#define NUM_BENCH_CASES (sizeof(g_benchCases)/sizeof(BenchCase))
+
+static const long g_benchRates[] = {44100, 48000, 88200, 96000, 176400, 192000};
+#define NUM_BENCH_RATES (sizeof(g_benchRates)/sizeof(long))
+
+static unsigned long long Cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+ return __rdtsc();
+#else
+ return 0;
+#endif
+}
+
+static void BenchTrigger(Kit *k, const BenchCase *c)
+{
+ if (c->note == 0) return;
+ int saved = k->qw[c->note];
+ if (c->forceAux) k->qw[c->note] = -1;
+ HandleMIDI(k, MIDI_NOTEON, c->channel, c->note, 100);
+ if (c->ghost) HandleMIDI(k, MIDI_NOTEON, c->channel, c->note+7, 100);
+ k->qw[c->note] = saved;
+}
+
+// renders 'seconds' of one case, retriggering it twice a second,
+// and prints a line of CSV. with more than one kit, they all play it,
+// rendered together by SynthesizeBatch(), and the times are per kit
+static void BenchRun(const BenchCase *c, long rate, int buffer, double seconds, int kits)
+{
+ static sample_t buf[MAX_KITS][4096];
+ sample_t *bus[MAX_KITS][NUM_BUSES];
+ sample_t **buses[MAX_KITS];
+ Kit *kitList[MAX_KITS];
+ Kit *k = &g_kits[0];
+ int n, j;
+ g_sampleRate = rate;
+ g_numKits = kits;
+ SetUpKits();
+ for (n=0; n<kits; n++) {
+  ClaimKit(&g_kits[n]);
+  kitList[n] = &g_kits[n];
+  for (j=0; j<NUM_BUSES; j++) bus[n][j] = buf[n];
+  buses[n] = bus[n];
+  if (c->sweep >= 0) HandleMIDI(&g_kits[n], MIDI_CONTROLLER, c->channel, 70, c->sweep);
+ }
+
+ long total = seconds * rate;
+ long nextTrigger = 0;
+ long frame, blocks = 0;
+ struct timespec start, stop;
+ clock_gettime(CLOCK_MONOTONIC, &start);
+ unsigned long long cycles = Cycles();
+ for (frame=0; frame<total; frame+=buffer) {
+  if (frame >= nextTrigger) { // (triggers are cheap next to the rendering)
+   for (n=0; n<kits; n++) BenchTrigger(&g_kits[n], c);
+   nextTrigger += rate/2;
+  }
+  if (kits == 1) Synthesize(k, buf[0], buffer);
+  else SynthesizeBatch(kitList, buses, kits, buffer);
+  blocks++;
+ }
+ cycles = Cycles() - cycles;
+ clock_gettime(CLOCK_MONOTONIC, &stop);
+ double ns = (stop.tv_sec - start.tv_sec)*1e9 + (stop.tv_nsec - start.tv_nsec);
+ printf("%s,%ld,%d,%.3f,%.0f\n", c->name, rate, buffer,
+        ns / ((double)blocks*buffer*kits), (double)cycles / blocks / kits);
+}
+
+// handles the command line for "snappy-drums --bench ..."
+int BenchMain(int argc, char *argv[])
+{
+ long onlyRate = 0;
+ int onlyBuffer = 0;
+ double seconds = 2;
+ int kits = 1;
+ int opt, bad = 0;
+ while ((opt = getopt(argc, argv, "r:b:d:k:" COMMON_OPTIONS)) != -1) switch (opt) {
+  case 'r': onlyRate = atol(optarg); break;
+  case 'b': onlyBuffer = atoi(optarg); break;
+  case 'd': seconds = atof(optarg); break;
+  case 'k': kits = atoi(optarg); break;
+  default: if (CommonOption(opt, optarg)) bad = 1;
+ }
+ if (bad || seconds <= 0 || kits < 1 || kits > MAX_KITS || (onlyRate && onlyRate < 8000)
+     || (onlyBuffer && (onlyBuffer < 1 || onlyBuffer > 4096))) {
+  fprintf(stderr, "usage: %s --bench [-r samplerate] [-b buffersize] "
+                  "[-d seconds] [-k kits] " COMMON_USAGE " [generator ...]\n"
+                  "generators:", argv[0]);
+  int i;
+  for (i=0; i<NUM_BENCH_CASES; i++) fprintf(stderr, " %s", g_benchCases[i].name);
+  fprintf(stderr, "\n");
+  return 1;
+ }
+
+ printf("generator,samplerate,buffer,ns_per_sample,cycles_per_block\n");
+ int i, r, buffer;
+ for (i=0; i<NUM_BENCH_CASES; i++) {
+  const BenchCase *c = &g_benchCases[i];
+  if (optind < argc) { // only the generators named on the command line
+   int a;
+   for (a=optind; a<argc && strcmp(argv[a], c->name); a++);
+   if (a == argc) continue;
+  }
+  for (r=0; r<NUM_BENCH_RATES; r++) {
+   long rate = onlyRate ? onlyRate : g_benchRates[r];
+   for (buffer=16; buffer<=4096; buffer*=2) {
+    if (onlyBuffer) buffer = onlyBuffer;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+     BenchRun(c, rate, buffer, seconds, kits);
+     fflush(stdout);
+     _exit(0);
+    }
+    if (pid > 0) waitpid(pid, NULL, 0);
+    if (onlyBuffer) break;
+   }
+   if (onlyRate) break;
+  }
+ }
+ return 0;
+}
+
+
+
+// GOLDEN OUTPUT
+// renders a fixed set of trigger scripts that between them cover every
+// kind of note (each qw region, claps & hats long and short, the
+// cowbells, cymbals 120-127), pitch bend and controller sweeps, at a few
+// sample rates. --golden -w saves them as reference WAV files; after that
+// --golden compares new renders against them, so a change that's only
+// meant to make things faster can be checked to sound the same.
+
+#define GOLDEN_MAX_EVENTS 4096
+#define GOLDEN_NOISE_TOLERANCE 1e-5 // for cases that use the noise source
+#define GOLDEN_LEVEL_BLOCK 4096 // frames per peak & RMS level in a sums file
+
+typedef struct {
+ long frame;
+ unsigned char msg[3];
+} GoldenEvent;
+
+GoldenEvent g_goldenEvents[GOLDEN_MAX_EVENTS];
+int g_numGoldenEvents;
+
+// adds an event to the script being built. the scripts add them in order
+static void GoldenAt(double seconds, int status, int channel, int data1, int data2)
+{
+ if (g_numGoldenEvents >= GOLDEN_MAX_EVENTS) return;
+ GoldenEvent *e = &g_goldenEvents[g_numGoldenEvents++];
+ e->frame = seconds * g_sampleRate + 0.5;
+ e->msg[0] = status | channel;
+ e->msg[1] = data1;
+ e->msg[2] = data2;
+}
+
+static void GoldenBend(double seconds, int channel, int value)
+{
+ value += 8192;
+ GoldenAt(seconds, MIDI_PITCHBEND, channel, value & 0x7F, value >> 7);
+}
+
+// each script adds its events and returns how many seconds to render
+
+static double GoldenToneDrums() // every tone drum note, low to high
+{
+ double t = 0;
+ int note;
+ for (note=0; note<128; note++) if (g_kits[0].qw[note] > 0) {
+  GoldenAt(t, MIDI_NOTEON, 0, note, 100);
+  t += 0.05;
+ }
+ return t + 1;
+}
+
+static double GoldenAuxTones() // every aux tone note on channel 16
+{
+ double t = 0;
+ int note;
+ for (note=0; note<128; note++) if (g_kits[0].qw[note] > 0) {
+  GoldenAt(t, MIDI_NOTEON, 15, note, 100);
+  GoldenAt(t+0.03, MIDI_NOTEOFF, 15, note, 0);
+  t += 0.05;
+ }
+ return t + 1;
+}
+
+// claps (qw 0 and -1) or hats (qw -2 and -3), loud and soft, long and
+// short, then again with their controller at each end
+static double GoldenClapsOrHats(int qw1, int qw2, int param)
+{
+ static const int tweaks[] = {-1, 0, 127};
+ double t = 0;
+ int i, note, velocity;
+ for (i=0; i<3; i++) {
+  if (tweaks[i] >= 0) GoldenAt(t, MIDI_CONTROLLER, 0, param, tweaks[i]);
+  for (note=0; note<128; note++) if (g_kits[0].qw[note] == qw1 || g_kits[0].qw[note] == qw2)
+   for (velocity=127; velocity>0; velocity-=87) {
+    GoldenAt(t, MIDI_NOTEON, 0, note, velocity);
+    t += 0.4;
+   }
+ }
+ return t + 1;
+}
+static double GoldenClaps() { return GoldenClapsOrHats(0, -1, 75); }
+static double GoldenHats()  { return GoldenClapsOrHats(-2, -3, 76); }
+
+static double GoldenCowbells() // channel 16's notes below the cymbals
+{
+ double t = 0;
+ int note;
+ GoldenAt(t, MIDI_CONTROLLER, 15, 75, 127);
+ for (note=0; note<120; note++) if (g_kits[0].qw[note] <= 0) {
+  GoldenAt(t, MIDI_NOTEON, 15, note, 100);
+  t += 0.25;
+ }
+ GoldenAt(t, MIDI_CONTROLLER, 15, 75, 0);
+ for (note=0; note<120; note++) if (g_kits[0].qw[note] <= 0) {
+  GoldenAt(t, MIDI_NOTEON, 15, note, 100);
+  t += 0.1;
+ }
+ return t + 1;
+}
+
+static double GoldenCymbals() // each of 120-127, then again with CC76 high
+{
+ double t = 0;
+ int note;
+ for (note=120; note<128; note++) {
+  GoldenAt(t, MIDI_NOTEON, 15, note, 100);
+  t += 0.5;
+ }
+ GoldenAt(t, MIDI_CONTROLLER, 15, 76, 127);
+ for (note=120; note<128; note++) {
+  GoldenAt(t, MIDI_NOTEON, 15, note, 100);
+  t += 0.3;
+ }
+ return t + 1;
+}
+
+static double GoldenPitchBend() // sweeps under a tone drum and an aux tone
+{
+ double t = 0;
+ int channel, i;
+ for (channel=0; channel<16; channel+=15) {
+  GoldenAt(t, MIDI_NOTEON, channel, channel ? 57 : 36, 100);
+  for (i=0; i<=64; i++) GoldenBend(t + i*0.01, channel, i*256 - 8192 - (i==64));
+  GoldenBend(t + 0.7, channel, 0);
+  t += 1;
+ }
+ return t + 0.5;
+}
+
+// the tone drum & aux tone controllers and volume, changed between and
+// during hits, then the reset and the all notes/sound off controllers
+static double GoldenControllers()
+{
+ static const int values[] = {0, 32, 64, 96, 127};
+ double t = 0;
+ int i;
+ for (i=0; i<5; i++) {
+  GoldenAt(t, MIDI_CONTROLLER, 0, 70, values[i]);
+  GoldenAt(t, MIDI_NOTEON, 0, 36, 100);
+  GoldenAt(t+0.1, MIDI_CONTROLLER, 0, 72, values[4-i]);
+  GoldenAt(t+0.2, MIDI_NOTEON, 0, 45, 100);
+  t += 0.5;
+ }
+ for (i=0; i<5; i++) {
+  GoldenAt(t, MIDI_CONTROLLER, 15, 71, values[i]);
+  GoldenAt(t, MIDI_CONTROLLER, 15, 72, values[4-i]);
+  GoldenAt(t, MIDI_NOTEON, 15, 57, 100);
+  GoldenAt(t+0.2, MIDI_NOTEOFF, 15, 57, 0);
+  t += 0.5;
+ }
+ for (i=0; i<5; i++) {
+  GoldenAt(t, MIDI_CONTROLLER, 0, 7, values[4-i]);
+  GoldenAt(t, MIDI_NOTEON, 0, 40, 100);
+  t += 0.25;
+ }
+ GoldenAt(t, MIDI_CONTROLLER, 0, 121, 0);
+ GoldenAt(t, MIDI_NOTEON, 0, 36, 100);
+ GoldenAt(t, MIDI_NOTEON, 15, 57, 100);
+ GoldenAt(t+0.2, MIDI_CONTROLLER, 0, 123, 0);
+ GoldenAt(t+0.5, MIDI_NOTEON, 0, 36, 100);
+ GoldenAt(t+0.5, MIDI_NOTEON, 15, 64, 100);
+ GoldenAt(t+0.7, MIDI_CONTROLLER, 0, 120, 0);
+ return t + 1.5;
+}
+
+static double GoldenGhosts() // two tone drums at once, on one channel
+{
+ double t = 0;
+ int i;
+ for (i=0; i<6; i++) {
+  GoldenAt(t, MIDI_NOTEON, 0, 36 + i*4, 100);
+  GoldenAt(t, MIDI_NOTEON, 0, 40 + i*6, 80);
+  t += 0.4;
+ }
+ return t + 1;
+}
+
+typedef struct {
+ const char *name;
+ double (*script)();
+ int noisy; // uses the noise source, so it only has to come close
+} GoldenCase;
+
+static const GoldenCase g_goldenCases[] = {
+ {"tonedrums",   GoldenToneDrums,   0},
+ {"auxtones",    GoldenAuxTones,    0},
+ {"claps",       GoldenClaps,       1},
+ {"hihats",      GoldenHats,        1},
+ {"cowbells",    GoldenCowbells,    0},
+ {"cymbals",     GoldenCymbals,     0},
+ {"pitchbend",   GoldenPitchBend,   0},
+ {"controllers", GoldenControllers, 0},
+ {"ghosts",      GoldenGhosts,      1},
+};
+#define NUM_GOLDEN_CASES (sizeof(g_goldenCases)/sizeof(GoldenCase))
+
+static const long g_goldenRates[] = {44100, 48000, 96000};
+#define NUM_GOLDEN_RATES (sizeof(g_goldenRates)/sizeof(long))
+
+// renders one case at g_sampleRate, the same way --render does.
+// returns the number of frames in *out (malloc'd)
+static long GoldenRender(const GoldenCase *c, sample_t **out)
+{
+ SetUpKits();
+ Kit *k = &g_kits[0];
+ ClaimKit(k);
+ g_numGoldenEvents = 0;
+ long total = c->script() * g_sampleRate;
+ sample_t *buf = calloc(total, sizeof(sample_t));
+ long frame = 0;
+ int e;
+ for (e=0; e<=g_numGoldenEvents; e++) {
+  long until = (e < g_numGoldenEvents) ? g_goldenEvents[e].frame : total;
+  if (until > total) until = total;
+  while (frame < until) {
+   int len = (until - frame < RENDER_BLOCK) ? until - frame : RENDER_BLOCK;
+   Synthesize(k, buf + frame, len);
+   frame += len;
+  }
+  if (e < g_numGoldenEvents) HandleMIDIMessage(k, g_goldenEvents[e].msg, 3);
+ }
+ *out = buf;
+ return total;
+}
+
+// reads a 32-bit float WAV file written by WavWrite().
+// returns the number of frames, or -1
+static long GoldenRead(const char *filename, sample_t **out)
+{
+ FILE *file = fopen(filename, "rb");
+ if (!file) return -1;
+ unsigned char header[44];
+ long frames = -1;
+ if (fread(header, 1, 44, file) == 44 && !memcmp(header, "RIFF", 4)
+     && header[20] == 3 && header[34] == 32) { // float, 32 bits
+  unsigned long size = header[40] | header[41]<<8 | header[42]<<16 | (unsigned long)header[43]<<24;
+  frames = size / 4;
+  *out = malloc(frames * sizeof(sample_t));
+  long i;
+  for (i=0; i<frames; i++) {
+   unsigned char b[4];
+   union { float f; unsigned u; } x;
+   if (fread(b, 1, 4, file) < 4) break;
+   x.u = b[0] | b[1]<<8 | b[2]<<16 | (unsigned)b[3]<<24;
+   (*out)[i] = x.f;
+  }
+  if (i < frames) { free(*out); frames = -1; }
+ }
+ fclose(file);
+ return frames;
+}
+
+// a checksum of a render, of its samples as they'd be in the WAV file
+// (64 bit FNV-1a), so a whole set of references fits in a few lines
+static unsigned long long GoldenHash(const sample_t *out, long frames)
+{
+ unsigned long long hash = 14695981039346656037ULL;
+ long f;
+ int b;
+ for (f=0; f<frames; f++) {
+  union { float f; uint32_t u; } x;
+  x.f = out[f];
+  for (b=0; b<32; b+=8) hash = (hash ^ ((x.u >> b) & 0xFF)) * 1099511628211ULL;
+ }
+ return hash;
+}
+
+// what the renders depend on besides the code, as the checksum files
+// have it
+static void GoldenSettings(char *line)
+{
+ static const char *chokes[] = {"all", "channel", "none"};
+#ifdef SNAPPY_FIXED
+ const char *build = "fixed";
+#else
+ const char *build = "float";
+#endif
+ sprintf(line, "settings %s -v %d -g %s -s %u -c %d", build, g_kitSettings.voices,
+         chokes[g_kitSettings.chokeMode], g_kitSettings.seed, g_kitSettings.toneCacheMs);
+}
 
- initscr(); // curses interface
- while (g_sampleRate < 1) sleep(1); // wait for JACK thread to set sampleRate
+// the peak and RMS level of a block of a render
+static void GoldenLevels(const sample_t *out, long frames, double *peak, double *rms)
+{
+ double sum = 0;
+ long f;
+ *peak = 0;
+ for (f=0; f<frames; f++) {
+  double x = out[f];
+  if (!(fabs(x) <= *peak)) *peak = fabs(x); // (NaNs count too)
+  sum += x*x;
+ }
+ *rms = sqrt(sum / frames);
+}
+
+// a noisy case can't have a checksum (it only has to come close), so the
+// sums file has the peak and RMS level of each block of it, one per line
+static void GoldenWriteLevels(FILE *sums, const sample_t *out, long frames)
+{
+ long f;
+ fprintf(sums, " levels %d\n", GOLDEN_LEVEL_BLOCK);
+ for (f=0; f<frames; f+=GOLDEN_LEVEL_BLOCK) {
+  double peak, rms;
+  GoldenLevels(out+f, (frames-f < GOLDEN_LEVEL_BLOCK) ? frames-f : GOLDEN_LEVEL_BLOCK, &peak, &rms);
+  fprintf(sums, "+ %.17g %.17g\n", peak, rms);
+ }
+}
 
- SetUpNotes();
+// checks a render against the levels after its line in a sums file. if a
+// block's samples are all within 'allowed', so are its peak and RMS.
+// returns how far off the worst block is (-1 if the levels are cut short),
+// and where it starts in *at
+static double GoldenCheckLevels(FILE *sums, int block, const sample_t *out, long frames, long *at)
+{
+ double maxDiff = 0;
+ long f;
+ for (f=0; f<frames; f+=block) {
+  char line[128];
+  double refPeak, refRms, peak, rms;
+  if (!fgets(line, sizeof(line), sums) || sscanf(line, "+ %lf %lf", &refPeak, &refRms) < 2)
+   return -1;
+  GoldenLevels(out+f, (frames-f < block) ? frames-f : block, &peak, &rms);
+  double diff = fmax(fabs(peak - refPeak), fabs(rms - refRms));
+  if (!(diff <= maxDiff)) { maxDiff = diff; *at = f; }
+ }
+ return maxDiff;
+}
+
+// finds a render's line in a sums file: its frames, and its checksum or
+// (for a noisy case) its level block size, with the levels up next.
+// returns 0 if it's there
+static int GoldenFindSum(FILE *sums, const char *name, long *frames,
+                         unsigned long long *hash, int *block)
+{
+ char line[256], word[64];
+ rewind(sums);
+ while (fgets(line, sizeof(line), sums)) {
+  if (sscanf(line, "%63s %ld", word, frames) < 2 || strcmp(word, name)) continue;
+  *hash = 0;
+  *block = 0;
+  if (sscanf(line, "%*s %*d levels %d", block) == 1 && *block > 0) return 0;
+  return sscanf(line, "%*s %*d %llx", hash) == 1 ? 0 : -1;
+ }
+ return -1;
+}
+
+// handles the command line for "snappy-drums --golden ..."
+int GoldenMain(int argc, char *argv[])
+{
+ int write = 0;
+ long onlyRate = 0;
+ double tolerance = -1; // -1: exact, or GOLDEN_NOISE_TOLERANCE for noisy cases
+ int opt, bad = 0;
+ while ((opt = getopt(argc, argv, "wr:e:" COMMON_OPTIONS)) != -1) switch (opt) {
+  case 'w': write = 1; break;
+  case 'r': onlyRate = atol(optarg); break;
+  case 'e': tolerance = atof(optarg); break;
+  default: if (CommonOption(opt, optarg)) bad = 1;
+ }
+ if (bad || optind >= argc || (onlyRate && onlyRate < 8000)) {
+  fprintf(stderr, "usage: %s --golden [-w] [-r samplerate] [-e tolerance] "
+                  COMMON_USAGE " directory|sums.txt [case ...]\n"
+                  "cases:", argv[0]);
+  int i;
+  for (i=0; i<NUM_GOLDEN_CASES; i++) fprintf(stderr, " %s", g_goldenCases[i].name);
+  fprintf(stderr, "\n");
+  return 1;
+ }
+ const char *dir = argv[optind++];
+
+ // -w also writes a checksum of each render to dir/sums.txt (or for a
+ // noisy case, its levels). given a file like that instead of a
+ // directory, it checks against the sums: exactly, but for the noisy
+ // cases, which get the same tolerance as against the WAVs
+ char settings[128], line[256];
+ GoldenSettings(settings);
+ FILE *sums = NULL;
+ struct stat st;
+ if (write) {
+  char filename[strlen(dir) + 16];
+  sprintf(filename, "%s/sums.txt", dir);
+  if (!(sums = fopen(filename, "w"))) { perror(filename); return 1; }
+  fprintf(sums, "# made by snappy-drums --golden -w: case-samplerate, frames, checksum\n"
+                "# (or \"levels\" and the block size, then the peak & RMS of each block)\n%s\n", settings);
+ }
+ else if (!stat(dir, &st) && S_ISREG(st.st_mode)) {
+  if (!(sums = fopen(dir, "r"))) { perror(dir); return 1; }
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), sums)) found = !strncmp(line, "settings ", 9);
+  line[strcspn(line, "\n")] = 0;
+  if (!found || strcmp(line, settings)) {
+   printf("%s: made with other settings (%s), not %s\n", dir, found ? line+9 : "unknown", settings+9);
+   fclose(sums);
+   return 1;
+  }
+ }
+
+ int i, r, failed = 0;
+ for (i=0; i<NUM_GOLDEN_CASES; i++) {
+  const GoldenCase *c = &g_goldenCases[i];
+  if (optind < argc) { // only the cases named on the command line
+   int a;
+   for (a=optind; a<argc && strcmp(argv[a], c->name); a++);
+   if (a == argc) continue;
+  }
+  for (r=0; r<NUM_GOLDEN_RATES; r++) {
+   g_sampleRate = onlyRate ? onlyRate : g_goldenRates[r];
+   char filename[strlen(dir) + 64];
+   sprintf(filename, "%s/%s-%ld.wav", dir, c->name, g_sampleRate);
+   sample_t *out, *ref;
+   long frames = GoldenRender(c, &out);
+   unsigned long long hash = GoldenHash(out, frames), refHash;
+   long refFrames, at = 0;
+   int block;
+   double allowed = (tolerance >= 0) ? tolerance : c->noisy ? GOLDEN_NOISE_TOLERANCE : 0;
+
+   if (write) {
+    WavFile wav;
+    if (WavOpen(&wav, filename, 1, 32)) return 1;
+    WavWrite(&wav, out, frames);
+    WavClose(&wav);
+    fprintf(sums, "%s-%ld %ld", c->name, g_sampleRate, frames);
+    if (c->noisy) GoldenWriteLevels(sums, out, frames);
+    else fprintf(sums, " %016llx\n", hash);
+    printf("%s: wrote %ld frames\n", filename, frames);
+   }
+   else if (sums) {
+    sprintf(filename, "%s-%ld", c->name, g_sampleRate);
+    if (GoldenFindSum(sums, filename, &refFrames, &refHash, &block)) {
+     printf("%s: FAILED, no checksum for it\n", filename);
+     failed++;
+    }
+    else if (refFrames != frames) {
+     printf("%s: FAILED, %ld frames, not %ld\n", filename, frames, refFrames);
+     failed++;
+    }
+    else if (block) { // (a noisy case)
+     double maxDiff = GoldenCheckLevels(sums, block, out, frames, &at);
+     if (maxDiff < 0) {
+      printf("%s: FAILED, its levels are cut short\n", filename);
+      failed++;
+     }
+     else if (maxDiff == 0) printf("%s: ok, same levels\n", filename);
+     else if (maxDiff <= allowed) printf("%s: ok, levels off by up to %g\n", filename, maxDiff);
+     else {
+      printf("%s: FAILED, levels off by up to %g in the block at frame %ld (allowed %g)\n",
+             filename, maxDiff, at, allowed);
+      failed++;
+     }
+    }
+    else if (refHash != hash) {
+     printf("%s: FAILED, not the same as the reference (compare WAVs from -w to see how far off)\n", filename);
+     failed++;
+    }
+    else printf("%s: ok, identical\n", filename);
+   }
+   else {
+    refFrames = GoldenRead(filename, &ref);
+    if (refFrames < 0) {
+     printf("%s: FAILED, can't read it (make it with -w)\n", filename);
+     failed++;
+    }
+    else if (refFrames != frames) {
+     printf("%s: FAILED, %ld frames, not %ld\n", filename, frames, refFrames);
+     failed++;
+    }
+    else {
+     double maxDiff = 0;
+     long f;
+     for (f=0; f<frames; f++) {
+      double diff = fabs(out[f] - ref[f]);
+      if (!(diff <= maxDiff)) { maxDiff = diff; at = f; } // (NaNs count too)
+     }
+     if (!memcmp(out, ref, frames*sizeof(sample_t)))
+      printf("%s: ok, identical\n", filename);
+     else if (maxDiff <= allowed && allowed > 0)
+      printf("%s: ok, off by up to %g\n", filename, maxDiff);
+     else {
+      printf("%s: FAILED, off by up to %g at frame %ld (allowed %g)\n",
+             filename, maxDiff, at, allowed);
+      failed++;
+     }
+     free(ref);
+    }
+   }
+   free(out);
+   if (onlyRate) break;
+  }
+ }
+ if (sums) fclose(sums);
+ if (failed) printf("%d FAILED\n", failed);
+ return failed ? 1 : 0;
+}
+
+
+// SAMPLE PACK EXPORT
+// renders one-shots of every note that makes a sound of its own, at each
+// of a list of velocities and controller settings, to one WAV file each,
+// plus an index.json describing them. each one-shot starts from a fresh
+// kit and stops when the kit has died away to silence. the work is split
+// between forked processes, one per CPU, like the benchmarks.
+
+#define EXPORT_MAX_CCS 4 // controllers that can be varied (-C)
+#define EXPORT_MAX_VALUES 16 // values per controller, and velocities
+#define EXPORT_SILENCE (0.5/8388608) // half a 24 bit step
+#define EXPORT_UNRENDERED -2 // a job's length until a worker has rendered it
+
+typedef struct {
+ int channel, note, velocity;
+ int cc[EXPORT_MAX_CCS]; // values, for the controllers in the ExportGrid
+ const char *kind;
+} ExportJob;
+
+typedef struct {
+ int nccs;
+ int ccs[EXPORT_MAX_CCS];     // controller numbers
+ int nvalues[EXPORT_MAX_CCS];
+ int values[EXPORT_MAX_CCS][EXPORT_MAX_VALUES];
+ int nvelocities;
+ int velocities[EXPORT_MAX_VALUES];
+} ExportGrid;
+
+// what every worker gets to go by
+typedef struct {
+ const ExportGrid *grid;
+ const ExportJob *jobs;
+ long njobs;
+ long *lengths; // in shared memory: each job's, for the index (-1 if it failed)
+ const char *dir;
+ int bits;
+ long maxFrames, noteFrames;
+ Kit fresh; // the first kit, just set up: where each job starts from
+} Export;
+
+// what a note plays on its channel (0 or 15). NULL if it's the same sound
+// as a lower note on that channel, so it doesn't need exporting again
+static const char* ExportKind(int channel, int note)
+{
+ int qw = g_kits[0].qw[note], n;
+ if (channel == 15 && qw <= 0) return note >= 120 ? "cymbal" : "cowbell";
+ for (n=0; n<note; n++) if (g_kits[0].qw[n] == qw) return NULL;
+ if (qw > 0) return channel == 15 ? "auxtone" : "tonedrum";
+ return qw >= -1 ? "clap" : "hihat";
+}
+
+// a rough upper bound on how loud the kit could still get, from the state
+// of its generators, so an export knows when there's nothing left to hear
+static sample_t KitLevel(const Kit *k)
+{
+ const KitState *s = &k->state;
+ sample_t level = 0;
+ int i;
+ if (s->voiceEventCount || s->newClap || s->newHighHat || s->newCowbell || s->newCymbal)
+  return 1;
+ for (i=0; i<s->activeVoices; i++)
+  level += fabsf(LEVEL_FLOAT(s->voices[i].a)) + fabsf(LEVEL_FLOAT(s->voices[i].s))
+         + fabsf(LEVEL_FLOAT(s->voices[i].ds));
+ level += 4*(fabsf(COEF_FLOAT(s->ca)) + fabsf(COEF_FLOAT(s->ha))); // (the noise filters have a gain of up to 4)
+ if (s->cbWaveScale*3 <= k->quarterWaveFade) level += fabsf(COEF_FLOAT(s->cbA)) * 40 * s->cbWaveScale;
+ int sum = 0, max = 0;
+ for (i=0; i<CYMBAL_N; i++) {
+  sum += s->cymTones[i];
+  if (s->cymTones[i] > max) max = s->cymTones[i];
+ }
+ // the cymbal's lowpass filter can only move f*(the input's range) per
+ // sample, and its input flips at least every max samples
+ if (s->cymA != 0) level += fabsf(LEVEL_FLOAT(s->cymA)) * sum * 4 * fminf(1, COEF_FLOAT(s->cymF) * max);
+ return level;
+}
+
+// renders one job into buf (at most maxFrames), and returns its length
+static long ExportRender(const Export *e, const ExportJob *job, sample_t *buf)
+{
+ const ExportGrid *grid = e->grid;
+ const long maxFrames = e->maxFrames, noteFrames = e->noteFrames;
+ Kit *k = &g_kits[0];
+ CopyKit(k, &e->fresh); // (a fresh start)
+ int i;
+ for (i=0; i<grid->nccs; i++)
+  HandleMIDI(k, MIDI_CONTROLLER, job->channel, grid->ccs[i], job->cc[i]);
+ HandleMIDI(k, MIDI_NOTEON, job->channel, job->note, job->velocity);
+
+ long frame = 0, end = 0;
+ while (frame < maxFrames) {
+  int len = (maxFrames - frame < 256) ? maxFrames - frame : 256;
+  if (job->channel == 15 && frame < noteFrames && frame+len > noteFrames) len = noteFrames - frame;
+  if (frame == noteFrames && job->channel == 15)
+   HandleMIDI(k, MIDI_NOTEOFF, job->channel, job->note, 0);
+  Synthesize(k, buf + frame, len);
+  frame += len;
+  if (KitLevel(k) < EXPORT_SILENCE) break;
+ }
+ // trimmed after the last sample that isn't silent
+ for (end=frame; end>0 && fabsf(buf[end-1]) < EXPORT_SILENCE; end--);
+ return end;
+}
+
+static void ExportFileName(char *name, const ExportGrid *grid, const ExportJob *job)
+{
+ int i;
+ name += sprintf(name, "%s-%03d-v%03d", job->kind, job->note, job->velocity);
+ for (i=0; i<grid->nccs; i++) name += sprintf(name, "-cc%d_%03d", grid->ccs[i], job->cc[i]);
+ strcpy(name, ".wav");
+}
+
+// renders the jobs from 'first' on, every step'th one, that nobody has
+// rendered yet, into their files. returns -1 if it couldn't start
+static int ExportWorker(const Export *e, long first, long step)
+{
+ sample_t *buf = malloc(e->maxFrames * sizeof(sample_t));
+ if (!buf) return -1;
+ char name[strlen(e->dir) + 128];
+ long n;
+ ClaimKit(&g_kits[0]);
+ for (n=first; n<e->njobs; n+=step) {
+  if (e->lengths[n] != EXPORT_UNRENDERED) continue;
+  long length = ExportRender(e, &e->jobs[n], buf);
+  if (length > 0) { // (0 is too low to hear: see LOW_FREQUENCY_CUTOFF)
+   WavFile wav;
+   sprintf(name, "%s/", e->dir);
+   ExportFileName(name + strlen(name), e->grid, &e->jobs[n]);
+   if (WavOpen(&wav, name, 1, e->bits)) length = -1;
+   else {
+    WavWrite(&wav, buf, length);
+    WavClose(&wav);
+   }
+  }
+  e->lengths[n] = length;
+ }
+ free(buf);
+ return 0;
+}
+
+// reads a list like "32,64,127" of numbers from 0 to 127. returns how many
+static int ReadValueList(const char *s, int *values)
+{
+ int n = 0;
+ char *end;
+ while (n < EXPORT_MAX_VALUES) {
+  long v = strtol(s, &end, 10);
+  if (end == s || v < 0 || v > 127) return 0;
+  values[n++] = v;
+  if (*end != ',') break;
+  s = end+1;
+ }
+ return *end ? 0 : n;
+}
+
+// handles the command line for "snappy-drums --export ..."
+int ExportMain(int argc, char *argv[])
+{
+ ExportGrid grid = {0};
+ int bits = 24;
+ int workers = sysconf(_SC_NPROCESSORS_ONLN);
+ double noteSeconds = 0.5, maxSeconds = 20;
+ g_sampleRate = 48000;
+ grid.nvelocities = ReadValueList("32,64,96,127", grid.velocities);
+ int opt, bad = 0;
+ while ((opt = getopt(argc, argv, "r:b:j:V:C:n:l:" COMMON_OPTIONS)) != -1) switch (opt) {
+  case 'r': g_sampleRate = atol(optarg); break;
+  case 'b': bits = atoi(optarg); break;
+  case 'j': workers = atoi(optarg); break;
+  case 'V':
+   grid.nvelocities = ReadValueList(optarg, grid.velocities);
+   if (!grid.nvelocities) bad = 1;
+  break;
+  case 'C':
+  {
+   int cc = strtol(optarg, NULL, 10);
+   const char *eq = strchr(optarg, '=');
+   if (grid.nccs >= EXPORT_MAX_CCS || !eq || cc < 0 || cc > 119) { bad = 1; break; }
+   grid.ccs[grid.nccs] = cc;
+   grid.nvalues[grid.nccs] = ReadValueList(eq+1, grid.values[grid.nccs]);
+   if (!grid.nvalues[grid.nccs++]) bad = 1;
+  }
+  break;
+  case 'n': noteSeconds = atof(optarg); break;
+  case 'l': maxSeconds = atof(optarg); break;
+  default: if (CommonOption(opt, optarg)) bad = 1;
+ }
+ if (bad || optind >= argc || g_sampleRate < 8000 || (bits != 24 && bits != 32)
+     || workers < 1 || maxSeconds <= 0) {
+  fprintf(stderr, "usage: %s --export [-r samplerate] [-b 24|32] [-j jobs] "
+                  "[-V velocities] [-C controller=values ...] [-n noteseconds] "
+                  "[-l maxseconds] " COMMON_USAGE " directory [kind ...]\n"
+                  "kinds: tonedrum clap hihat auxtone cowbell cymbal\n", argv[0]);
+  return 1;
+ }
+ const char *dir = argv[optind++];
+ char name[strlen(dir) + 128];
+ sprintf(name, "%s/index.json", dir);
+ FILE *index = fopen(name, "w"); // (written at the end)
+ if (!index) { perror(name); return 1; }
+ SetUpKits();
+
+ // the grid: each note on channels 1 and 16, times the velocities,
+ // times each controller's values
+ int combos = grid.nvelocities, i, j, channel, note;
+ for (i=0; i<grid.nccs; i++) combos *= grid.nvalues[i];
+ ExportJob *jobs = malloc(256 * combos * sizeof(ExportJob));
+ if (!jobs) { fprintf(stderr, "export: out of memory\n"); return 1; }
+ long njobs = 0;
+ for (channel=0; channel<16; channel+=15) for (note=0; note<128; note++) {
+  const char *kind = ExportKind(channel, note);
+  if (!kind) continue;
+  if (optind < argc) { // only the kinds named on the command line
+   int a;
+   for (a=optind; a<argc && strcmp(argv[a], kind); a++);
+   if (a == argc) continue;
+  }
+  for (j=0; j<combos; j++) {
+   ExportJob *job = &jobs[njobs++];
+   int rest = j;
+   job->channel = channel;
+   job->note = note;
+   job->kind = kind;
+   job->velocity = grid.velocities[rest % grid.nvelocities];
+   rest /= grid.nvelocities;
+   for (i=0; i<grid.nccs; i++) {
+    job->cc[i] = grid.values[i][rest % grid.nvalues[i]];
+    rest /= grid.nvalues[i];
+   }
+  }
+ }
+
+ // each worker takes every workers'th job, and leaves the lengths it
+ // rendered in shared memory for the index
+ static Export e; // (it's big)
+ e.grid = &grid;
+ e.jobs = jobs;
+ e.njobs = njobs;
+ e.lengths = mmap(NULL, (njobs ? njobs : 1) * sizeof(long), PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+ if (e.lengths == MAP_FAILED) { perror("mmap"); return 1; }
+ long *lengths = e.lengths, n;
+ for (n=0; n<njobs; n++) lengths[n] = EXPORT_UNRENDERED;
+ e.dir = dir;
+ e.bits = bits;
+ e.maxFrames = maxSeconds * g_sampleRate;
+ e.noteFrames = noteSeconds * g_sampleRate;
+ if (SetUpKit(&e.fresh, &g_kits[0].settings)) return 1;
+ struct timespec start, stop;
+ clock_gettime(CLOCK_MONOTONIC, &start);
+ int w;
+ fflush(stdout);
+ for (w=0; w<workers && w<njobs; w++) {
+  pid_t pid = fork();
+  if (pid < 0) { perror("fork"); break; } // (the rest get rendered here)
+  if (pid == 0) _exit(ExportWorker(&e, w, workers) ? 1 : 0);
+ }
+ while (wait(NULL) > 0);
+ // whatever a worker didn't get to (it couldn't start, or died) gets
+ // rendered here instead
+ for (n=0; n<njobs && lengths[n] != EXPORT_UNRENDERED; n++);
+ if (n < njobs && ExportWorker(&e, n, 1)) {
+  fprintf(stderr, "export: out of memory\n");
+  return 1;
+ }
+ clock_gettime(CLOCK_MONOTONIC, &stop);
+
+ // the index
+ fprintf(index, "{\n \"samplerate\": %ld,\n \"bits\": %d,\n \"samples\": [", g_sampleRate, bits);
+ long failed = 0, silent = 0, first = 1;
+ for (n=0; n<njobs; n++) {
+  const ExportJob *job = &jobs[n];
+  if (lengths[n] < 0) { failed++; continue; }
+  if (lengths[n] == 0) { silent++; continue; }
+  ExportFileName(name, &grid, job);
+  fprintf(index, "%s\n  {\"file\": \"%s\", \"kind\": \"%s\", \"channel\": %d, \"note\": %d, "
+                 "\"velocity\": %d, \"controllers\": {", first ? "" : ",", name, job->kind,
+                 job->channel+1, job->note, job->velocity);
+  for (i=0; i<grid.nccs; i++) fprintf(index, "%s\"%d\": %d", i ? ", " : "", grid.ccs[i], job->cc[i]);
+  fprintf(index, "}, \"frames\": %ld}", lengths[n]);
+  first = 0;
+ }
+ fprintf(index, "\n ]\n}\n");
+ fclose(index);
+
+ double elapsed = (stop.tv_sec - start.tv_sec) + 1e-9*(stop.tv_nsec - start.tv_nsec);
+ fprintf(stderr, "exported %ld one-shots in %.2f seconds, with %d workers",
+         njobs - failed - silent, elapsed, workers);
+ if (silent) fprintf(stderr, " (%ld more were silent)", silent);
+ fprintf(stderr, "\n");
+ return failed ? 1 : 0;
+}
+
+
+
+// DISK RECORDER
+// with -R file.wav, whatever goes out of the JACK ports also goes to disk:
+// "out" to that file, and every other output port (with -m or -k) to a
+// file next to it, named after the port, like file-tonedrums.wav.
+// the audio thread only copies each period into a ring buffer that was
+// allocated and locked into memory at startup; it never makes a system
+// call. a low priority thread writes the ring out in big blocks, each one
+// starting on a disk block. if the disk falls behind and the ring fills up,
+// whole periods get dropped, and counted (record_dropped in the stats).
+
+#define RECORD_CHUNK 16384  // frames per write (64k of float samples)
+#define RECORD_HEADER 4096  // bytes before the data in each file
+#define RECORD_SECONDS 4    // at least this much fits in the ring
+#define RECORD_MAX_STEMS (1 + MAX_KITS*(1+NUM_BUSES))
+
+typedef struct {
+ int nstems;
+ sample_t **stems[RECORD_MAX_STEMS]; // where each stem's buffer is this period
+ WavFile wavs[RECORD_MAX_STEMS];     // (the first stem is "out")
+ sample_t *ring;  // one ring per stem, one after another
+ unsigned size;   // frames in each ring: a power of 2, and a multiple of RECORD_CHUNK
+ unsigned in;     // frames put in by the audio thread,
+ unsigned out;    // and taken out by the writer
+ int stop;
+ int failed;
+ pthread_t thread;
+} Recorder;
+Recorder g_recorder;
+
+// called by My_Process() after all the kits are done
+static void RecordPeriod(const sample_t *out, unsigned nframes)
+{
+ Recorder *r = &g_recorder;
+ unsigned in = r->in;
+ if (r->size - (in - __atomic_load_n(&r->out, __ATOMIC_ACQUIRE)) < nframes) {
+  __atomic_store_n(&g_stats.recordDropped, g_stats.recordDropped + nframes, __ATOMIC_RELAXED);
+  return;
+ }
+ unsigned pos = in & (r->size-1);
+ unsigned first = (nframes < r->size - pos) ? nframes : r->size - pos;
+ int i;
+ for (i=0; i<r->nstems; i++) {
+  const sample_t *from = i ? *r->stems[i] : out;
+  sample_t *ring = r->ring + (size_t)i*r->size;
+  memcpy(ring + pos, from, first*sizeof(sample_t));
+  memcpy(ring, from + first, (nframes - first)*sizeof(sample_t));
+ }
+ __atomic_store_n(&r->in, in + nframes, __ATOMIC_RELEASE);
+}
+
+// writes n frames of each stem, from ring position 'from' (no wrapping)
+static int RecordWrite(Recorder *r, unsigned from, unsigned n)
+{
+ int i;
+ for (i=0; i<r->nstems; i++) {
+  WavFile *wav = &r->wavs[i];
+  const char *data = (const char*)(r->ring + (size_t)i*r->size + (from & (r->size-1)));
+  size_t left = n*sizeof(sample_t);
+  while (left) {
+   ssize_t done = write(fileno(wav->file), data, left);
+   if (done < 0 && errno == EINTR) continue;
+   if (done < 0) return -1;
+   data += done;
+   left -= done;
+  }
+  wav->frames += n;
+ }
+ return 0;
+}
+
+// the writer. it wakes up now and then, and writes out every whole chunk
+// in the ring; when it's told to stop, it writes the rest and closes up
+void* RecordThread (void *arg)
+{
+ Recorder *r = &g_recorder;
+ // a WAV file can't hold more than 4 GB
+ const unsigned long maxFrames = (0xFFFFFFFFul - RECORD_HEADER) / sizeof(sample_t);
+ int i, stopping = 0;
+ setpriority(PRIO_PROCESS, 0, 10); // (on Linux, this only lowers this thread)
+ while (!stopping) {
+  stopping = __atomic_load_n(&r->stop, __ATOMIC_ACQUIRE);
+  if (!stopping) usleep(20000);
+  unsigned in = __atomic_load_n(&r->in, __ATOMIC_ACQUIRE);
+  unsigned out = r->out;
+  while (in - out >= RECORD_CHUNK || (stopping && in != out)) {
+   unsigned n = in - out;
+   if (n > RECORD_CHUNK) n = RECORD_CHUNK;
+   if (n > r->size - (out & (r->size-1))) n = r->size - (out & (r->size-1));
+   if (!r->failed && r->wavs[0].frames + n > maxFrames) {
+    fprintf(stderr, "recorder: the files are full (4 GB), so that's all\n");
+    r->failed = 1;
+   }
+   if (!r->failed && RecordWrite(r, out, n)) {
+    perror("recorder");
+    r->failed = 1;
+   }
+   out += n; // (after a failure, the ring just gets emptied)
+   __atomic_store_n(&r->out, out, __ATOMIC_RELEASE);
+  }
+ }
+ for (i=0; i<r->nstems; i++) WavClose(&r->wavs[i]);
+ return NULL;
+}
+
+// opens the files and starts the writer. g_sampleRate must already be set
+int RecordStart(const char *fileName)
+{
+ Recorder *r = &g_recorder;
+ char names[RECORD_MAX_STEMS][32];
+ int i, n;
+ r->nstems = 1;
+ for (n=0; n<g_numKits; n++) {
+  KitIO *io = &g_kitIO[n];
+  if (g_numKits > 1) {
+   sprintf(names[r->nstems], "kit%d_out", n+1);
+   r->stems[r->nstems++] = &io->out;
+  }
+  if (g_multiOut) for (i=0; i<NUM_BUSES; i++) {
+   if (g_numKits > 1) sprintf(names[r->nstems], "kit%d_%s", n+1, g_busNames[i]);
+   else strcpy(names[r->nstems], g_busNames[i]);
+   r->stems[r->nstems++] = &io->bus[i];
+  }
+ }
+
+ r->size = RECORD_CHUNK;
+ while (r->size < RECORD_SECONDS * g_sampleRate) r->size *= 2;
+ size_t bytes = (size_t)r->nstems * r->size * sizeof(sample_t);
+ r->ring = aligned_alloc(RECORD_HEADER, bytes);
+ if (!r->ring) { fprintf(stderr, "recorder: out of memory\n"); return -1; }
+ memset(r->ring, 0, bytes); // (touch every page now, not on the audio thread)
+ if (mlock(r->ring, bytes)) perror("recorder: can't lock the ring buffer in memory");
+
+ size_t baseLength = strlen(fileName);
+ if (baseLength > 4 && !strcasecmp(fileName + baseLength - 4, ".wav")) baseLength -= 4;
+ for (i=0; i<r->nstems; i++) {
+  char name[baseLength + 40];
+  if (i == 0) strcpy(name, fileName);
+  else sprintf(name, "%.*s-%s.wav", (int)baseLength, fileName, names[i]);
+  WavFile *wav = &r->wavs[i];
+  if (!(wav->file = fopen(name, "wb"))) { perror(name); return -1; }
+  wav->channels = 1;
+  wav->bits = 32;
+  wav->frames = 0;
+  wav->junk = RECORD_HEADER - 52; // (the rest of the header is 52 bytes)
+  WriteWavHeader(wav); // sizes get filled in by WavClose()
+  fflush(wav->file);
+ }
+ pthread_create(&r->thread, NULL, RecordThread, NULL);
+ return 0;
+}
+
+// stops the writer, once the audio has stopped, and waits for the files
+void RecordStop()
+{
+ Recorder *r = &g_recorder;
+ __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+ pthread_join(r->thread, NULL);
+ unsigned long long dropped = __atomic_load_n(&g_stats.recordDropped, __ATOMIC_RELAXED);
+ fprintf(stderr, "recorded %ld frames", r->wavs[0].frames);
+ if (dropped) fprintf(stderr, " (%llu were dropped: the disk couldn't keep up)", dropped);
+ fprintf(stderr, "\n");
+}
+
+
+// FLIGHT RECORDER
+// with -F dir, the last few seconds of "out", every MIDI event, key and
+// sequencer command that came in, and how long each callback took, are
+// always kept in rings that were allocated and locked into memory at
+// startup. after an xrun (or on SIGUSR1, or the daemon's "flight"
+// command) a low priority thread waits a moment, so the aftermath is in
+// there too, then copies the rings and writes them to dir, as
+// flight-<time>.wav and flight-<time>.json, which lines it all up by frame.
+// on the audio threads it costs a copy of each period, a few stores per
+// callback and one per MIDI event, with no locks and no system calls; that
+// time is flight_ns in the stats. the rings are never emptied: the oldest
+// things just get written over.
+
+#define FLIGHT_SECONDS   4    // at least this much audio fits in the ring
+#define FLIGHT_CALLBACKS 8192 // callbacks kept (a power of 2)
+#define FLIGHT_EVENTS    1024 // events kept in each ring (a power of 2)
+#define FLIGHT_AFTER_MS  500  // how long a dump waits, to catch the aftermath
+#define FLIGHT_SLACK     8192 // the most frames a period could write during a copy
+
+typedef struct {
+ jack_nframes_t frame; // JACK's frame time: exact for JACK MIDI, else when it came in
+ int kit;
+ int source;           // 'j' JACK MIDI, 'a' ALSA MIDI, 'k' the keyboard, 'd' the daemon
+ int status, channel, param, value; // the same as HandleMIDI()'s, or CONTROL_KEY,
+                                    // 0xC0 (a pattern), FLIGHT_START or FLIGHT_STOP
+} FlightEvent;
+
+typedef struct {
+ FlightEvent events[FLIGHT_EVENTS];
+ unsigned in; // events put in
+} FlightEventRing;
+
+typedef struct {
+ jack_nframes_t frame; // JACK's frame time at the start of the period
+ unsigned audioIn;     // where the period starts in the audio ring
+ unsigned nframes;
+ unsigned ns;          // how long the callback took
+ int voices;
+} FlightCallback;
+
+typedef struct {
+ sample_t *audio;  // the ring of "out"
+ unsigned size;    // frames in it: a power of 2
+ unsigned in;      // frames put in by the JACK thread
+ FlightCallback *callbacks;
+ unsigned ncallbacks; // callbacks put in
+ FlightEventRing *rings; // one for each kit (only its audio thread writes it),
+ int nrings;             // then one for the other threads, under the lock
+ pthread_mutex_t lock;
+ int reasons; // FLIGHT_XRUN etc, since the last dump
+ sem_t wake;
+ // the dump's copies of it all (only the dump thread touches these)
+ sample_t *audioCopy;
+ FlightCallback *callbackCopy;
+ FlightEvent *eventCopy;
+ pthread_t thread;
+} Flight;
+Flight g_flight;
+
+// called by My_Process() at the end of each period, with its time
+static void FlightPeriod(const sample_t *out, unsigned nframes, unsigned long long ns, int voices)
+{
+ Flight *f = &g_flight;
+ unsigned in = f->in;
+ unsigned pos = in & (f->size-1);
+ unsigned first = (nframes < f->size - pos) ? nframes : f->size - pos;
+ memcpy(f->audio + pos, out, first*sizeof(sample_t));
+ memcpy(f->audio, out + first, (nframes - first)*sizeof(sample_t));
+ __atomic_store_n(&f->in, in + nframes, __ATOMIC_RELEASE);
+
+ FlightCallback *c = &f->callbacks[f->ncallbacks & (FLIGHT_CALLBACKS-1)];
+ c->frame = g_periodFrame;
+ c->audioIn = in;
+ c->nframes = nframes;
+ c->ns = ns;
+ c->voices = voices;
+ __atomic_store_n(&f->ncallbacks, f->ncallbacks + 1, __ATOMIC_RELEASE);
+}
+
+static void FlightPut(FlightEventRing *r, const FlightEvent *ev)
+{
+ r->events[r->in & (FLIGHT_EVENTS-1)] = *ev;
+ __atomic_store_n(&r->in, r->in + 1, __ATOMIC_RELEASE);
+}
+
+// a JACK MIDI event, from the thread rendering that kit
+static void FlightMIDI(int kit, jack_nframes_t frame, const unsigned char *msg, size_t size)
+{
+ FlightEvent ev = {frame, kit, 'j', msg[0] & 0xF0, msg[0] & 0x0F,
+                   size > 1 ? msg[1] : 0, size > 2 ? msg[2] : 0};
+ if (ev.status == MIDI_PITCHBEND) {
+  ev.value = (ev.value << 7 | ev.param) - 8192;
+  ev.param = 0;
+ }
+ FlightPut(&g_flight.rings[kit], &ev);
+}
+
+// anything else that came in, from any thread but the audio threads
+static void FlightNote(int kit, int source, int status, int channel, int param, int value)
+{
+ if (!g_flightDir) return;
+ Flight *f = &g_flight;
+ FlightEvent ev = {jack_frame_time(g_client), kit, source, status, channel, param, value};
+ pthread_mutex_lock(&f->lock);
+ FlightPut(&f->rings[f->nrings-1], &ev);
+ pthread_mutex_unlock(&f->lock);
+}
+
+// asks for a dump. safe in a signal handler
+static void FlightTrigger(int reason)
+{
+ __atomic_or_fetch(&g_flight.reasons, reason, __ATOMIC_RELEASE);
+ sem_post(&g_flight.wake);
+}
+
+static void FlightSignal(int sig) { FlightTrigger(FLIGHT_SIGNAL); }
+
+// copies a ring that's still being written: all of it, oldest first.
+// returns how many items at the end of the copy are good (the ones before
+// could have been written over, by up to 'slack' more, while it was being
+// copied), and sets *upTo to the count of items put in when it started
+static unsigned FlightCopy(void *to, const void *ring, unsigned size, size_t itemSize,
+                           const unsigned *in, unsigned slack, unsigned *upTo)
+{
+ unsigned in1 = *upTo = __atomic_load_n(in, __ATOMIC_ACQUIRE);
+ unsigned pos = in1 & (size-1);
+ memcpy(to, (const char*)ring + pos*itemSize, (size - pos)*itemSize);
+ memcpy((char*)to + (size - pos)*itemSize, ring, pos*itemSize);
+ unsigned in2 = __atomic_load_n(in, __ATOMIC_ACQUIRE);
+ unsigned have = (in1 < size) ? in1 : size;
+ unsigned lost = in2 - in1 + slack;
+ if (lost >= size) return 0;
+ return (have < size - lost) ? have : size - lost;
+}
+
+static int CompareFlightEvents(const void *a, const void *b)
+{
+ int d = ((const FlightEvent*)a)->frame - ((const FlightEvent*)b)->frame; // (JACK's frame time wraps)
+ return (d > 0) - (d < 0);
+}
+
+static const char* FlightType(const FlightEvent *ev)
+{
+ switch (ev->status) {
+ case MIDI_NOTEOFF:    return "note_off";
+ case MIDI_NOTEON:     return "note_on";
+ case MIDI_CONTROLLER: return "controller";
+ case MIDI_PITCHBEND:  return "pitch_bend";
+ case 0xC0:            return "pattern";
+ case CONTROL_KEY:     return "key";
+ case FLIGHT_START:    return "start";
+ case FLIGHT_STOP:     return "stop";
+ default:              return "other";
+ }
+}
+
+static const char* FlightSource(int source)
+{
+ switch (source) {
+ case 'j': return "jack";
+ case 'a': return "alsa";
+ case 'k': return "keyboard";
+ default:  return "daemon";
+ }
+}
+
+// writes out what's in the rings now. the JSON lists every callback and
+// event with its JACK frame time and its offset in the WAV file (negative
+// if it's from before the start of it)
+static void FlightDump(Flight *f, int reasons)
+{
+ char name[strlen(g_flightDir) + 64];
+ int i, n;
+ unsigned upTo;
+ // the audio goes last, so it has all of every callback and event
+ unsigned ncallbacks = FlightCopy(f->callbackCopy, f->callbacks, FLIGHT_CALLBACKS,
+                                  sizeof(FlightCallback), &f->ncallbacks, 1, &upTo);
+ unsigned nevents = 0;
+ for (n=0; n<f->nrings; n++) {
+  FlightEvent *to = f->eventCopy + nevents;
+  unsigned got = FlightCopy(to, f->rings[n].events, FLIGHT_EVENTS, sizeof(FlightEvent),
+                            &f->rings[n].in, 1, &upTo);
+  memmove(to, to + FLIGHT_EVENTS - got, got*sizeof(FlightEvent));
+  nevents += got;
+ }
+ qsort(f->eventCopy, nevents, sizeof(FlightEvent), CompareFlightEvents);
+ unsigned nframes = FlightCopy(f->audioCopy, f->audio, f->size, sizeof(sample_t), &f->in, FLIGHT_SLACK, &upTo);
+ unsigned audioStart = upTo - nframes;
+ const sample_t *audio = f->audioCopy + f->size - nframes;
+ const FlightCallback *callbacks = f->callbackCopy + FLIGHT_CALLBACKS - ncallbacks;
+
+ char stamp[32];
+ time_t t = time(NULL);
+ strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+ static int count = 0; // (two dumps in one second get numbered)
+ static char lastStamp[32];
+ count = strcmp(stamp, lastStamp) ? 0 : count+1;
+ strcpy(lastStamp, stamp);
+ if (count) sprintf(stamp + strlen(stamp), "-%d", count);
+
+ WavFile wav;
+ sprintf(name, "%s/flight-%s.wav", g_flightDir, stamp);
+ if (WavOpen(&wav, name, 1, 32)) return;
+ WavWrite(&wav, audio, nframes);
+ WavClose(&wav);
+
+ sprintf(name, "%s/flight-%s.json", g_flightDir, stamp);
+ FILE *json = fopen(name, "w");
+ if (!json) { perror(name); return; }
+ fprintf(json, "{\n \"reason\": [");
+ static const char *reasonNames[] = {"xrun", "signal", "asked"};
+ for (i=n=0; i<3; i++)
+  if (reasons & (1<<i)) fprintf(json, "%s\"%s\"", n++ ? ", " : "", reasonNames[i]);
+ fprintf(json, "],\n");
+ fprintf(json, " \"samplerate\": %ld,\n \"kits\": %d,\n \"xruns\": %llu,\n", g_sampleRate,
+         g_numKits, __atomic_load_n(&g_stats.xruns, __ATOMIC_RELAXED));
+ fprintf(json, " \"wav\": \"flight-%s.wav\",\n \"frames\": %u,\n \"callbacks\": [", stamp, nframes);
+ for (i=0; i<ncallbacks; i++) {
+  const FlightCallback *c = &callbacks[i];
+  fprintf(json, "%s\n  {\"frame\": %u, \"offset\": %d, \"nframes\": %u, \"ns\": %u, \"voices\": %d",
+          i ? "," : "", c->frame, (int)(c->audioIn - audioStart), c->nframes, c->ns, c->voices);
+  // JACK's frame time jumps over the periods an xrun lost
+  if (i && c->frame != callbacks[i-1].frame + callbacks[i-1].nframes)
+   fprintf(json, ", \"skipped\": %d", (int)(c->frame - callbacks[i-1].frame - callbacks[i-1].nframes));
+  fprintf(json, "}");
+ }
+ fprintf(json, "\n ],\n \"events\": [");
+ const FlightCallback *c = callbacks; // (the events are in order, so it just moves along)
+ for (i=0; i<nevents; i++) {
+  const FlightEvent *ev = &f->eventCopy[i];
+  while (c+1 < callbacks + ncallbacks && (int)(ev->frame - c[1].frame) >= 0) c++;
+  fprintf(json, "%s\n  {\"frame\": %u, ", i ? "," : "", ev->frame);
+  if (ncallbacks && (int)(ev->frame - c->frame) >= 0)
+   fprintf(json, "\"offset\": %d, ", (int)(c->audioIn - audioStart + ev->frame - c->frame));
+  fprintf(json, "\"kit\": %d, \"source\": \"%s\", \"type\": \"%s\", \"channel\": %d, \"param\": %d, \"value\": %d}",
+          ev->kit+1, FlightSource(ev->source), FlightType(ev), ev->channel+1, ev->param, ev->value);
+ }
+ fprintf(json, "\n ]\n}\n");
+ fclose(json);
+ fprintf(stderr, "flight recorder: wrote %s/flight-%s.wav and .json\n", g_flightDir, stamp);
+}
+
+// the dump thread. a burst of xruns makes one dump
+void* FlightThread (void *arg)
+{
+ Flight *f = &g_flight;
+ setpriority(PRIO_PROCESS, 0, 10); // (on Linux, this only lowers this thread)
+ while (1) {
+  while (sem_wait(&f->wake));
+  usleep(FLIGHT_AFTER_MS * 1000);
+  while (sem_trywait(&f->wake) == 0);
+  FlightDump(f, __atomic_exchange_n(&f->reasons, 0, __ATOMIC_ACQUIRE));
+ }
+ return NULL;
+}
+
+// zeroed memory, locked in (for the rings the audio threads write)
+static void* FlightAlloc(size_t bytes, int lock)
+{
+ void *p = malloc(bytes);
+ if (!p) return NULL;
+ memset(p, 0, bytes); // (touch every page now, not on the audio thread)
+ if (lock && mlock(p, bytes)) perror("flight recorder: can't lock the rings in memory");
+ return p;
+}
+
+// sets aside the rings and starts the dump thread. g_sampleRate must
+// already be set
+int FlightStart()
+{
+ Flight *f = &g_flight;
+ if (access(g_flightDir, W_OK)) { perror(g_flightDir); return -1; }
+ f->size = 1;
+ while (f->size < FLIGHT_SECONDS * g_sampleRate) f->size *= 2;
+ f->nrings = g_numKits + 1;
+ f->audio = FlightAlloc(f->size * sizeof(sample_t), 1);
+ f->callbacks = FlightAlloc(FLIGHT_CALLBACKS * sizeof(FlightCallback), 1);
+ f->rings = FlightAlloc(f->nrings * sizeof(FlightEventRing), 1);
+ f->audioCopy = FlightAlloc(f->size * sizeof(sample_t), 0);
+ f->callbackCopy = FlightAlloc(FLIGHT_CALLBACKS * sizeof(FlightCallback), 0);
+ f->eventCopy = FlightAlloc(f->nrings * FLIGHT_EVENTS * sizeof(FlightEvent), 0);
+ if (!f->audio || !f->callbacks || !f->rings || !f->audioCopy || !f->callbackCopy || !f->eventCopy) {
+  fprintf(stderr, "flight recorder: out of memory\n");
+  return -1;
+ }
+ pthread_mutex_init(&f->lock, NULL);
+ sem_init(&f->wake, 0, 0);
+
+ struct sigaction sa;
+ memset(&sa, 0, sizeof(sa));
+ sa.sa_handler = FlightSignal;
+ sa.sa_flags = SA_RESTART;
+ sigaction(SIGUSR1, &sa, NULL);
+ pthread_create(&f->thread, NULL, FlightThread, NULL);
+ return 0;
+}
+
+
+
+// RENDER AHEAD
+// with -A periods, a worker thread renders the first kit (the one the
+// sequencer plays) that many periods ahead of time, from what's already
+// known: the sequencer's patterns, and the tails of whatever is ringing.
+// My_Process then just copies each period out of a ring of them. anything
+// the plan didn't know about (MIDI from JACK, ALSA or the keyboard, the
+// sequencer starting, stopping or being given another pattern, JACK
+// transport jumping) makes My_Process render that period itself, the same
+// as without -A, starting from where the plan had the kit. then the worker
+// throws out the rest of its plan and starts a new one from there.
+
+#define AHEAD_SLOTS 32 // in the ring, so -A can be up to 31
+
+// a period rendered ahead
+typedef struct {
+ unsigned plan;    // which plan it's from,
+ unsigned period;  // and which period it's for (counted by My_Process)
+ jack_nframes_t nframes;
+ int run;          // what the sequencer was going by at the start of the
+ long long frame;  // period (see SeqQuery), and where it was then
+ double tempo;     //
+ sample_t *bus[NUM_BUSES]; // the kit's buses (sharing a buffer unless -m)
+ KitSnapshot kit;  // the kit at the end of the period,
+ Sequencer seq;    // and the sequencer
+} AheadSlot;
+
+typedef struct {
+ AheadSlot slots[AHEAD_SLOTS];
+ jack_nframes_t maxFrames; // the size of their buffers
+ unsigned head;    // slots filled, by the worker
+ unsigned tail;    // slots done with, by My_Process, which still needs the
+                   // one before tail: its kit is where the next period starts
+ // a new plan, from My_Process to the worker
+ pthread_mutex_t startLock;
+ unsigned startPlan;    // its number (0 is none yet)
+ unsigned startPeriod;  // its first period
+ jack_nframes_t startFrames;
+ KitSnapshot startKit;
+ Sequencer startSeq;
+ int run, nextPattern;  // what the sequencer's controls were set to
+ PatternBank *retired;  // a bank the audio thread is done with, that the
+                        // plans before this one might still be using
+ // from the worker to ReloadPatterns
+ PatternBank *dropped;  // a retired bank no plan uses any more, to free
+ // only My_Process touches these
+ unsigned plan;    // the plan the slots have to be from: a new one after
+                   // each period that's off the plan
+ unsigned period;  // periods so far
+ int following;    // boolean: the last period came from the ring, so
+                   // g_kits[0] is behind
+ // and only the worker touches these
+ Kit kit;
+ Sequencer seq;
+ sem_t wake;
+ pthread_t thread;
+} Ahead;
+Ahead g_ahead;
+
+// the worker: renders the plan until the ring is -A periods ahead, then
+// waits for My_Process to use some up (or to start a new plan)
+void* AheadThread (void *arg)
+{
+ Ahead *a = &g_ahead;
+ Kit *k = &a->kit;
+ Sequencer *sq = &a->seq;
+ unsigned plan = 0, period = 0;
+ jack_nframes_t nframes = 0;
+ ClaimKit(k);
+ while (1) {
+  sem_wait(&a->wake);
+  while (1) {
+   pthread_mutex_lock(&a->startLock);
+   if (a->startPlan != plan) {
+    plan = a->startPlan;
+    period = a->startPeriod;
+    nframes = a->startFrames;
+    FillKitCache(k, &a->startKit);
+    RestoreKit(k, &a->startKit);
+    SeqCopyPlaying(sq, &a->startSeq);
+    sq->followTransport = g_seq.followTransport;
+    sq->run = a->run;
+    sq->nextPattern = a->nextPattern;
+    sq->newBank = NULL;
+    if (a->retired && !__atomic_load_n(&a->dropped, __ATOMIC_ACQUIRE)) {
+     __atomic_store_n(&a->dropped, a->retired, __ATOMIC_RELEASE);
+     a->retired = NULL;
+    }
+   }
+   pthread_mutex_unlock(&a->startLock);
+   unsigned head = a->head;
+   if (!plan || nframes > a->maxFrames
+       || head - __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE) >= g_aheadPeriods) break;
+
+   AheadSlot *slot = &a->slots[head % AHEAD_SLOTS];
+   slot->plan = plan;
+   slot->period = period++;
+   slot->nframes = nframes;
+   if (g_seq.bank) {
+    // the plan is that the sequencer carries on the way it's going
+    jack_position_t pos;
+    memset(&pos, 0, sizeof(pos));
+    pos.valid = JackPositionBBT;
+    pos.frame = sq->frame;
+    pos.beats_per_minute = sq->tempo;
+    slot->run = sq->followTransport ? sq->playing : sq->run;
+    slot->frame = sq->frame;
+    slot->tempo = sq->tempo;
+    SeqStartPeriod(sq, k, slot->run, &pos);
+   }
+   SchedulePeriod(k, g_seq.bank ? sq : NULL, NULL, nframes);
+   SynthesizeBuses(k, slot->bus, nframes);
+   SaveKit(k, &slot->kit);
+   SeqCopyPlaying(&slot->seq, sq);
+   __atomic_store_n(&a->head, head+1, __ATOMIC_RELEASE);
+  }
+ }
+ return NULL;
+}
+
+// the first kit's part of the period, with -A: out of the ring if the
+// plan still holds, else rendered right here, and then the worker gets a
+// new plan, starting from the next period
+static void AheadProcess(jack_nframes_t nframes)
+{
+ Ahead *a = &g_ahead;
+ KitIO *io = &g_kitIO[0];
+ Sequencer *sq = g_seq.bank ? &g_seq : NULL;
+ AheadSlot *slot = NULL;
+ jack_position_t pos;
+ int run = sq ? SeqQuery(sq, &pos) : 0;
+ int i, j;
+
+ // the plan only knows about the sequencer
+ int onPlan = !(io->midi && jack_midi_get_event_count(io->midi)) && !PendingMIDI(&g_kits[0]);
+ if (sq && (__atomic_load_n(&sq->nextPattern, __ATOMIC_RELAXED) != a->nextPattern
+            || __atomic_load_n(&sq->newBank, __ATOMIC_RELAXED))) onPlan = 0;
+ // this period's slot, skipping any that are from an old plan
+ unsigned head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE), tail = a->tail;
+ for (; onPlan && tail != head; tail++) {
+  AheadSlot *s = &a->slots[tail % AHEAD_SLOTS];
+  if (s->plan == a->plan && s->period == a->period) { slot = s; break; }
+ }
+ if (slot && (slot->nframes != nframes || (sq && (run != slot->run || (sq->followTransport && run
+     && (pos.frame != slot->frame || SeqTransportTempo(sq, &pos) != slot->tempo))))))
+  slot = NULL;
+
+ if (slot) {
+  for (j=0; j<NUM_BUSES; j++) {
+   for (i=0; i<j && io->bus[i] != io->bus[j]; i++);
+   if (i == j) memcpy(io->bus[j], slot->bus[j], nframes*sizeof(sample_t));
+  }
+  MixKit(0, nframes);
+  FillKitCache(&g_kits[0], &slot->kit); // (so a restore from it doesn't have to)
+  a->following = 1;
+  __atomic_store_n(&a->tail, tail+1, __ATOMIC_RELEASE);
+ }
+ else {
+  if (a->following) { // (where the plan had the kit)
+   const AheadSlot *last = &a->slots[(a->tail-1) % AHEAD_SLOTS];
+   RestoreKit(&g_kits[0], &last->kit);
+   if (sq) SeqCopyPlaying(sq, &last->seq);
+   a->following = 0;
+  }
+  ProcessKit(0, nframes);
+  __atomic_store_n(&a->tail, head, __ATOMIC_RELEASE); // (all out of date now)
+  a->plan++;
+  if (!pthread_mutex_trylock(&a->startLock)) { // (or try again next period)
+   SaveKit(&g_kits[0], &a->startKit);
+   if (sq) {
+    SeqCopyPlaying(&a->startSeq, sq);
+    a->run = __atomic_load_n(&sq->run, __ATOMIC_RELAXED);
+    a->nextPattern = __atomic_load_n(&sq->nextPattern, __ATOMIC_RELAXED);
+    if (!a->retired) a->retired = __atomic_exchange_n(&sq->oldBank, NULL, __ATOMIC_ACQUIRE);
+   }
+   a->startPeriod = a->period+1;
+   a->startFrames = nframes;
+   a->startPlan = a->plan;
+   pthread_mutex_unlock(&a->startLock);
+  }
+ }
+ a->period++;
+ sem_post(&a->wake);
+}
+
+// a retired pattern bank that's safe to free now, or NULL
+static PatternBank* AheadDroppedBank(void)
+{
+ return __atomic_exchange_n(&g_ahead.dropped, NULL, __ATOMIC_ACQUIRE);
+}
+
+// the first kit as it is now, for the stats
+static const KitState* AheadKit(void)
+{
+ if (!g_ahead.following) return &g_kits[0].state;
+ return &g_ahead.slots[(g_ahead.tail-1) % AHEAD_SLOTS].kit.state;
+}
+
+// sets up the worker's kit and buffers, and starts it. g_sampleRate must
+// already be set, and this has to happen before SetUpKits()
+int AheadStart()
+{
+ Ahead *a = &g_ahead;
+ KitSettings settings = g_kitSettings;
+ settings.sampleRate = g_sampleRate;
+ settings.timing = 0; // (the stats are for the JACK thread's time)
+ if (SetUpKit(&a->kit, &settings)) return -1;
+ a->maxFrames = jack_get_buffer_size(g_client);
+ int buffers = g_multiOut ? NUM_BUSES : 1, i, j;
+ size_t bytes = (size_t)AHEAD_SLOTS * buffers * a->maxFrames * sizeof(sample_t);
+ sample_t *buffer = calloc(1, bytes);
+ if (!buffer) { fprintf(stderr, "render ahead: out of memory\n"); return -1; }
+ for (i=0; i<AHEAD_SLOTS; i++) for (j=0; j<NUM_BUSES; j++)
+  a->slots[i].bus[j] = buffer + (i*buffers + (j < buffers ? j : 0)) * a->maxFrames;
+ // (locking the ring into memory touches every page of it now, not on
+ // the audio thread)
+ if (mlock(buffer, bytes) || mlock(a, sizeof(Ahead)))
+  perror("render ahead: can't lock the ring in memory");
+ pthread_mutex_init(&a->startLock, NULL);
+ sem_init(&a->wake, 0, 0);
+ // a real-time thread, just below JACK's own, so it keeps up when the
+ // computer is busy with other things
+ int priority = jack_client_real_time_priority(g_client) - 1;
+ if (jack_client_create_thread (g_client, &a->thread, priority > 0 ? priority : 1,
+      jack_is_realtime(g_client), AheadThread, NULL)) {
+  fprintf(stderr, "cannot start the render ahead thread\n");
+  return -1;
+ }
+ return 0;
+}
+
+
+
+
+// DAEMON MODE
+// with -D, there's no terminal: no xterm, no curses. the program goes
+// straight into the audio graph and takes commands, one per line, from
+// any number of local programs through a Unix domain socket. the commands
+// reach the audio thread through each kit's control queue, the same as
+// ALSA MIDI, so the audio thread never waits on the socket. it quits
+// cleanly on SIGTERM (or SIGINT, or a "quit" command). see the manpage.
+
+#define DAEMON_MAX_CLIENTS 16
+#define DAEMON_LINE_MAX 256
+
+typedef struct {
+ int fd; // -1 if this slot is free
+ int kit; // where this client's commands go (0 is the first kit)
+ int len;
+ char line[DAEMON_LINE_MAX];
+} DaemonClient;
+
+int g_daemonSocket = -1; // listening
+const char *g_daemonSocketName = NULL; // set with -D
+
+// replies are small, so they go out without waiting; a client that doesn't
+// read its replies loses them rather than holding up everybody else
+static void DaemonReply(DaemonClient *c, const char *text, size_t len)
+{
+ send(c->fd, text, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void DaemonPrintf(DaemonClient *c, const char *format, ...)
+{
+ char text[DAEMON_LINE_MAX];
+ va_list args;
+ va_start(args, format);
+ int len = vsnprintf(text, sizeof(text), format, args);
+ va_end(args);
+ if (len >= (int)sizeof(text)) len = sizeof(text)-1;
+ if (len > 0) DaemonReply(c, text, len);
+}
+
+static void DaemonReady(DaemonClient *c)
+{
+ DaemonPrintf(c, "ready sample_rate %ld kits %d patterns %d\n", g_sampleRate,
+              g_numKits, g_seq.bank ? g_seq.bank->npatterns : 0);
+}
+
+// MIDI channels are 1-16 here, the same as in the manpage
+static int DaemonChannel(int channel) { return channel >= 1 && channel <= 16; }
+static int DaemonData(int value) { return value >= 0 && value <= 127; }
+
+// runs one command line. returns an error message, or NULL if it went fine
+static const char* DaemonCommand(DaemonClient *c, char *line)
+{
+ char word[16];
+ int a, b, v, used = 0;
+ Kit *k = &g_kits[c->kit];
+ if (sscanf(line, " %15s %n", word, &used) < 1) return ""; // (blank line)
+ const char *rest = line + used;
+
+ if (!strcmp(word, "note") || !strcmp(word, "off")) {
+  int on = (word[0] == 'n');
+  v = 0;
+  if (sscanf(rest, "%d %d %d", &a, &b, &v) < (on ? 3 : 2)) return on ? "usage: note channel note velocity" : "usage: off channel note";
+  if (!DaemonChannel(a) || !DaemonData(b) || !DaemonData(v)) return "out of range";
+  FlightNote(c->kit, 'd', on ? MIDI_NOTEON : MIDI_NOTEOFF, a-1, b, v);
+  HandleMIDI(k, on ? MIDI_NOTEON : MIDI_NOTEOFF, a-1, b, v);
+ }
+ else if (!strcmp(word, "cc")) {
+  if (sscanf(rest, "%d %d %d", &a, &b, &v) < 3) return "usage: cc channel controller value";
+  if (!DaemonChannel(a) || !DaemonData(b) || !DaemonData(v)) return "out of range";
+  FlightNote(c->kit, 'd', MIDI_CONTROLLER, a-1, b, v);
+  HandleMIDI(k, MIDI_CONTROLLER, a-1, b, v);
+ }
+ else if (!strcmp(word, "bend")) {
+  if (sscanf(rest, "%d %d", &a, &v) < 2) return "usage: bend channel value";
+  if (!DaemonChannel(a) || v < -8192 || v > 8191) return "out of range";
+  FlightNote(c->kit, 'd', MIDI_PITCHBEND, a-1, 0, v);
+  HandleMIDI(k, MIDI_PITCHBEND, a-1, 0, v);
+ }
+ else if (!strcmp(word, "key")) {
+  if (!*rest || (unsigned char)*rest >= 128) return "usage: key character";
+  FlightNote(c->kit, 'd', CONTROL_KEY, 0, *rest, 0);
+  HandleKey(k, *rest);
+ }
+ else if (!strcmp(word, "kit")) {
+  if (sscanf(rest, "%d", &a) < 1) return "usage: kit number";
+  if (a < 1 || a > g_numKits) return "no such kit";
+  c->kit = a-1;
+ }
+ else if (!strcmp(word, "start") || !strcmp(word, "stop")) {
+  if (!g_seq.bank) return "no pattern file (-P)";
+  FlightNote(0, 'd', word[2] == 'a' ? FLIGHT_START : FLIGHT_STOP, 0, 0, 0);
+  SeqRun(&g_seq, word[2] == 'a');
+ }
+ else if (!strcmp(word, "pattern")) {
+  if (!g_seq.bank) return "no pattern file (-P)";
+  if (sscanf(rest, "%d", &a) < 1) return "usage: pattern number";
+  if (a < 1 || a > g_seq.bank->npatterns) return "no such pattern";
+  FlightNote(0, 'd', 0xC0, 0, a-1, 0);
+  SelectPattern(&g_seq, a-1);
+ }
+ else if (!strcmp(word, "reload")) {
+  if (!g_seq.bank) return "no pattern file (-P)";
+  if (ReloadPatterns(&g_seq)) return "can't load the pattern file";
+ }
+ else if (!strcmp(word, "stats")) {
+  char *text = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&text, &len);
+  if (!f) return "out of memory";
+  WriteStats(f);
+  fclose(f);
+  DaemonReply(c, text, len);
+  free(text);
+ }
+ else if (!strcmp(word, "flight")) {
+  if (!g_flightDir) return "no flight recorder (-F)";
+  FlightTrigger(FLIGHT_ASKED);
+ }
+ else if (!strcmp(word, "ping")) {
+  DaemonReady(c);
+  return NULL;
+ }
+ else if (!strcmp(word, "quit")) kill(getpid(), SIGTERM);
+ else return "unknown command";
+ DaemonReply(c, "ok\n", 3);
+ return NULL;
+}
+
+// takes in whatever a client sent, and runs each whole line
+static int DaemonRead(DaemonClient *c)
+{
+ int got = recv(c->fd, c->line + c->len, DAEMON_LINE_MAX-1 - c->len, 0);
+ if (got <= 0) return -1; // (hung up)
+ c->len += got;
+ c->line[c->len] = 0;
+ char *start = c->line, *end;
+ while ((end = strchr(start, '\n'))) {
+  *end = 0;
+  if (end > start && end[-1] == '\r') end[-1] = 0;
+  const char *error = DaemonCommand(c, start);
+  if (error && *error) DaemonPrintf(c, "error: %s\n", error);
+  start = end+1;
+ }
+ c->len -= start - c->line;
+ memmove(c->line, start, c->len);
+ if (c->len == DAEMON_LINE_MAX-1) return -1; // (a line that long is garbage)
+ return 0;
+}
+
+// makes the listening socket. this is done before JACK starts up, so a bad
+// path (or another snappy-drums on the same socket) stops the program early
+int DaemonListen(const char *path)
+{
+ struct sockaddr_un addr;
+ memset(&addr, 0, sizeof(addr));
+ addr.sun_family = AF_UNIX;
+ if (strlen(path) >= sizeof(addr.sun_path)) {
+  fprintf(stderr, "%s: the socket path is too long\n", path);
+  return -1;
+ }
+ strcpy(addr.sun_path, path);
+ int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+ if (fd < 0) { perror("socket"); return -1; }
+ if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+  // left over from a crash, or still in use?
+  if (errno != EADDRINUSE || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+   if (errno == EADDRINUSE) fprintf(stderr, "%s: another program is listening here\n", path);
+   else perror(path);
+   close(fd);
+   return -1;
+  }
+  close(fd);
+  unlink(path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+   perror(path);
+   return -1;
+  }
+ }
+ if (listen(fd, 8)) { perror(path); close(fd); return -1; }
+ return fd;
+}
+
+// the loop that serves the control socket
+void* DaemonThread (void *arg)
+{
+ DaemonClient clients[DAEMON_MAX_CLIENTS];
+ struct pollfd pfd[DAEMON_MAX_CLIENTS+1];
+ int i, n;
+ for (i=0; i<DAEMON_MAX_CLIENTS; i++) clients[i].fd = -1;
+ while (1) {
+  pfd[0].fd = g_daemonSocket;
+  pfd[0].events = POLLIN;
+  for (i=0; i<DAEMON_MAX_CLIENTS; i++) {
+   pfd[i+1].fd = clients[i].fd;
+   pfd[i+1].events = POLLIN;
+  }
+  if (poll(pfd, DAEMON_MAX_CLIENTS+1, -1) <= 0) continue;
+  for (i=0; i<DAEMON_MAX_CLIENTS; i++) {
+   DaemonClient *c = &clients[i];
+   if (c->fd < 0 || !pfd[i+1].revents) continue;
+   if (DaemonRead(c)) {
+    close(c->fd);
+    c->fd = -1;
+   }
+  }
+  if (pfd[0].revents & POLLIN) {
+   int fd = accept4(g_daemonSocket, NULL, NULL, SOCK_CLOEXEC);
+   if (fd < 0) continue;
+   for (n=0; n<DAEMON_MAX_CLIENTS && clients[n].fd >= 0; n++);
+   if (n == DAEMON_MAX_CLIENTS) {
+    send(fd, "error: too many clients\n", 24, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    continue;
+   }
+   DaemonClient *c = &clients[n];
+   c->fd = fd;
+   c->kit = 0;
+   c->len = 0;
+   DaemonReady(c);
+  }
+ }
+ return NULL;
+}
+
+
+// main() handles the user interface and the startup/shutdown
+int main (int argc, char *argv[])
+{
+ // offline rendering doesn't need a terminal, JACK or ALSA
+ if (argc > 1 && !strcmp(argv[1], "--render")) {
+  argv[1] = argv[0];
+  return RenderMain(argc-1, argv+1);
+ }
+ if (argc > 1 && !strcmp(argv[1], "--bench")) {
+  argv[1] = argv[0];
+  return BenchMain(argc-1, argv+1);
+ }
+ if (argc > 1 && !strcmp(argv[1], "--golden")) {
+  argv[1] = argv[0];
+  return GoldenMain(argc-1, argv+1);
+ }
+ if (argc > 1 && !strcmp(argv[1], "--export")) {
+  argv[1] = argv[0];
+  return ExportMain(argc-1, argv+1);
+ }
+
+ int opt;
+ while ((opt = getopt(argc, argv, "mS:k:BP:TD:R:A:F:" COMMON_OPTIONS)) != -1) {
+  if (opt == 'm') g_multiOut = 1;
+  else if (opt == 'S') g_statsFile = optarg;
+  else if (opt == 'k' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_KITS)
+   g_numKits = atoi(optarg);
+  else if (opt == 'B') g_batch = 1;
+  else if (opt == 'P') g_seq.fileName = optarg;
+  else if (opt == 'T') g_seq.followTransport = 1;
+  else if (opt == 'D') g_daemonSocketName = optarg;
+  else if (opt == 'R') g_recordFile = optarg;
+  else if (opt == 'A' && atoi(optarg) >= 1 && atoi(optarg) < AHEAD_SLOTS)
+   g_aheadPeriods = atoi(optarg);
+  else if (opt == 'F') g_flightDir = optarg;
+  else if (CommonOption(opt, optarg)) {
+   fprintf(stderr, "usage: %s [-m] [-S statsfile] [-k kits [-B]] [-P patternfile [-T]] [-D socket] [-R file.wav] [-A periods] [-F dir] " COMMON_USAGE "\n"
+                   "   or: %s --render ...\n"
+                   "   or: %s --bench ...\n"
+                   "   or: %s --golden ...\n"
+                   "   or: %s --export ...\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
+   return 1;
+  }
+ }
+
+ g_keepStats = g_statsFile || g_daemonSocketName || g_flightDir;
+
+ // first make sure it's run in a terminal (unless it's a daemon)
+ if (!g_daemonSocketName && !getenv("TERM")) {
+  char *args[argc+4];
+  args[0] = "xterm"; args[1] = "-hold"; args[2] = "-e";
+  memcpy(args+3, argv, (argc+1)*sizeof(char*));
+  execvp("xterm", args);
+ }
+
+ // the sequencer's patterns
+ if (g_seq.fileName && !(g_seq.bank = LoadPatterns(g_seq.fileName))) return 1;
+
+ // a daemon handles SIGTERM in main(), at its own pace, so every thread
+ // (including JACK's, which start with the client) has to block it
+ sigset_t quitSignals;
+ if (g_daemonSocketName) {
+  sigemptyset(&quitSignals);
+  sigaddset(&quitSignals, SIGTERM);
+  sigaddset(&quitSignals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &quitSignals, NULL);
+  if ((g_daemonSocket = DaemonListen(g_daemonSocketName)) < 0) return 1;
+ }
+ // display the basic program info
+ else printf("-- JACK + ALSA MIDI instrument --\n");
+
+ // set up the everything to work with JACK
+ int i, n;
+ if ((g_client = jack_client_new(CLIENT_NAME)) == 0) {
+  char name[32];sprintf(name,"%s_%d",CLIENT_NAME,getpid());// try another name
+  if ((g_client = jack_client_new(name)) == 0) {// or is jackd not running?
+   fprintf(stderr,"-- You must start JACK before running this program. --\n");
+   return 1; }
+ }
+ jack_set_error_function (My_ErrorHandler);
+ jack_set_process_callback (g_client, My_Process, 0);
+ jack_set_sample_rate_callback (g_client, My_SampleRateChange, 0);
+ jack_on_shutdown (g_client, My_JackShutdown, 0);
+ jack_set_xrun_callback (g_client, My_Xrun, 0);
+ g_outputPort = jack_port_register (g_client, "out",
+                 JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+ if (g_numKits == 1) {
+  g_midiPort = jack_port_register (g_client, "midi_in",
+                JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+  if (g_multiOut) for (i=0; i<NUM_BUSES; i++) {
+   g_busPorts[i] = jack_port_register (g_client, g_busNames[i],
+                    JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+   if (!g_busPorts[i]) {
+    fprintf(stderr, "cannot register port %s\n", g_busNames[i]);
+    return 1;
+   }
+  }
+  g_kitIO[0].outPort = g_outputPort;
+  g_kitIO[0].midiPort = g_midiPort;
+  memcpy(g_kitIO[0].busPorts, g_busPorts, sizeof(g_busPorts));
+ }
+ // multi-kit: "out" is the mix, and each kit gets its own ports, named
+ // kit1_out, kit1_midi_in, kit1_tonedrums (with -m) etc, and a thread
+ else for (n=0; n<g_numKits; n++) {
+  KitIO *io = &g_kitIO[n];
+  char name[64];
+  sprintf(name, "kit%d_out", n+1);
+  io->outPort = jack_port_register (g_client, name,
+                 JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+  sprintf(name, "kit%d_midi_in", n+1);
+  io->midiPort = jack_port_register (g_client, name,
+                  JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+  if (!io->outPort || !io->midiPort) {
+   fprintf(stderr, "cannot register the ports for kit %d\n", n+1);
+   return 1;
+  }
+  if (g_multiOut) for (i=0; i<NUM_BUSES; i++) {
+   sprintf(name, "kit%d_%s", n+1, g_busNames[i]);
+   io->busPorts[i] = jack_port_register (g_client, name,
+                      JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+   if (!io->busPorts[i]) {
+    fprintf(stderr, "cannot register port %s\n", name);
+    return 1;
+   }
+  }
+  if (n == 0 || g_batch) continue; // (the first kit renders on the JACK thread)
+  sem_init(&io->go, 0, 0);
+  sem_init(&io->done, 0, 0);
+  if (jack_client_create_thread (g_client, &io->thread,
+       jack_client_real_time_priority(g_client), jack_is_realtime(g_client),
+       KitThread, io)) {
+   fprintf(stderr, "cannot start the thread for kit %d\n", n+1);
+   return 1;
+  }
+ }
+ // activate the client
+ if (jack_activate (g_client))
+ { fprintf (stderr, "cannot activate client\n");
+  return 1; }
+ // find some output ports to connect to
+ const char **ports;
+ ports=jack_get_ports(g_client,NULL,NULL,JackPortIsPhysical|JackPortIsInput);
+ if (ports == NULL) {
+  fprintf(stderr, "cannot find any playback ports (speakers?)\n");
+ } else {
+  for (i=0; ports[i]!=NULL; i++) {
+    if (jack_connect (g_client, jack_port_name(g_outputPort), ports[i]))
+      fprintf (stderr, "cannot connect output ports\n");
+  }
+  free (ports);
+ }
+
+ // set up an ALSA midi port
+ if (snd_seq_open(&g_seqHandle, "default", SND_SEQ_OPEN_INPUT, 0) < 0) {
+  fprintf(stderr, "Error opening ALSA sequencer.\n");
+  return 1;
+ }
+ snd_seq_set_client_name(g_seqHandle, CLIENT_NAME);
+ for (n=0; n<g_numKits; n++) { // (one port per kit)
+  char name[64];
+  if (g_numKits == 1) strcpy(name, CLIENT_NAME);
+  else sprintf(name, "%s kit %d", CLIENT_NAME, n+1);
+  g_kitIO[n].alsaPort = snd_seq_create_simple_port(g_seqHandle, name,
+   SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
+   SND_SEQ_PORT_TYPE_APPLICATION);
+  if (g_kitIO[n].alsaPort < 0) {
+   fprintf(stderr, "Error creating sequencer port.\n");
+   return 1;
+  }
+ }
+ pthread_t MIDIthread; // automate midi handling
+ pthread_create(&MIDIthread,NULL,WaitOnMIDI,NULL);
+ if (g_statsFile) {
+  pthread_t statsThread;
+  pthread_create(&statsThread,NULL,StatsThread,NULL);
+ }
+
+ if (!g_daemonSocketName) initscr(); // curses interface
+ while (g_sampleRate < 1) usleep(10000); // wait for JACK thread to set sampleRate
+
+ // (before SetUpKits(), which lets My_Process start making sound)
+ if (g_recordFile && RecordStart(g_recordFile)) {
+  if (!g_daemonSocketName) endwin();
+  return 1;
+ }
+ if (g_aheadPeriods && AheadStart()) {
+  if (!g_daemonSocketName) endwin();
+  return 1;
+ }
+ if (g_flightDir && FlightStart()) {
+  if (!g_daemonSocketName) endwin();
+  return 1;
+ }
+ SetUpKits();
+ if (g_daemonSocketName) {
+  pthread_t daemonThread;
+  pthread_create(&daemonThread,NULL,DaemonThread,NULL);
+  int sig;
+  while (sigwait(&quitSignals, &sig)); // (until SIGTERM or SIGINT)
+  // stop the audio before anything it uses goes away
+  jack_deactivate (g_client);
+  if (g_recordFile) RecordStop();
+  jack_client_close (g_client);
+  snd_seq_close (g_seqHandle);
+  close (g_daemonSocket);
+  unlink (g_daemonSocketName);
+  return 0;
+ }
+ Kit *k = &g_kits[0]; // the keyboard plays the first kit
+ unsigned long long dropped = 0;
+ if (g_recordFile) timeout(1000); // (to keep an eye on the recorder)
  while (1) {
   int gotten = getch();
+  if (g_recordFile && dropped != __atomic_load_n(&g_stats.recordDropped, __ATOMIC_RELAXED)) {
+   dropped = __atomic_load_n(&g_stats.recordDropped, __ATOMIC_RELAXED);
+   printw("recorder: %llu frames dropped so far (the disk can't keep up)\n", dropped);
+  }
   if (gotten < 0) continue;
   if (gotten == 27) {
    printw("Press ESC twice to quit.\n");
-   if (getch() == 27) break;
-  }
-  else if (gotten == '1' || gotten == '!') {
-   g_newClap = 1;
-   g_clapVolume = 0.2*g_masterVolume;
-  }
-  else if (gotten == '`' || gotten == '~') {
-   g_newHighHat = 1;
-   g_hhVolume = 0.2*g_masterVolume;
-  }
-  else if (gotten == '-') {
-   g_newCowbell = 1;
-   g_cbWaveScale = 8;
-   g_cbDecayFactor = 1.0 - DCV_COWBELL/g_cbWaveScale;
-   g_cbVolume = 0.5*g_masterVolume;
-  }
-  else if (gotten == '_') {
-   g_newCowbell = 1;
-   g_cbWaveScale = 6;
-   g_cbDecayFactor = 1.0 - DCV_COWBELL/g_cbWaveScale;
-   g_cbVolume = 0.5*g_masterVolume;
-  }
-  else if (g_keys[gotten] > 0) {
-   int qw = g_qw[g_keys[gotten]];
-   if (qw > 0) {
-    g_newToneDrum = 1;
-    g_tdQuarterWave = qw;
-    g_tdVolume = 0.8*g_masterVolume;
-   }
+   while ((gotten = getch()) < 0);
+   if (gotten == 27) break;
+  }
+  else if (gotten == ' ' && g_seq.bank) { // the sequencer
+   int run = g_seq.followTransport ? !g_seq.playing : !g_seq.run;
+   FlightNote(0, 'k', run ? FLIGHT_START : FLIGHT_STOP, 0, 0, 0);
+   SeqRun(&g_seq, run);
+  }
+  else if (gotten == '\t' && g_seq.bank) {
+   int next = (g_seq.nextPattern + 1) % g_seq.bank->npatterns;
+   FlightNote(0, 'k', 0xC0, 0, next, 0);
+   SelectPattern(&g_seq, next);
+   printw("next pattern: %d\n", g_seq.nextPattern + 1);
+  }
+  else if (gotten == '\\' && g_seq.bank) {
+   if (ReloadPatterns(&g_seq) == 0) printw("reloaded %s\n", g_seq.fileName);
+  }
+  else {
+   FlightNote(0, 'k', CONTROL_KEY, 0, gotten, 0);
+   HandleKey(k, gotten); // (the drums)
   }
  }
  endwin();
 
+ jack_deactivate (g_client);
+ if (g_recordFile) RecordStop();
  jack_client_close (g_client);
  return 0;
 }
@@ -0,0 +1,2100 @@
+/***
+ The sound engine of Elie's snappy drum machine: everything that makes the
+ sound, and the MIDI mapping. see snappy-engine.h for how to use it.
+ --
+
+
+ Copyright 2019, Elie Goldman Smith
+
+ This program is FREE SOFTWARE: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+***/
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "snappy-engine.h"
+
+// macros etc to make code look cleaner
+#define MIDI_TO_FREQ(m)  (440*pow(2, 0.08333333333333333*((m)-69)))
+#define isSubnormalF(f)  ((*(unsigned*)&(f) & 0x7F800000) == 0)
+
+// constants
+#define LOW_FREQUENCY_ROLLOFF 46 // hz    
+#define LOW_FREQUENCY_CUTOFF 39 // hz        or try 48.8hz and 41.4hz
+// default controller values
+// note: most globals don't reset to these, but rather to a number based on these.
+#define DCV_CLAP 0.00025 // or try 0.0004 but comment out //ca *= g_clapDecayFactor;
+#define DCV_HH 0.001
+#define DCV_DECAY 0.04
+#define DCV_SWEEP_SPEED 7
+#define DCV_AUX_DECAY 0.02
+#define DCV_AUX_RELEASE 0.14
+#define DCV_CYMBAL 0.001
+#define DCV_COWBELL 0.004
+
+
+static char g_keys[128]; // keyboard character -> midi note (see SetUpKeys)
+
+// scalar xorshift32. state must never be zero
+static inline unsigned Random(unsigned *state)
+{
+ unsigned x = *state;
+ x ^= x << 13;
+ x ^= x >> 17;
+ x ^= x << 5;
+ return *state = x;
+}
+
+// uniform random number from -1 to 1
+static inline sample_t RandomSample(unsigned *state)
+ { return (int)Random(state) * (1.0/2147483648.0); }
+
+// x times a uniform random number from -1 to 1
+#ifdef SNAPPY_FIXED
+static inline int32_t RandomTimes(int32_t x, unsigned *state)
+ { return ((int64_t)x * (int)Random(state)) >> 31; }
+#else
+#define RandomTimes(x, state) ((x)*RandomSample(state))
+#endif
+
+// makes a well-mixed nonzero seed from any number (splitmix32 finalizer)
+static unsigned MixSeed(unsigned x)
+{
+ x = (x ^ (x >> 16)) * 0x7feb352d;
+ x = (x ^ (x >> 15)) * 0x846ca68b;
+ x ^= x >> 16;
+ return x ? x : 0x9E3779B9;
+}
+
+static void SeedNoise(Noise *noise, unsigned seed)
+{
+ int i;
+ for (i=0; i<VEC_N; i++) noise->x[i] = MixSeed(seed*VEC_N + i);
+ noise->nleft = 0;
+}
+
+// fills dst[] with white noise from -1 to 1, VEC_N samples per step
+static void NoiseBlock(Noise *noise, level_t *dst, int nframes)
+{
+ int i = 0;
+ while (i < nframes && noise->nleft > 0)
+  dst[i++] = noise->left[VEC_N - noise->nleft--];
+ uvec_t x = noise->x;
+ for (; i < nframes; i += VEC_N) {
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+#ifdef SNAPPY_FIXED
+  // the same numbers as below, exactly, in Q24
+  lvec_t f = ((lvec_t)(x >> 9) - (1<<22)) * 4;
+#else
+  // put the top 23 bits in a float's mantissa: 1 to 2, then scale to -1 to 1
+  vec_t f = (vec_t)((x >> 9) | 0x3F800000) * 2.0f - 3.0f;
+#endif
+  if (i + VEC_N <= nframes) memcpy(dst+i, &f, sizeof(f));
+  else {
+   int n = nframes - i;
+   memcpy(dst+i, &f, n*sizeof(level_t));
+   memcpy(noise->left, &f, sizeof(f));
+   noise->nleft = VEC_N - n;
+  }
+ }
+ noise->x = x;
+}
+
+// sends a voice event to StartVoices(), which starts it at the beginning
+// of the next Synthesize() call. only for the thread rendering the kit
+// (other threads' notes get here through the control queue)
+static void PushVoiceEvent(Kit *k, const VoiceEvent *ev)
+{
+ if (k->state.voiceEventCount < MAX_VOICE_EVENTS)
+  k->state.voiceEvents[k->state.voiceEventCount++] = *ev;
+}
+
+void ClaimKit(Kit *k)
+{
+ pthread_t self = pthread_self();
+ if (k->owned && pthread_equal(k->owner, self)) return;
+ __atomic_store(&k->owner, &self, __ATOMIC_RELAXED);
+ __atomic_store_n(&k->owned, 1, __ATOMIC_RELEASE);
+}
+
+// nonzero in the thread rendering the kit
+static int OwnsKit(Kit *k)
+{
+ pthread_t owner;
+ if (!__atomic_load_n(&k->owned, __ATOMIC_ACQUIRE)) return 0;
+ __atomic_load(&k->owner, &owner, __ATOMIC_RELAXED);
+ return pthread_equal(owner, pthread_self());
+}
+
+// sends MIDI (or a key, see CONTROL_KEY) from another thread to the thread
+// rendering the kit. safe to call from any thread
+static void PushControlEvent(Kit *k, const ControlEvent *ev)
+{
+ pthread_mutex_lock(&k->controlQueueLock);
+ unsigned in = k->controlQueueIn;
+ if (in - __atomic_load_n(&k->controlQueueOut, __ATOMIC_ACQUIRE) < CONTROL_QUEUE_SIZE) {
+  k->controlQueue[in & (CONTROL_QUEUE_SIZE-1)] = *ev;
+  __atomic_store_n(&k->controlQueueIn, in+1, __ATOMIC_RELEASE);
+ }
+ pthread_mutex_unlock(&k->controlQueueLock);
+}
+
+// which choke group a new tone drum or aux tone on this MIDI channel goes in
+static int ChokeGroup(const Kit *k, int type, int channel)
+{
+ if (k->settings.chokeMode == CHOKE_NONE) return 0;
+ if (type == VOICE_AUXTONE) return 16;
+ if (k->settings.chokeMode == CHOKE_CHANNEL) return channel+1;
+ return 1;
+}
+
+// finds a voice for a new note: the voice in the same choke group if there
+// is one, else a free voice, else the quietest voice (the cheapest to lose)
+static Voice* AllocateVoice(Kit *k, int type, int group)
+{
+ int i;
+ if (group) for (i=0; i<k->state.activeVoices; i++)
+  if (k->state.voices[i].group == group && k->state.voices[i].type == type) return &k->state.voices[i];
+ if (k->state.activeVoices < k->settings.voices) {
+  Voice *v = &k->state.voices[k->state.activeVoices++];
+  memset(v, 0, sizeof(Voice));
+  v->rng = MixSeed(Random(&k->state.rng));
+  v->n = v->count = 1;
+  v->lines = 6;
+  return v;
+ }
+ Voice *quietest = &k->state.voices[0];
+ for (i=1; i<k->state.activeVoices; i++)
+  if (LEVEL_ABS(k->state.voices[i].a) + LEVEL_ABS(k->state.voices[i].s) < LEVEL_ABS(quietest->a) + LEVEL_ABS(quietest->s))
+   quietest = &k->state.voices[i];
+ return quietest;
+}
+
+// sets up the start of a tone drum hit; scale is the volume, with polarity
+static void SetUpToneDrum(Kit *k, Voice *v, sample_t scale)
+{
+ v->s = v->a = LEVEL(scale);
+ v->ds = 0;
+ v->plateau = 1;
+ v->attack = 1;
+ v->lines = 6;
+ v->fm = v->dfm = 0;
+
+ v->count = v->n = k->state.tdSweepSpeed*2;
+ if (v->qw > k->quarterWaveMax) v->qw = k->quarterWaveMax;
+ v->attf = COEF((k->state.tdDecayFactor + 1.0) / v->qw);
+
+ if (v->n < v->qw) {
+  // this is to correct for amplitude decay during sweep
+  v->a = LEVEL(scale * pow(-k->state.tdDecayFactor, 0.25 - 0.25 * v->qw / k->state.tdSweepSpeed));
+  v->s = v->a;
+ }
+ else v->count = v->n = v->qw;
+
+ v->fresh = 1;
+ v->cached = 0;
+ v->cacheScale = LEVEL(scale);
+}
+
+static void StartToneDrum(Kit *k, const VoiceEvent *ev)
+{
+ Voice *v = AllocateVoice(k, VOICE_TONEDRUM, ev->group);
+ sample_t vol = ev->volume;
+ v->type = VOICE_TONEDRUM;
+ v->group = ev->group;
+ v->noteQW = ev->noteQW;
+ v->qw = ev->qw;
+ v->bend = ev->bend;
+ v->noisiness = SPAN(ev->noisiness);
+ if (v->bend != k->state.tdBend) { // pitch bend came after the note
+  v->bend = k->state.tdBend;
+  v->qw = 0.5+v->noteQW*v->bend;
+ }
+ if (v->qw < 1) v->qw = 1;
+ if (v->noisiness > SPAN(v->qw-1)) v->noisiness = SPAN(v->qw-1);
+
+ if      (v->s > 0) SetUpToneDrum(k, v, -vol);   // polarity
+ else if (v->s < 0) SetUpToneDrum(k, v,  vol);   //
+ else               SetUpToneDrum(k, v, (Random(&v->rng)&1) ? -vol : vol);
+}
+
+static void StartAuxTone(Kit *k, const VoiceEvent *ev)
+{
+ Voice *v = AllocateVoice(k, VOICE_AUXTONE, ev->group);
+ v->type = VOICE_AUXTONE;
+ v->group = ev->group;
+ v->noteQW = ev->noteQW;
+ v->qw = ev->qw;
+ v->bend = ev->bend;
+ v->decay = COEF(ev->decay);
+ if      (v->s > 0) v->a = LEVEL( ev->volume);   // polarity
+ else if (v->s < 0) v->a = LEVEL(-ev->volume);   //
+ else               v->a = LEVEL((Random(&v->rng)&1) ? -ev->volume : ev->volume);
+ v->count = 0;
+ v->plateau = 1;
+}
+
+// sorts one voice event into pending[], or applies it to the playing
+// voices. returns the new number of pending events
+static int TakeVoiceEvent(Kit *k, const VoiceEvent *ev, VoiceEvent *pending, int npending)
+{
+ int i, j;
+ switch (ev->type) {
+ case VOICE_TONEDRUM:
+  // if another tone drum in the same choke group was already received
+  // this period, do a ghost drum
+  for (j=0; j<npending; j++)
+   if (ev->group && pending[j].group == ev->group && pending[j].type == VOICE_TONEDRUM) break;
+  if (j < npending) {
+   pending[j].noisiness = (ev->qw - pending[j].qw)*0.5;
+   pending[j].qw = (ev->qw + pending[j].qw)*0.5;
+   pending[j].volume = (ev->volume + pending[j].volume)*0.5;
+   pending[j].noteQW = ev->noteQW;
+   pending[j].bend = ev->bend;
+  }
+  else pending[npending++] = *ev;
+ break;
+ case VOICE_AUXTONE:
+  pending[npending++] = *ev;
+ break;
+ case VOICE_RELEASE:
+  for (i=0; i<k->state.activeVoices; i++)
+   if (k->state.voices[i].type == VOICE_AUXTONE && k->state.voices[i].noteQW == ev->noteQW)
+    k->state.voices[i].decay = COEF(ev->decay);
+  for (j=0; j<npending; j++)
+   if (pending[j].type == VOICE_AUXTONE && pending[j].noteQW == ev->noteQW)
+    pending[j].decay = ev->decay;
+ break;
+ case VOICE_NOTESOFF:
+  for (i=0; i<k->state.activeVoices; i++) {
+   if (k->state.voices[i].type == VOICE_TONEDRUM) k->state.voices[i].qw = k->quarterWaveMax+1;
+   else k->state.voices[i].decay = COEF(-0.8);
+  }
+ break;
+ case VOICE_SOUNDOFF:
+  for (i=0; i<k->state.activeVoices; i++) {
+   Voice *v = &k->state.voices[i];
+   if (v->type == VOICE_TONEDRUM) { v->s = v->a = v->ds = 0; v->fresh = v->cached = 0; }
+   else { v->a = 0; v->count = 0; v->plateau = 1; }
+  }
+  npending = 0;
+ break;
+ }
+ return npending;
+}
+
+// starts the voices for the new voice events.
+// returns nonzero if a tone drum was started
+static int StartVoices(Kit *k)
+{
+ VoiceEvent pending[MAX_VOICE_EVENTS];
+ int npending = 0;
+ int j;
+ for (j=0; j<k->state.voiceEventCount; j++)
+  npending = TakeVoiceEvent(k, &k->state.voiceEvents[j], pending, npending);
+ k->state.voiceEventCount = 0;
+
+ int toneDrumStarted = 0;
+ for (j=0; j<npending; j++) {
+  if (pending[j].type == VOICE_TONEDRUM) {
+   StartToneDrum(k, &pending[j]);
+   toneDrumStarted = 1;
+  }
+  else StartAuxTone(k, &pending[j]);
+ }
+ return toneDrumStarted;
+}
+
+// adds one straight line to out[0..len-1]: s+ds, s+2*ds, ... s+len*ds,
+// VEC_N samples at a time. (a plateau is just a line with ds = 0)
+static void AddLine(level_t *out, int len, level_t s, level_t ds)
+{
+ int i;
+ lvec_t steps;
+ for (i=0; i<VEC_N; i++) steps[i] = i+1;
+ for (i=0; i+VEC_N<=len; i+=VEC_N) {
+  lvec_t o;
+  memcpy(&o, out+i, sizeof(o));
+  o += s + ds*(steps + (level_t)i);
+  memcpy(out+i, &o, sizeof(o));
+ }
+ for (; i<len; i++) out[i] += s + ds*(i+1);
+}
+
+// the live tone drum generator: adds the next nframes of a tone drum
+// voice to out[]. the wave is a line graph, so it gets drawn a line at a
+// time, and all the deciding happens only where one line ends
+#ifndef SNAPPY_FIXED
+static void ToneDrumLines(const Kit *k, Voice *v, level_t *out, int nframes,
+                          const int sweepSpeed, const coef_t decayFactor)
+{
+ // work on local copies, so the compiler can keep them in registers
+ sample_t s = v->s, ds = v->ds, a = v->a, fm = v->fm, dfm = v->dfm;
+ unsigned rng = v->rng;
+ int n = v->n, count = v->count, lines = v->lines;
+ int plateau = v->plateau, attack = v->attack;
+ const int qw = v->qw;
+ const sample_t noisiness = v->noisiness;
+ const sample_t attf = v->attf;
+ const sample_t lfRolloffSlope = 1.0 / (k->quarterWaveMax - k->quarterWaveFade);
+ int i = 0;
+ while (i < nframes) {
+  // the rest of this line, or as much of it as fits
+  int len = (count > 1) ? count : 1;
+  if (len > nframes-i) len = nframes-i;
+  AddLine(out+i, len, s, ds);
+  s += ds*len;
+  i += len;
+  count -= len;
+
+  /* for some nasty grit, each sample of the line could also get this:
+  if      (s > fabs(a)*0.001) out[i] += fabs(a)*0.25;
+  else if (s < fabs(a)*0.001) out[i] -= fabs(a)*0.25; */
+
+  if (count <= 0) {
+   if (attack) {
+    n += sweepSpeed;
+    if (n >= qw) attack = 0;
+   }
+   if (!attack) {
+    n = qw;
+    if (noisiness) {
+     fm += dfm;
+     n += fm + 0.5;
+     if (n < 1) n = 1;
+     if (--lines <= 0) {
+      lines = 6;
+      dfm = (1.0/6.0) * (noisiness*RandomSample(&rng) - fm);
+     }
+    }
+   }
+   if (plateau) {
+    plateau = 0;
+
+    if (attack) a *= -1.0 + n*attf;
+    else a *= decayFactor;
+
+    if    (n <= k->quarterWaveFade) ds = (a - s) / n;
+    else if (n < k->quarterWaveMax) ds = (a*(k->quarterWaveMax-n)*lfRolloffSlope - s) / n;
+    else ds = -s / n;
+
+    if (isSubnormalF(a)) a = 0;
+    if (isSubnormalF(s)) s = 0;
+    if (isSubnormalF(ds)) ds = 0;
+   }
+   else {
+    plateau = 1;
+    ds = 0;
+    if (isSubnormalF(s)) s = 0;
+   }
+   count = n;
+  }
+ }
+ v->s = s; v->ds = ds; v->a = a; v->fm = fm; v->dfm = dfm;
+ v->n = n; v->count = count; v->lines = lines;
+ v->plateau = plateau; v->attack = attack;
+ v->rng = rng;
+}
+#else
+// the same, in fixed point. a line can't always end exactly on its target
+// level (ds is rounded to a whole step), but each new line starts from
+// wherever the last one ended, so the error doesn't add up
+static void ToneDrumLines(const Kit *k, Voice *v, level_t *out, int nframes,
+                          const int sweepSpeed, const coef_t decayFactor)
+{
+ level_t s = v->s, ds = v->ds, a = v->a;
+ span_t fm = v->fm, dfm = v->dfm;
+ unsigned rng = v->rng;
+ int n = v->n, count = v->count, lines = v->lines;
+ int plateau = v->plateau, attack = v->attack;
+ const int qw = v->qw;
+ const span_t noisiness = v->noisiness;
+ const coef_t attf = v->attf;
+ const int fadeLength = k->quarterWaveMax - k->quarterWaveFade;
+ int i = 0;
+ while (i < nframes) {
+  int len = (count > 1) ? count : 1;
+  if (len > nframes-i) len = nframes-i;
+  AddLine(out+i, len, s, ds);
+  s += ds*len;
+  i += len;
+  count -= len;
+
+  if (count <= 0) {
+   if (attack) {
+    n += sweepSpeed;
+    if (n >= qw) attack = 0;
+   }
+   if (!attack) {
+    n = qw;
+    if (noisiness) {
+     fm += dfm;
+     n += (fm + (1<<(SPAN_BITS-1))) >> SPAN_BITS; // (rounded)
+     if (n < 1) n = 1;
+     if (--lines <= 0) {
+      lines = 6;
+      dfm = (RandomTimes(noisiness, &rng) - fm) / 6;
+     }
+    }
+   }
+   if (plateau) {
+    plateau = 0;
+
+    if (attack) a = MulCoef(a, -COEF_ONE + n*attf);
+    else a = MulCoef(a, decayFactor);
+
+    if    (n <= k->quarterWaveFade) ds = (a - s) / n;
+    else if (n < k->quarterWaveMax) ds = ((int64_t)a*(k->quarterWaveMax-n)/fadeLength - s) / n;
+    else ds = -s / n;
+   }
+   else {
+    plateau = 1;
+    ds = 0;
+    if (a == 0) s = 0; // (that slope was headed for 0; make sure it got there)
+   }
+   count = n;
+  }
+ }
+ v->s = s; v->ds = ds; v->a = a; v->fm = fm; v->dfm = dfm;
+ v->n = n; v->count = count; v->lines = lines;
+ v->plateau = plateau; v->attack = attack;
+ v->rng = rng;
+}
+#endif
+
+// sets a voice to a state from the tone drum cache (which is at volume 1)
+static void SetToneDrumState(Voice *v, const Voice *from, level_t scale)
+{
+ Voice keep = *v;
+ *v = *from;
+ v->type = keep.type; v->group = keep.group; v->noteQW = keep.noteQW;
+ v->bend = keep.bend; v->rng = keep.rng; v->cacheScale = keep.cacheScale;
+ v->s = MulLevel(v->s, scale); v->ds = MulLevel(v->ds, scale); v->a = MulLevel(v->a, scale);
+ v->fresh = v->cached = 0;
+}
+
+// the cache entry for a hit, or NULL if there isn't one
+static ToneCacheEntry* FindToneCache(Kit *k, int qw, int sweepSpeed, sample_t decayFactor)
+{
+ int i;
+ for (i=0; i<TONE_CACHE_SIZE; i++) {
+  ToneCacheEntry *c = &k->toneCache[i];
+  if (c->lastUsed && c->qw == qw && c->sweepSpeed == sweepSpeed
+      && c->decayFactor == decayFactor) return c;
+ }
+ return NULL;
+}
+
+// the least recently used entry that no voice is playing, to render a new
+// hit in place of, or NULL if every entry is playing
+static ToneCacheEntry* FreeToneCache(Kit *k)
+{
+ ToneCacheEntry *e = NULL;
+ int i, j;
+ for (i=0; i<TONE_CACHE_SIZE; i++) {
+  ToneCacheEntry *c = &k->toneCache[i];
+  for (j=0; j<k->state.activeVoices && k->state.voices[j].cached != i+1; j++);
+  if (j == k->state.activeVoices && (!e || c->lastUsed < e->lastUsed)) e = c;
+ }
+ return e;
+}
+
+// renders an entry's table, from its start
+static void FillToneCache(Kit *k, ToneCacheEntry *e)
+{
+ e->end = e->start;
+ memset(e->table, 0, k->toneCacheLen*sizeof(level_t));
+ ToneDrumLines(k, &e->end, e->table, k->toneCacheLen, e->sweepSpeed, COEF(e->decayFactor));
+ e->diesAway = LEVEL_ABS(e->end.a) + LEVEL_ABS(e->end.s) < LEVEL_TINY;
+}
+
+// if this hit can play from the cache, finds its entry, or renders a new
+// one in place of the least recently used entry that no voice is playing
+static void AttachToneCache(Kit *k, Voice *v)
+{
+ v->fresh = 0;
+ if (!k->toneCacheLen || v->noisiness != 0 || v->cacheScale == 0) return;
+ const int sweepSpeed = k->state.tdSweepSpeed;
+ const sample_t decayFactor = k->state.tdDecayFactor;
+ ToneCacheEntry *e = FindToneCache(k, v->qw, sweepSpeed, decayFactor);
+ if (!e) {
+  if (!(e = FreeToneCache(k))) return; // (every entry is playing)
+  e->qw = v->qw;
+  e->sweepSpeed = sweepSpeed;
+  e->decayFactor = decayFactor;
+#ifdef SNAPPY_FIXED
+  e->start = *v; // (set up again at volume 1: 1/cacheScale can be too big)
+  SetUpToneDrum(k, &e->start, 1);
+#else
+  SetToneDrumState(&e->start, v, 1/v->cacheScale);
+#endif
+  FillToneCache(k, e);
+ }
+ e->lastUsed = ++k->toneCacheClock;
+ if (e->diesAway) return;
+ v->cached = e - k->toneCache + 1;
+ v->cachePos = 0;
+}
+
+// allocates the cache tables, for the current sample rate, and fills the
+// cache with the tone drum notes (lowest first), so they're ready to play
+static void SetUpToneCache(Kit *k)
+{
+ int i;
+ k->toneCacheLen = (long long)k->settings.toneCacheMs * k->settings.sampleRate / 1000;
+ if (k->toneCacheLen <= 0) { k->toneCacheLen = 0; return; }
+ for (i=0; i<TONE_CACHE_SIZE; i++)
+  k->toneCache[i].table = malloc(k->toneCacheLen*sizeof(level_t));
+ k->toneCacheScratch = malloc(k->toneCacheLen*sizeof(level_t));
+
+ for (i=0; i<128; i++) if (k->qw[i] > 0) {
+  Voice v;
+  memset(&v, 0, sizeof(v));
+  v.type = VOICE_TONEDRUM;
+  v.noteQW = v.qw = k->qw[i];
+  v.bend = 1;
+  SetUpToneDrum(k, &v, 1);
+  AttachToneCache(k, &v);
+ }
+}
+
+// the hit changed while playing from the cache, so the live generator has
+// to take over: it catches up from the start of the hit to where it is now
+static void LeaveToneCache(Kit *k, Voice *v, const ToneCacheEntry *e)
+{
+ int pos = v->cachePos, qw = v->qw;
+ SetToneDrumState(v, &e->start, v->cacheScale);
+ memset(k->toneCacheScratch, 0, pos*sizeof(level_t));
+ ToneDrumLines(k, v, k->toneCacheScratch, pos, e->sweepSpeed, COEF(e->decayFactor));
+ v->qw = qw; // (all notes off changes this)
+}
+
+// adds the next nframes of a tone drum voice to out[]
+static void RenderToneDrum(Kit *k, Voice *v, level_t *out, int nframes)
+{
+ if (v->fresh) AttachToneCache(k, v);
+ if (v->cached) {
+  const ToneCacheEntry *e = &k->toneCache[v->cached-1];
+  if (v->bend != k->state.tdBend || v->qw != e->qw || k->state.tdSweepSpeed != e->sweepSpeed
+      || k->state.tdDecayFactor != e->decayFactor) LeaveToneCache(k, v, e);
+  else {
+   int i, len = k->toneCacheLen - v->cachePos;
+   if (len > nframes) len = nframes;
+   const level_t *t = e->table + v->cachePos;
+   const level_t scale = v->cacheScale;
+   for (i=0; i<len; i++) out[i] += MulLevel(scale, t[i]);
+   v->cachePos += len;
+   if (len > 0) v->s = MulLevel(scale, t[len-1]); // (for the polarity of the next hit)
+   if (v->cachePos == k->toneCacheLen) SetToneDrumState(v, &e->end, scale);
+   out += len;
+   nframes -= len;
+   if (nframes <= 0) return;
+  }
+ }
+
+ // pitch bend changes the tone while it's playing
+ if (v->bend != k->state.tdBend) {
+  v->bend = k->state.tdBend;
+  v->qw = 0.5+v->noteQW*v->bend;
+ }
+ if (v->qw < 1) v->qw = 1;
+ if (v->noisiness > SPAN(v->qw-1)) v->noisiness = SPAN(v->qw-1);
+ ToneDrumLines(k, v, out, nframes, k->state.tdSweepSpeed, COEF(k->state.tdDecayFactor));
+}
+
+// adds the next nframes of an aux tone voice to out[]
+static void RenderAuxTone(Kit *k, Voice *v, level_t *out, int nframes)
+{
+ if (v->bend != k->state.atBend) {
+  v->bend = k->state.atBend;
+  v->qw = 0.5+v->noteQW*v->bend;
+ }
+ if (v->qw < 1) v->qw = 1;
+ if (v->decay > 0) v->decay = -v->decay;
+ if (v->decay < -COEF_ONE) v->decay = -COEF_ONE;
+
+ level_t as = v->s, ads = v->ds, aa = v->a;
+ int acount = v->count, aplateau = v->plateau;
+ const int qw = v->qw;
+ const coef_t decay = v->decay;
+ int i = 0;
+ while (i < nframes) { // a line at a time, like the tone drum
+  int len = (acount > 1) ? acount : 1;
+  if (len > nframes-i) len = nframes-i;
+  AddLine(out+i, len, as, ads);
+  as += ads*len;
+  i += len;
+  acount -= len;
+
+  if (acount <= 0) {
+   acount = qw;
+   if (aplateau) {
+    aplateau = 0;
+#ifdef SNAPPY_FIXED
+    aa = MulCoef(aa, decay);
+    if (qw < k->quarterWaveMax) ads = (aa - as) / acount;
+    else ads = -as / acount;
+#else
+    aa *= decay;
+    if (qw < k->quarterWaveMax) ads = (aa - as) / acount;
+    else ads = -as / acount;
+    if (isSubnormalF(aa)) aa = 0;
+    if (isSubnormalF(as)) as = 0;
+    if (isSubnormalF(ads)) ads = 0;
+#endif
+   }
+   else {
+    aplateau = 1;
+    ads = 0;
+#ifdef SNAPPY_FIXED
+    if (aa == 0) as = 0; // (see the fixed point ToneDrumLines)
+#else
+    if (isSubnormalF(as)) as = 0;
+#endif
+   }
+  }
+ }
+ v->s = as; v->ds = ads; v->a = aa;
+ v->count = acount; v->plateau = aplateau;
+}
+
+// all the active voices render in one pass over the pool, and the
+// ones that have gone silent get swapped out of the active part
+static void RenderVoices(Kit *k, level_t *tdOut, level_t *atOut, int nframes)
+{
+ int i;
+ for (i=0; i<k->state.activeVoices; i++) {
+  Voice *v = &k->state.voices[i];
+  if (v->type == VOICE_TONEDRUM) RenderToneDrum(k, v, tdOut, nframes);
+  else                           RenderAuxTone(k, v, atOut, nframes);
+  if (v->a == 0 && v->s == 0 && v->ds == 0)
+   k->state.voices[i--] = k->state.voices[--k->state.activeVoices];
+ }
+}
+
+
+// claps and high hats share one white noise source, and get rendered
+// CLAP_BLOCK samples at a time: first everything that can be done with
+// vectors (noise, convolutions, decay curves, the first clap filter), then
+// a short scalar loop for the second clap filter, while a clap is sounding.
+#define CLAP_BLOCK 256 // MUST BE A MULTIPLE OF VEC_N
+#define CLAP_TICK 512  // clap starts with some decaying 'ticks', each 512 samples
+#define CLAP_FILTER 0.008 // the first clap filter's coefficient
+#define CYMBAL_FILTER 0.1 // the cymbal's highpass filter's
+
+#ifndef SNAPPY_FIXED
+// fills pw[0..n-1] with d^0, d^1, d^2, ... so decays don't need a multiply
+// chain through every sample. n gets rounded up to a multiple of VEC_N
+static void DecayCurve(sample_t *pw, sample_t d, int n)
+{
+ int i;
+ sample_t p = 1;
+ vec_t v, step;
+ for (i=0; i<VEC_N; i++) { v[i] = p; p *= d; }
+ step = (vec_t){0} + p; // d^VEC_N in every lane
+ for (i=0; i<n; i+=VEC_N) {
+  memcpy(pw+i, &v, sizeof(v));
+  v *= step;
+ }
+}
+
+// a one-pole lowpass filter (state += (x - state) * k), set up to run
+// VEC_N samples at a time: each lane gets its weighted sum of the inputs so
+// far, and only the old state has to be carried from one vector to the next.
+typedef struct {
+ sample_t k;
+ sample_t pN;     // how much of the old state is left after VEC_N samples
+ vec_t pj;        // how much of the old state is in each lane
+ vec_t w[VEC_N];  // w[m][j]: how much x[m] is in lane j
+} OnePole;
+
+static void SetUpOnePole(OnePole *op, sample_t k)
+{
+ int j, m;
+ const sample_t p = 1-k;
+ op->k = k;
+ for (j=0; j<VEC_N; j++) {
+  op->pj[j] = pow(p, j);
+  for (m=0; m<VEC_N; m++) op->w[m][j] = (m < j) ? k*pow(p, j-1-m) : 0;
+ }
+ op->pN = pow(p, VEC_N);
+}
+
+// runs the filter over x[0..n-1], and puts the filter state from before each
+// sample into f[]. n gets rounded up to a multiple of VEC_N
+static void OnePoleStates(const OnePole *op, sample_t *f, const sample_t *x, int n, sample_t state)
+{
+ int i, m;
+ const sample_t k = op->k, p = 1-k;
+ for (i=0; i<n; i+=VEC_N) {
+  vec_t acc = op->pj * state;
+  vec_t in = {0};
+  for (m=0; m<VEC_N-1; m++) in += op->w[m] * x[i+m];
+  acc += in;
+  memcpy(f+i, &acc, sizeof(acc));
+  state = op->pN*state + p*in[VEC_N-1] + k*x[i+VEC_N-1];
+ }
+}
+
+static OnePole g_clapFilter; // the first clap filter
+static OnePole g_cymbalFilter; // the cymbal's highpass filter (a lowpass, subtracted)
+#else
+// in fixed point, the filters just run a sample at a time
+static const coef_t g_clapFilterCoef = CLAP_FILTER * COEF_ONE + 0.5;
+static const coef_t g_cymbalFilterCoef = CYMBAL_FILTER * COEF_ONE + 0.5;
+#endif
+
+// the tables that all kits share, set up by SetUpGenerators()
+static level_t g_clapTick[CLAP_TICK+1]; // envelope of one clap tick
+
+static void SetUpGenerators()
+{
+ int i;
+ for (i=0; i<=CLAP_TICK; i++) g_clapTick[i] = LEVEL((2.0/512.0/512.0/512.0)*i*i*i);
+#ifndef SNAPPY_FIXED
+ SetUpOnePole(&g_clapFilter, CLAP_FILTER);
+ SetUpOnePole(&g_cymbalFilter, CYMBAL_FILTER);
+#endif
+}
+
+// starts new claps & high hats. returns nonzero if there's anything to render
+static int StartClapsAndHats(Kit *k, int toneDrumStarted)
+{
+ if (k->state.newClap) {
+  k->state.newClap = 0;
+  k->state.ca = COEF(k->state.clapVolume);
+  k->state.f2c = COEF_ONE;
+  if (toneDrumStarted) k->state.clapTicks = 0;
+  else                 k->state.clapTicks = 2;
+  k->state.clapTime = CLAP_TICK;
+ }
+ if (k->state.newHighHat) {
+  k->state.newHighHat = 0;
+  k->state.ha = COEF(k->state.hhVolume);
+ }
+ return k->state.ca != 0 || k->state.ha != 0;
+}
+
+#ifdef SNAPPY_FIXED
+static void RenderClapsAndHats(Kit *k, level_t *clapOut, level_t *hatOut, int nframes, int toneDrumStarted)
+{
+ if (!StartClapsAndHats(k, toneDrumStarted)) return;
+
+ // in fixed point, it's all done a sample at a time, in the same order
+ level_t n0 = k->state.n0, n1 = k->state.n1, f1s = k->state.f1s, f2s = k->state.f2s;
+ coef_t f2c = k->state.f2c, ca = k->state.ca, ha = k->state.ha;
+ int clapTicks = k->state.clapTicks, clapTime = k->state.clapTime;
+ const level_t *tick = g_clapTick;
+ const coef_t clapDecay = COEF(k->state.clapDecayFactor);
+ const coef_t hhDecay = COEF(k->state.hhDecayFactor);
+ level_t x[CLAP_BLOCK]; // noise
+ int i;
+ int block;
+ for (block=0; block<nframes; block+=CLAP_BLOCK) {
+  level_t *o = clapOut + block;
+  level_t *h = hatOut + block;
+  int len = (nframes-block < CLAP_BLOCK) ? nframes-block : CLAP_BLOCK;
+  NoiseBlock(&k->state.clapNoise, x, len);
+  for (i=0; i<len; i++) {
+   // the two simple convolutions of the noise
+   level_t clap = x[i] + 2*n0 + n1;
+   level_t hat = x[i] - 2*n0 + n1;
+   n1 = n0;
+   n0 = x[i];
+
+   if (ha != 0) {
+    h[i] -= MulCoef(hat, ha);
+    ha = MulCoef(ha, hhDecay);
+   }
+
+   // first clap filter (the noise minus its lowpass)
+   clap -= f1s;
+   f1s += MulCoef(clap, g_clapFilterCoef);
+
+   // second clap filter, and the clap itself
+   if (ca != 0) {
+    f2s += MulCoef(clap - f2s, f2c);
+    if (clapTicks > 0) {
+     o[i] += MulCoef(MulLevel(f2s, tick[clapTime]), ca);
+     if (--clapTime <= 0) {
+      clapTime = CLAP_TICK;
+      clapTicks--;
+     }
+    }
+    else {
+     o[i] += MulCoef(f2s, ca);
+     ca = MulCoef(ca, clapDecay);
+    }
+   }
+   f2c = MulCoef(f2c, clapDecay);
+  }
+ }
+ k->state.n0 = n0; k->state.n1 = n1; k->state.f1s = f1s; k->state.f2s = f2s; k->state.f2c = f2c;
+ k->state.ca = ca; k->state.ha = ha;
+ k->state.clapTicks = clapTicks; k->state.clapTime = clapTime;
+}
+#else
+
+// a block of claps & high hats (up to CLAP_BLOCK samples) in between the
+// stages below. the stages are separate so a batch of kits can run the
+// middle one together (see RenderClapsAndHatsBatch)
+typedef struct {
+ int len;
+ sample_t cn[CLAP_BLOCK+VEC_N];  // clap noise
+ sample_t cpw[CLAP_BLOCK+VEC_N]; // clap decay curve
+} ClapBlock;
+
+// first stage, all on vectors: the noise, the high hats, the first clap
+// filter, and the clap's decay curve
+static void ClapBlockStart(Kit *k, ClapBlock *cb, sample_t *h, int len)
+{
+ sample_t x[CLAP_BLOCK+VEC_N+2]; // noise, after the 2 previous samples
+ sample_t hn[CLAP_BLOCK+VEC_N];  // high hat noise
+ sample_t hpw[CLAP_BLOCK+VEC_N]; // high hat decay curve
+ sample_t f1n[CLAP_BLOCK+VEC_N]; // first clap filter state
+ sample_t *cn = cb->cn;
+ int vlen = (len + VEC_N) / VEC_N * VEC_N; // room for d^len in the curves
+ int i;
+ cb->len = len;
+
+ // noise, and the two simple convolutions of it
+ x[0] = k->state.n1;
+ x[1] = k->state.n0;
+ NoiseBlock(&k->state.clapNoise, x+2, len);
+ memset(x+2+len, 0, (vlen-len)*sizeof(sample_t));
+ k->state.n1 = x[len];
+ k->state.n0 = x[len+1];
+ for (i=0; i<vlen; i+=VEC_N) {
+  vec_t a, b, c;
+  memcpy(&a, x+i, sizeof(a));
+  memcpy(&b, x+i+1, sizeof(b));
+  memcpy(&c, x+i+2, sizeof(c));
+  vec_t clap = c + 2*b + a;
+  vec_t hat = c - 2*b + a;
+  memcpy(cn+i, &clap, sizeof(clap));
+  memcpy(hn+i, &hat, sizeof(hat));
+ }
+
+ // high hats
+ if (k->state.ha != 0) {
+  const sample_t ha = k->state.ha;
+  DecayCurve(hpw, k->state.hhDecayFactor, vlen);
+  for (i=0; i<len; i++) h[i] -= ha * hpw[i] * hn[i];
+  k->state.ha = ha * hpw[len];
+ }
+
+ // first clap filter: runs even when the clap is silent, so the
+ // next clap starts out the same as it always has
+ OnePoleStates(&g_clapFilter, f1n, cn, vlen, k->state.f1s);
+ k->state.f1s = f1n[len];
+ for (i=0; i<vlen; i+=VEC_N) {
+  vec_t c, f;
+  memcpy(&c, cn+i, sizeof(c));
+  memcpy(&f, f1n+i, sizeof(f));
+  c -= f;
+  memcpy(cn+i, &c, sizeof(c));
+ }
+ DecayCurve(cb->cpw, k->state.clapDecayFactor, vlen);
+}
+
+// second stage, only while the clap is sounding: the second clap filter,
+// whose coefficient decays along with the clap. it's a chain through every
+// sample, so it runs a sample at a time. (when the clap is silent it can be
+// skipped: a new clap resets f2c to 1, which wipes out the old f2s on its
+// first sample anyway)
+static void ClapBlockFilter(Kit *k, ClapBlock *cb)
+{
+ const sample_t f2c = k->state.f2c;
+ sample_t f2s = k->state.f2s;
+ int i;
+ for (i=0; i<cb->len; i++) {
+  sample_t g = f2c * cb->cpw[i];
+  f2s = f2s*(1-g) + cb->cn[i]*g; // f2s += (clapNoise - f2s) * g
+  cb->cn[i] = f2s;
+ }
+ k->state.f2s = f2s;
+}
+
+// last stage: the clap's ticks and then its decay, into o[]
+static void ClapBlockEnd(Kit *k, ClapBlock *cb, sample_t *o)
+{
+ const sample_t *cn = cb->cn, *cpw = cb->cpw, *tick = g_clapTick;
+ const int len = cb->len;
+ int i;
+ if (k->state.ca != 0) {
+  sample_t ca = k->state.ca;
+  int clapTicks = k->state.clapTicks, clapTime = k->state.clapTime;
+  i = 0;
+  while (clapTicks > 0 && i < len) {
+   o[i] += ca * cn[i] * tick[clapTime];
+   i++;
+   if (--clapTime <= 0) {
+    clapTime = CLAP_TICK;
+    clapTicks--;
+   }
+  }
+  int start = i; // where the clap starts decaying
+  for (; i<len; i++) o[i] += ca * cpw[i-start] * cn[i];
+  k->state.ca = ca * cpw[len-start];
+  k->state.clapTicks = clapTicks; k->state.clapTime = clapTime;
+ }
+ k->state.f2c *= cpw[len];
+
+ // avoid subnormal numbers, because they could waste CPU cycles
+ if (isSubnormalF(k->state.ca)) k->state.ca = 0;
+ if (isSubnormalF(k->state.ha)) k->state.ha = 0;
+ if (isSubnormalF(k->state.f2c)) k->state.f2c = 0;
+}
+
+static void RenderClapsAndHats(Kit *k, level_t *clapOut, level_t *hatOut, int nframes, int toneDrumStarted)
+{
+ ClapBlock cb;
+ int block;
+ if (!StartClapsAndHats(k, toneDrumStarted)) return;
+ for (block=0; block<nframes; block+=CLAP_BLOCK) {
+  int len = (nframes-block < CLAP_BLOCK) ? nframes-block : CLAP_BLOCK;
+  ClapBlockStart(k, &cb, hatOut + block, len);
+  if (k->state.ca != 0) ClapBlockFilter(k, &cb);
+  ClapBlockEnd(k, &cb, clapOut + block);
+ }
+}
+
+// the second clap filter for a batch of kits, with a kit in each lane of
+// the vectors: the chain through the samples is still there, but it carries
+// up to VEC_N claps at once. each vector gets built from the kits' blocks
+// right in the registers (spare lanes just filter silence)
+static void ClapBlockFilterLanes(Kit *kits[], ClapBlock *cb[], int nkits)
+{
+ static const sample_t silence[CLAP_BLOCK+VEC_N];
+ sample_t spare[CLAP_BLOCK+VEC_N];
+ const sample_t *cn[VEC_N], *cpw[VEC_N];
+ sample_t *out[VEC_N];
+ vec_t f2s = {0}, f2c = {0};
+ const int len = cb[0]->len;
+ int i, j;
+ for (j=0; j<VEC_N; j++) {
+  if (j < nkits) {
+   cn[j] = out[j] = cb[j]->cn;
+   cpw[j] = cb[j]->cpw;
+   f2s[j] = kits[j]->state.f2s;
+   f2c[j] = kits[j]->state.f2c;
+  }
+  else {
+   cn[j] = cpw[j] = silence;
+   out[j] = spare;
+  }
+ }
+ for (i=0; i<len; i++) {
+  vec_t x, w;
+  for (j=0; j<VEC_N; j++) {
+   x[j] = cn[j][i];
+   w[j] = cpw[j][i];
+  }
+  vec_t g = f2c * w;
+  f2s = f2s*(1-g) + x*g;
+  for (j=0; j<VEC_N; j++) out[j][i] = f2s[j];
+ }
+ for (j=0; j<nkits; j++) kits[j]->state.f2s = f2s[j];
+}
+
+// claps & high hats for a batch of up to VEC_N kits, each rendering nframes
+// into its own buses. the same as RenderClapsAndHats() on each one, except
+// that the kits with a clap sounding share the second clap filter
+static void RenderClapsAndHatsBatch(Kit *kits[], sample_t *bus[][NUM_BUSES],
+                                    const int toneDrumStarted[], int nkits, int nframes)
+{
+ ClapBlock blocks[VEC_N];
+ Kit *active[VEC_N], *sounding[VEC_N];
+ ClapBlock *sb[VEC_N];
+ sample_t *clapOut[VEC_N], *hatOut[VEC_N];
+ int nactive = 0, nsounding, j, block;
+ for (j=0; j<nkits; j++) {
+  if (!StartClapsAndHats(kits[j], toneDrumStarted[j])) continue;
+  active[nactive] = kits[j];
+  clapOut[nactive] = bus[j][BUS_CLAP];
+  hatOut[nactive] = bus[j][BUS_HIGHHAT];
+  nactive++;
+ }
+ for (block=0; block<nframes; block+=CLAP_BLOCK) {
+  int len = (nframes-block < CLAP_BLOCK) ? nframes-block : CLAP_BLOCK;
+  nsounding = 0;
+  for (j=0; j<nactive; j++) {
+   ClapBlockStart(active[j], &blocks[j], hatOut[j] + block, len);
+   if (active[j]->state.ca == 0) continue;
+   sounding[nsounding] = active[j];
+   sb[nsounding++] = &blocks[j];
+  }
+  if (nsounding > 1) ClapBlockFilterLanes(sounding, sb, nsounding);
+  else if (nsounding) ClapBlockFilter(sounding[0], sb[0]);
+  for (j=0; j<nactive; j++) ClapBlockEnd(active[j], &blocks[j], clapOut[j] + block);
+ }
+}
+#endif
+
+
+// the cymbal is a sum of square waves, so it only changes when one of them
+// flips. instead of stepping every square wave on every sample, this finds
+// the next flip, and fills in the constant stretch up to it through the
+// lowpass filter. so the cost goes with the number of flips, not tones
+// times samples. the highpass filter then runs on vectors, CLAP_BLOCK
+// samples at a time.
+static void RenderCymbal(Kit *k, level_t *out, int nframes)
+{
+ int *phases = k->state.cymPhases; // -tone..-1: positive half, 0..tone-1: negative
+ int tones[CYMBAL_N];
+ int i, j;
+ for (j=0; j<CYMBAL_N; j++) tones[j] = k->state.cymTones[j];
+ if (k->state.newCymbal) {
+  k->state.newCymbal = 0;
+  k->state.cymA = k->state.cymS = k->state.cymS2 = 0;
+  k->state.cymF = COEF_ONE;
+  for (j=0; j<CYMBAL_N; j++) {
+   //phases[j] = 0;
+   k->state.cymA += tones[j];
+  }
+  if (Random(&k->state.rng)&1) k->state.cymA = -k->state.cymA;
+  if (k->state.cymA != 0) k->state.cymA = LEVEL(0.4*k->state.cymVolume / k->state.cymA); // 'a' should never be zero here tho
+ }
+ if (k->state.cymA == 0 || k->state.cymF == 0) return; // here, 'a' can be zero if the cymbal is done ringing.
+
+#ifdef SNAPPY_FIXED
+ // in fixed point, the highpass filter just runs along with the lowpass
+ const level_t a = k->state.cymA; // amplitude
+ coef_t f = k->state.cymF;   // lowpass filter coefficient
+ level_t s = k->state.cymS;  // lowpass filter state
+ level_t s2 = k->state.cymS2; // highpass filter state
+ const coef_t decay = COEF(k->state.cymDecayFactor);
+ i = 0;
+ while (i < nframes) {
+  int v = 0, run = nframes - i;
+  for (j=0; j<CYMBAL_N; j++) {
+   int left;
+   if (phases[j] < 0) { v += tones[j]; left = -phases[j]; }
+   else { v -= tones[j]; left = tones[j] - phases[j]; if (left < 1) left = 1; }
+   if (left < run) run = left;
+  }
+  for (j=0; j<CYMBAL_N; j++) {
+   phases[j] += run;
+   if (phases[j] >= tones[j]) phases[j] = -tones[j];
+  }
+  const level_t va = v*a;
+  const int end = i + run;
+  level_t e = va - s;
+  for (; i<end; i++) {
+   e = MulCoef(e, COEF_ONE - f);
+   level_t ls = va - e;
+   s2 += MulCoef(ls - s2, g_cymbalFilterCoef);
+   out[i] += ls - s2;
+   f = MulCoef(f, decay);
+  }
+  s = va - e;
+ }
+#else
+ sample_t ls[CLAP_BLOCK+VEC_N]; // lowpass output
+ sample_t hs[CLAP_BLOCK+VEC_N]; // highpass filter states
+
+ // work on local copies, so the compiler can keep them in registers
+ const sample_t a = k->state.cymA; // amplitude
+ sample_t f = k->state.cymF;   // lowpass filter coefficient
+ sample_t s = k->state.cymS;   // lowpass filter state
+ sample_t s2 = k->state.cymS2; // highpass filter state
+ const sample_t decay = k->state.cymDecayFactor;
+ int block;
+ for (block=0; block<nframes; block+=CLAP_BLOCK) {
+  int len = (nframes-block < CLAP_BLOCK) ? nframes-block : CLAP_BLOCK;
+  int vlen = (len + VEC_N) / VEC_N * VEC_N;
+  i = 0;
+  while (i < len) {
+   // the current level, and how long it lasts until the next flip
+   int v = 0, run = len - i;
+   for (j=0; j<CYMBAL_N; j++) {
+    int left;
+    if (phases[j] < 0) { v += tones[j]; left = -phases[j]; }
+    else { v -= tones[j]; left = tones[j] - phases[j]; if (left < 1) left = 1; }
+    if (left < run) run = left;
+   }
+   for (j=0; j<CYMBAL_N; j++) {
+    phases[j] += run;
+    if (phases[j] >= tones[j]) phases[j] = -tones[j];
+   }
+
+   // with a constant input, the distance from the lowpass output to the
+   // input just gets multiplied by (1-f) on each sample
+   const sample_t va = v*a;
+   const int end = i + run;
+   sample_t e = va - s;
+   for (; i<end; i++) {
+    e *= 1-f;
+    ls[i] = va - e;
+    f *= decay;
+    if (isSubnormalF(f)) f = 0;
+   }
+   s = va - e;
+  }
+
+  memset(ls+len, 0, (vlen-len)*sizeof(sample_t));
+  OnePoleStates(&g_cymbalFilter, hs, ls, vlen, s2);
+  for (i=0; i<len; i++) out[block+i] += ls[i] - hs[i+1];
+  s2 = hs[len];
+  if (isSubnormalF(s)) s = 0;
+  if (isSubnormalF(s2)) s2 = 0;
+ }
+#endif
+ k->state.cymF = f; k->state.cymS = s; k->state.cymS2 = s2;
+}
+
+// the computer keyboard, for HandleKey(): two octaves on each of two rows,
+// and two more with shift
+static void SetUpKeys()
+{
+ int i; for (i=0; i<128; i++) g_keys[i] = -1;
+ char *row1l = "zsxdcvgbhnjm,l.;/";
+ char *row1u = "ZSXDCVGBHNJM<L>:?";
+ char *row2l = "q2w3er5t6y7ui9o0p[=]\n";
+ char *row2u = "Q@W#ER%T^Y&UI(O)P{+}";
+ for (i=0; row1l[i] != '\0'; i++) g_keys[row1l[i]] = i+24;
+ for (i=0; row2l[i] != '\0'; i++) g_keys[row2l[i]] = i+36;
+ for (i=0; row1u[i] != '\0'; i++) g_keys[row1u[i]] = i+48;
+ for (i=0; row2u[i] != '\0'; i++) g_keys[row2u[i]] = i+60;
+ g_keys[' '] = -1;
+}
+
+// the tables that are the same for every kit get set up once, by whichever
+// kit comes first
+static pthread_once_t g_tablesOnce = PTHREAD_ONCE_INIT;
+static void SetUpTables()
+{
+ SetUpKeys();
+ SetUpGenerators();
+}
+
+// works out which drum each MIDI note plays, at the kit's sample rate
+static void SetUpNotes(Kit *k)
+{
+ const long sampleRate = k->settings.sampleRate;
+ int i;
+ for (i=0; i<128; i++) {
+  int qw = 0.5 + 0.25 * sampleRate / MIDI_TO_FREQ(i);
+  k->qw[i] = qw;
+  if (qw <= 21) {
+   do {
+    k->qw[++i] = --qw;   
+   } while (qw > 0);
+   break;
+  }
+ }
+ if (i>124) i=124;
+ for (; i<128; i++) k->qw[i] = -(i&3);
+
+ k->quarterWaveFade = 0.5 + sampleRate * (0.25 / LOW_FREQUENCY_ROLLOFF);
+ k->quarterWaveMax = 0.5 + sampleRate * (0.25 / LOW_FREQUENCY_CUTOFF);
+ /*
+ fprintf(stderr, "sweep speed %d; ", k->state.tdSweepSpeed);
+ fprintf(stderr, "decay/release factor %f; ", k->state.tdDecayFactor);
+ fprintf(stderr, "short clap decay factor %f; ", k->state.clapDecayFactor);
+ fprintf(stderr, "short hihat decay factor %f; ", k->state.hhDecayFactor);
+ fprintf(stderr, "aux tone decay factor %f; ", -1.0+DCV_AUX_DECAY);
+ fprintf(stderr, "aux tone release factor %f\n", -1.0+DCV_AUX_RELEASE);
+ */
+}
+
+// puts a kit in its startup state: silent, with every controller at its
+// default, with its noise made from the seed in its settings
+int SetUpKit(Kit *k, const KitSettings *settings)
+{
+ int i;
+ const KitSettings s = *settings; // (which can be the kit's own)
+ if (s.sampleRate < 1) return -1;
+ pthread_once(&g_tablesOnce, SetUpTables);
+ CleanUpKit(k);
+ memset(k, 0, sizeof(Kit));
+ k->settings = s;
+ if (k->settings.voices < 1) k->settings.voices = 1;
+ if (k->settings.voices > MAX_VOICES) k->settings.voices = MAX_VOICES;
+ SetUpNotes(k);
+ pthread_mutex_init(&k->controlQueueLock, NULL);
+ const unsigned seed = k->settings.seed;
+ k->state.rng = MixSeed(seed);
+ SeedNoise(&k->state.clapNoise, seed);
+ k->state.masterVolume = 1.0;
+ k->state.tdBend = 1;
+ k->state.tdSweepSpeed = DCV_SWEEP_SPEED;
+ k->state.tdDecayFactor = -1.0+DCV_DECAY;
+ k->state.clapDecayFactor = 1.0-DCV_CLAP;
+ k->state.clapVolume = 0.2;
+ k->state.hhDecayFactor = 1.0-DCV_HH;
+ k->state.hhVolume = 0.2;
+ k->state.atBend = 1;
+ k->state.cbWaveScale = 4;
+ k->state.cbDecayFactor = 1.0-DCV_COWBELL;
+ k->state.cbVolume = 0.5;
+ static const int cymTones[CYMBAL_N] = {3, 4, 7, 11, 18, 29};
+ for (i=0; i<CYMBAL_N; i++) k->state.cymTones[i] = cymTones[i];
+ k->state.cymDecayFactor = 1.0-DCV_CYMBAL;
+ k->state.cymVolume = 0.2;
+ k->state.clapTweak = DCV_CLAP;
+ k->state.hhTweak = DCV_HH;
+ k->state.atDecay = -1.0+DCV_AUX_DECAY;
+ k->state.atRelease = -1.0+DCV_AUX_RELEASE;
+ k->state.cbTweak = DCV_COWBELL;
+ k->state.cymTweak = DCV_CYMBAL;
+ k->state.f2c = COEF(1);
+ k->state.clapTime = CLAP_TICK;
+ k->state.cbS = -18; // (the cowbell's DC)
+ k->state.cbCount = 2;
+ k->state.cymF = COEF(1);
+ SetUpToneCache(k);
+ return 0;
+}
+
+void CleanUpKit(Kit *k)
+{
+ int i;
+ for (i=0; i<TONE_CACHE_SIZE; i++) {
+  free(k->toneCache[i].table);
+  k->toneCache[i].table = NULL;
+ }
+ free(k->toneCacheScratch);
+ k->toneCacheScratch = NULL;
+}
+
+// copies a kit's state, with just the part of its voice pools in use:
+// the rest is left over from voices that are done
+static void CopyKitState(KitState *to, const KitState *from)
+{
+ memcpy(to, from, offsetof(KitState, voices));
+ memcpy(to->voices, from->voices, from->activeVoices*sizeof(Voice));
+ memcpy(to->voiceEvents, from->voiceEvents, from->voiceEventCount*sizeof(VoiceEvent));
+}
+
+void SaveKit(const Kit *k, KitSnapshot *snapshot)
+{
+ int i;
+ CopyKitState(&snapshot->state, &k->state);
+ snapshot->scheduledCount = k->scheduledCount;
+ memcpy(snapshot->scheduled, k->scheduled, k->scheduledCount*sizeof(ScheduledEvent));
+ for (i=0; i<k->state.activeVoices; i++) {
+  int cached = k->state.voices[i].cached;
+  if (cached) snapshot->cached[i] = k->toneCache[cached-1];
+ }
+}
+
+void RestoreKit(Kit *k, const KitSnapshot *snapshot)
+{
+ int i;
+ CopyKitState(&k->state, &snapshot->state);
+ k->scheduledCount = snapshot->scheduledCount;
+ memcpy(k->scheduled, snapshot->scheduled, snapshot->scheduledCount*sizeof(ScheduledEvent));
+
+ // a voice playing from the saved kit's cache plays on from the same hit
+ // in this kit's cache. if it doesn't have it (see FillKitCache), the live
+ // generator takes over: see LeaveToneCache
+ for (i=0; i<k->state.activeVoices; i++) k->state.voices[i].cached = 0;
+ for (i=0; i<k->state.activeVoices; i++) {
+  Voice *v = &k->state.voices[i];
+  if (!snapshot->state.voices[i].cached) continue;
+  const ToneCacheEntry *e = &snapshot->cached[i];
+  ToneCacheEntry *c = FindToneCache(k, e->qw, e->sweepSpeed, e->decayFactor);
+  if (c) v->cached = c - k->toneCache + 1;
+  else LeaveToneCache(k, v, e);
+ }
+}
+
+void FillKitCache(Kit *k, const KitSnapshot *snapshot)
+{
+ const int n = snapshot->state.activeVoices;
+ ToneCacheEntry *c;
+ int i;
+ // the hits it has first, so making room doesn't throw them out
+ for (i=0; i<n; i++) {
+  const ToneCacheEntry *e = &snapshot->cached[i];
+  if (!snapshot->state.voices[i].cached) continue;
+  if ((c = FindToneCache(k, e->qw, e->sweepSpeed, e->decayFactor)))
+   c->lastUsed = ++k->toneCacheClock;
+ }
+ for (i=0; i<n; i++) {
+  const ToneCacheEntry *e = &snapshot->cached[i];
+  if (!snapshot->state.voices[i].cached) continue;
+  if (FindToneCache(k, e->qw, e->sweepSpeed, e->decayFactor)) continue;
+  if (!(c = FreeToneCache(k))) return; // (no room: those play live)
+  c->qw = e->qw;
+  c->sweepSpeed = e->sweepSpeed;
+  c->decayFactor = e->decayFactor;
+  c->start = e->start;
+  FillToneCache(k, c);
+  c->lastUsed = ++k->toneCacheClock;
+ }
+}
+
+void CopyKit(Kit *k, const Kit *from)
+{
+ int i;
+ CopyKitState(&k->state, &from->state);
+ k->scheduledCount = from->scheduledCount;
+ memcpy(k->scheduled, from->scheduled, from->scheduledCount*sizeof(ScheduledEvent));
+ // every use of a cache entry sets lastUsed, from a clock that only goes
+ // up, so only the entries used since (and maybe filled with another hit)
+ // need copying
+ for (i=0; i<TONE_CACHE_SIZE; i++) {
+  ToneCacheEntry *c = &k->toneCache[i];
+  const ToneCacheEntry *e = &from->toneCache[i];
+  if (c->lastUsed == e->lastUsed) continue;
+  level_t *table = c->table;
+  *c = *e;
+  c->table = table;
+  if (table) memcpy(table, e->table, k->toneCacheLen*sizeof(level_t));
+ }
+ k->toneCacheClock = from->toneCacheClock;
+}
+
+// clock for the live stats
+unsigned long long NowNs(void)
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+// adds the time since 'since' to a stats total, and returns the time now.
+// does nothing if stats are off
+static unsigned long long StatsAdd(unsigned long long *total, unsigned long long since)
+{
+ if (!since) return 0; // (stats are off)
+ unsigned long long now = NowNs();
+ __atomic_store_n(total, *total + (now - since), __ATOMIC_RELAXED);
+ return now;
+}
+
+// the cowbell: a mix of two slanted triangle-waves, with a frequency ratio
+// of 2/3. This is implemented as a line graph.
+#define COWBELL_N 9
+static const int g_cowbellLengths[COWBELL_N] = {2,1,5,2,2,3,1,2,6};
+static const int g_cowbellSlopes[COWBELL_N] = {15, 3, -5, 7, -5, 3, -5, 7, -5};
+#define COWBELL_DC 18
+
+// starts a new cowbell. returns nonzero if there's anything to render
+static int StartCowbell(Kit *k)
+{
+ if (k->state.newCowbell) {
+  k->state.newCowbell = 0;
+  k->state.cbP = 0;
+  k->state.cbCount = g_cowbellLengths[0] * k->state.cbWaveScale;
+  k->state.cbS = -COWBELL_DC * k->state.cbWaveScale;
+  k->state.cbA = COEF(0.04 * k->state.cbVolume / k->state.cbWaveScale);
+  if (Random(&k->state.rng)&1) k->state.cbA = -k->state.cbA;
+ }
+ return k->state.cbA != 0 && k->state.cbWaveScale > 0 && k->state.cbWaveScale*3 <= k->quarterWaveFade;
+}
+
+static void RenderCowbell(Kit *k, level_t *out, int nframes)
+{
+ const int *lengths = g_cowbellLengths, *slopes = g_cowbellSlopes;
+ int i;
+ if (!StartCowbell(k)) return;
+ int s = k->state.cbS, p = k->state.cbP, count = k->state.cbCount;
+ coef_t a = k->state.cbA;
+#ifdef SNAPPY_FIXED
+ const coef_t decay = COEF(k->state.cbDecayFactor);
+#endif
+ // output loop
+ for (i=0; i<nframes; i++) {
+#ifdef SNAPPY_FIXED
+  out[i] += ((int64_t)s*a) >> (COEF_BITS-LEVEL_BITS);
+#else
+  out[i] += s*a;
+#endif
+  s += slopes[p];
+  if (--count <= 0) {
+   if (++p >= COWBELL_N) p = 0;
+   count = lengths[p] * k->state.cbWaveScale;
+  }
+#ifdef SNAPPY_FIXED
+  a = MulCoef(a, decay);
+#else
+  a *= k->state.cbDecayFactor;
+  if (isSubnormalF(a)) a=0;
+#endif
+ }
+ k->state.cbS = s; k->state.cbP = p; k->state.cbCount = count; k->state.cbA = a;
+}
+
+#ifndef SNAPPY_FIXED
+// the cowbell for a batch of kits, with a kit in each lane of the vectors.
+// all the lanes run together for as long as none of their lines ends; then
+// the lanes whose line ended get their next one, a kit at a time
+static void RenderCowbellLanes(Kit *kits[], sample_t *out[], int nkits, int nframes)
+{
+ typedef int ivec_t __attribute__((vector_size(sizeof(int)*VEC_N)));
+ int p[VEC_N];
+ ivec_t s = {0}, slope = {0}, count;
+ vec_t a = {0}, decay = {0};
+ int i = 0, j;
+ for (j=0; j<VEC_N; j++) {
+  if (j < nkits) {
+   Kit *k = kits[j];
+   s[j] = k->state.cbS;
+   p[j] = k->state.cbP;
+   count[j] = k->state.cbCount;
+   slope[j] = g_cowbellSlopes[p[j]];
+   a[j] = k->state.cbA;
+   decay[j] = k->state.cbDecayFactor;
+  }
+  else count[j] = nframes; // (spare lanes stay silent, and never end a line)
+ }
+ while (i < nframes) {
+  int run = nframes - i;
+  for (j=0; j<VEC_N; j++) if (count[j] < run) run = count[j];
+  if (run < 1) run = 1;
+  const int end = i + run;
+  for (; i<end; i++) {
+   vec_t v = __builtin_convertvector(s, vec_t) * a;
+   for (j=0; j<nkits; j++) out[j][i] += v[j];
+   s += slope;
+   a *= decay;
+  }
+  // no subnormals: checked once per line, not on every sample like the
+  // scalar loop, which is too slow on vectors that are wider than SSE
+  a = (vec_t)((uvec_t)a & (uvec_t)(((uvec_t)a & 0x7F800000) != 0));
+  count -= run;
+  for (j=0; j<nkits; j++) {
+   if (count[j] > 0) continue;
+   if (++p[j] >= COWBELL_N) p[j] = 0;
+   count[j] = g_cowbellLengths[p[j]] * kits[j]->state.cbWaveScale;
+   slope[j] = g_cowbellSlopes[p[j]];
+  }
+ }
+ for (j=0; j<nkits; j++) {
+  Kit *k = kits[j];
+  k->state.cbS = s[j]; k->state.cbP = p[j]; k->state.cbCount = count[j]; k->state.cbA = a[j];
+ }
+}
+#endif
+
+// all the SOUND GENERATING code is in these next functions. between
+// them, they render the next nframes samples of each instrument family
+// into bus[BUS_...]. buses can share a buffer, to get mixed together.
+static void TakeControlEvents(Kit *k); // (further down, with HandleMIDI)
+
+// the start of a part: MIDI from the other threads, silence, and the
+// voices. returns nonzero if a tone drum was started
+static int StartBuses(Kit *k, level_t *bus[NUM_BUSES], int nframes)
+{
+ int i, j;
+
+ // MIDI from the other threads (the parameters come out already checked)
+ TakeControlEvents(k);
+
+ // silence, to add each instrument onto
+ for (i=0; i<NUM_BUSES; i++) {
+  for (j=0; j<i && bus[j] != bus[i]; j++);
+  if (j == i) memset(bus[i], 0, nframes*sizeof(level_t));
+ }
+
+ unsigned long long t = k->settings.timing ? NowNs() : 0;
+
+ // Tone Drums and Auxillary Tones
+ int toneDrumStarted = StartVoices(k);
+ RenderVoices(k, bus[BUS_TONEDRUM], bus[BUS_AUXTONE], nframes);
+ StatsAdd(&k->sectionNs[STATS_VOICES], t);
+ return toneDrumStarted;
+}
+
+// the end of a part, after the claps & high hats
+static void FinishBuses(Kit *k, level_t *bus[NUM_BUSES], int nframes)
+{
+ unsigned long long t = k->settings.timing ? NowNs() : 0;
+
+ // Cowbell
+ RenderCowbell(k, bus[BUS_COWBELL], nframes);
+ t = StatsAdd(&k->sectionNs[STATS_COWBELL], t);
+
+ // Cymbal
+ RenderCymbal(k, bus[BUS_CYMBAL], nframes);
+ StatsAdd(&k->sectionNs[STATS_CYMBAL], t);
+}
+
+static void RenderBuses (Kit *k, level_t *bus[NUM_BUSES], int nframes)
+{
+ int toneDrumStarted = StartBuses(k, bus, nframes);
+ unsigned long long t = k->settings.timing ? NowNs() : 0;
+
+ // Claps and High Hats
+ RenderClapsAndHats(k, bus[BUS_CLAP], bus[BUS_HIGHHAT], nframes, toneDrumStarted);
+ StatsAdd(&k->sectionNs[STATS_CLAPHAT], t);
+
+ FinishBuses(k, bus, nframes);
+}
+
+#ifndef SNAPPY_FIXED
+// StatsAdd() for a section that a batch of kits rendered together: the
+// time gets shared out evenly
+static unsigned long long StatsShare(Kit *kits[], int nkits, int section, unsigned long long since)
+{
+ if (!since) return 0; // (stats are off)
+ unsigned long long now = NowNs(), each = (now - since) / nkits;
+ int j;
+ for (j=0; j<nkits; j++) {
+  unsigned long long *total = &kits[j]->sectionNs[section];
+  __atomic_store_n(total, *total + each, __ATOMIC_RELAXED);
+ }
+ return now;
+}
+
+// the same as RenderBuses() on each kit, for a batch of up to VEC_N kits
+// that all render a part of the same length
+static void RenderBatch (Kit *kits[], level_t *bus[][NUM_BUSES], int nkits, int nframes)
+{
+ int toneDrumStarted[VEC_N];
+ int j;
+ for (j=0; j<nkits; j++) toneDrumStarted[j] = StartBuses(kits[j], bus[j], nframes);
+ unsigned long long t = kits[0]->settings.timing ? NowNs() : 0;
+
+ // Claps and High Hats
+ RenderClapsAndHatsBatch(kits, bus, toneDrumStarted, nkits, nframes);
+ t = StatsShare(kits, nkits, STATS_CLAPHAT, t);
+
+ // Cowbells: the kits that have one sounding share the vectors
+ Kit *ringing[VEC_N];
+ sample_t *out[VEC_N];
+ int nringing = 0;
+ for (j=0; j<nkits; j++) {
+  if (!StartCowbell(kits[j])) continue;
+  ringing[nringing] = kits[j];
+  out[nringing++] = bus[j][BUS_COWBELL];
+ }
+ if (nringing > 1) RenderCowbellLanes(ringing, out, nringing, nframes);
+ else if (nringing) RenderCowbell(ringing[0], out[0], nframes);
+ t = StatsShare(kits, nkits, STATS_COWBELL, t);
+
+ // Cymbals
+ for (j=0; j<nkits; j++) {
+  unsigned long long tc = kits[j]->settings.timing ? NowNs() : 0;
+  RenderCymbal(kits[j], bus[j][BUS_CYMBAL], nframes);
+  StatsAdd(&kits[j]->sectionNs[STATS_CYMBAL], tc);
+ }
+}
+#endif
+
+static int TakeScheduledMIDI(Kit *k, int pos, int nframes); // (further down, with HandleMIDI)
+static void EndScheduledMIDI(Kit *k, int nframes);                 //
+
+#ifdef SNAPPY_FIXED
+// the fixed point engine renders into its own buffers, a block at a time,
+// and only the output gets turned into floats
+#define FIXED_BLOCK 256
+#endif
+
+// renders the period in parts, split wherever scheduled MIDI lands
+void SynthesizeBuses (Kit *k, sample_t *bus[NUM_BUSES], int nframes)
+{
+ int i, pos = 0;
+ ClaimKit(k);
+#ifdef SNAPPY_FIXED
+ int j;
+ level_t scratch[NUM_BUSES][FIXED_BLOCK];
+ level_t *lbus[NUM_BUSES];
+ for (i=0; i<NUM_BUSES; i++) { // buses that share a float buffer share a scratch buffer too
+  for (j=0; j<i && bus[j] != bus[i]; j++);
+  lbus[i] = scratch[j];
+ }
+#endif
+ while (pos < nframes) {
+  int n = TakeScheduledMIDI(k, pos, nframes);
+#ifdef SNAPPY_FIXED
+  if (n > FIXED_BLOCK) n = FIXED_BLOCK;
+  RenderBuses(k, lbus, n);
+  for (i=0; i<NUM_BUSES; i++) {
+   if (lbus[i] != scratch[i]) continue;
+   for (j=0; j<n; j++) bus[i][pos+j] = LEVEL_FLOAT(scratch[i][j]);
+  }
+#else
+  sample_t *part[NUM_BUSES];
+  for (i=0; i<NUM_BUSES; i++) part[i] = bus[i] + pos;
+  RenderBuses(k, part, n);
+#endif
+  pos += n;
+ }
+ EndScheduledMIDI(k, nframes);
+}
+
+void Synthesize (Kit *k, sample_t *out, int nframes)
+{
+ sample_t *bus[NUM_BUSES];
+ int i;
+ for (i=0; i<NUM_BUSES; i++) bus[i] = out;
+ SynthesizeBuses(k, bus, nframes);
+}
+
+#ifndef SNAPPY_FIXED
+// renders a batch of up to VEC_N kits. each kit's scheduled MIDI splits
+// the period for all of them, so they always render parts of the same length
+static void SynthesizeGroup (Kit *kits[], sample_t **bus[], int nkits, int nframes)
+{
+ sample_t *part[VEC_N][NUM_BUSES];
+ int i, j, pos = 0;
+ for (j=0; j<nkits; j++) ClaimKit(kits[j]);
+ while (pos < nframes) {
+  int n = nframes - pos;
+  for (j=0; j<nkits; j++) {
+   int next = TakeScheduledMIDI(kits[j], pos, nframes);
+   if (next < n) n = next;
+   for (i=0; i<NUM_BUSES; i++) part[j][i] = bus[j][i] + pos;
+  }
+  RenderBatch(kits, part, nkits, n);
+  pos += n;
+ }
+ for (j=0; j<nkits; j++) EndScheduledMIDI(kits[j], nframes);
+}
+#endif
+
+// renders many kits on one thread, VEC_N at a time, with a kit in each
+// vector lane where that helps. in fixed point there are no lanes to
+// share, so it's just SynthesizeBuses() on each kit
+void SynthesizeBatch (Kit *kits[], sample_t **bus[], int nkits, int nframes)
+{
+ int n;
+#ifdef SNAPPY_FIXED
+ for (n=0; n<nkits; n++) SynthesizeBuses(kits[n], bus[n], nframes);
+#else
+ for (n=0; n<nkits; n+=VEC_N)
+  SynthesizeGroup(kits+n, bus+n, (nkits-n < VEC_N) ? nkits-n : VEC_N, nframes);
+#endif
+}
+
+#ifdef SNAPPY_FIXED
+void SynthesizeLevels (Kit *k, level_t *out, int nframes)
+{
+ level_t *bus[NUM_BUSES];
+ int i, pos = 0;
+ ClaimKit(k);
+ while (pos < nframes) {
+  int n = TakeScheduledMIDI(k, pos, nframes);
+  for (i=0; i<NUM_BUSES; i++) bus[i] = out + pos;
+  RenderBuses(k, bus, n);
+  pos += n;
+ }
+ EndScheduledMIDI(k, nframes);
+}
+#endif
+
+
+
+
+// keeps the parameters in range, once whenever they change, so the
+// generators never have to check them
+static void ValidateParams(Kit *k)
+{
+ if (k->state.hhDecayFactor < 0) k->state.hhDecayFactor = -k->state.hhDecayFactor;
+ if (k->state.hhDecayFactor > 1) k->state.hhDecayFactor = 1;
+ if (k->state.clapDecayFactor < 0) k->state.clapDecayFactor = -k->state.clapDecayFactor;
+ if (k->state.clapDecayFactor > 1) k->state.clapDecayFactor = 1;
+ if (k->state.tdDecayFactor > 0) k->state.tdDecayFactor = -k->state.tdDecayFactor;
+ if (k->state.tdDecayFactor < -1) k->state.tdDecayFactor = -1;
+ if (k->state.tdSweepSpeed < 1) k->state.tdSweepSpeed = 1;
+ if (k->state.cbDecayFactor < -1) k->state.cbDecayFactor = -1;
+ if (k->state.cbDecayFactor > 1) k->state.cbDecayFactor = 1;
+ if (k->state.cbWaveScale < 1) k->state.cbWaveScale = 1;
+ if (k->state.cymDecayFactor < 0) k->state.cymDecayFactor = -k->state.cymDecayFactor;
+ if (k->state.cymDecayFactor > 1) k->state.cymDecayFactor = 1;
+}
+
+// responds to one MIDI message. This is where MIDI notes and controllers
+// get mapped onto the drums. status is one of the MIDI_* codes; for
+// MIDI_PITCHBEND, value is centered on zero (-8192 to 8191).
+// only for the thread rendering the kit: see HandleMIDI()
+static void ApplyMIDI(Kit *k, int status, int channel, int param, int value)
+{
+ switch (status) {
+ case MIDI_NOTEON:
+ {
+  int qw = k->qw[param];
+  sample_t v = (1.0/127.0) * value; v *= v * k->state.masterVolume;
+  if (v > 0) {
+   if (channel != 15) {
+    if (qw > 0) {                    // Tone Drums
+     VoiceEvent ev = {VOICE_TONEDRUM, ChokeGroup(k, VOICE_TONEDRUM, channel)};
+     ev.noteQW = qw;
+     ev.bend = k->state.tdBend;
+     ev.qw = 0.5+qw*ev.bend;
+     ev.volume = v;
+     PushVoiceEvent(k, &ev); // (ghost drums get sorted out in StartVoices)
+    }
+    else if (qw == 0 || qw == -1) { // Claps
+     sample_t cdf;
+     if (qw == 0) cdf = 1.0-k->state.clapTweak;
+     else         cdf = 1.0-k->state.clapTweak*0.5;
+     v *= 0.3;
+     if (!k->state.newClap) {
+      k->state.newClap = 1;
+      k->state.clapVolume = v;
+      k->state.clapDecayFactor = cdf;
+     }
+     else { // if another clap was already received, pick the loudest and longest
+      if (k->state.clapVolume < v) k->state.clapVolume = v;
+      if (k->state.clapDecayFactor < cdf) k->state.clapDecayFactor = cdf;
+     }
+    }
+    else if (qw == -2 || qw == -3) { // High Hats
+     sample_t hdf;
+     if (qw == -3) hdf = 1.0-k->state.hhTweak;
+     else          hdf = 1.0-k->state.hhTweak*0.25;
+     v *= 0.2;
+     if (!k->state.newHighHat) {
+      k->state.newHighHat = 1;
+      k->state.hhVolume = v;
+      k->state.hhDecayFactor = hdf;
+     }
+     else { // if another hihat was already received, pick the loudest and longest
+      if (k->state.hhVolume < v) k->state.hhVolume = v;
+      if (k->state.hhDecayFactor < hdf) k->state.hhDecayFactor = hdf;
+     }
+    }
+   } 
+   else {
+    if (qw > 0) {                     // Aux Tones
+     VoiceEvent ev = {VOICE_AUXTONE, ChokeGroup(k, VOICE_AUXTONE, channel)};
+     ev.noteQW = qw;
+     ev.bend = k->state.atBend;
+     ev.qw = 0.5+qw*ev.bend;
+     ev.volume = v*0.4;
+     ev.decay = k->state.atDecay;
+     PushVoiceEvent(k, &ev);
+    }
+    else switch(param) { // Cymbals
+     case 127:
+      k->state.newCymbal = 1;
+      k->state.cymVolume = v*0.5;
+      k->state.cymDecayFactor = 1.0-k->state.cymTweak;
+      k->state.cymTones[0] = 9;
+      k->state.cymTones[1] = 17;
+      k->state.cymTones[2] = 26;
+      k->state.cymTones[3] = 43;
+      k->state.cymTones[4] = 69;
+      k->state.cymTones[5] = 112; // fibonacci 1
+     break;
+     case 126:
+      k->state.newCymbal = 1;
+      k->state.cymVolume = v;
+      k->state.cymDecayFactor = 1.0-k->state.cymTweak*0.1;
+      k->state.cymTones[1] = 17;
+      k->state.cymTones[2] = 26;
+      k->state.cymTones[3] = 43;
+      k->state.cymTones[4] = 69;
+      k->state.cymTones[5] = 112;
+      k->state.cymTones[0] = 181; // same as above, but deeper
+     break;
+     case 125:
+      k->state.newCymbal = 1;
+      k->state.cymVolume = v*0.5;
+      k->state.cymDecayFactor = 1.0-k->state.cymTweak;
+      k->state.cymTones[0] = 11;
+      k->state.cymTones[1] = 19;
+      k->state.cymTones[2] = 30;
+      k->state.cymTones[3] = 49;
+      k->state.cymTones[4] = 79;
+      k->state.cymTones[5] = 128; // fibonacci 2
+     break;
+     case 124:
+      k->state.newCymbal = 1;
+      k->state.cymVolume = v;
+      k->state.cymDecayFactor = 1.0-k->state.cymTweak*0.1;
+      k->state.cymTones[1] = 19;
+      k->state.cymTones[2] = 30;
+      k->state.cymTones[3] = 49;
+      k->state.cymTones[4] = 79;
+      k->state.cymTones[5] = 128;
+      k->state.cymTones[0] = 207; // same as above, but deeper
+     break;
+     case 123:
+      k->state.newCymbal = 1;
+      k->state.cymVolume = v*0.5;
+      k->state.cymDecayFactor = 1.0-k->state.cymTweak;
+      k->state.cymTones[0] = 13;
+      k->state.cymTones[1] = 21;
+      k->state.cymTones[2] = 34;
+      k->state.cymTones[3] = 55;
+      k->state.cymTones[4] = 89;
+      k->state.cymTones[5] = 144; // fibonacci 3
+     break;
+     case 122:
+      k->state.newCymbal = 1;
+      k->state.cymVolume = v;
+      k->state.cymDecayFactor = 1.0-k->state.cymTweak*0.1;
+      k->state.cymTones[1] = 21;
+      k->state.cymTones[2] = 34;
+      k->state.cymTones[3] = 55;
+      k->state.cymTones[4] = 89;
+      k->state.cymTones[5] = 144;
+      k->state.cymTones[0] = 233; // same as above, but deeper
+     break;
+     case 121:
+      k->state.newCymbal = 1;
+      k->state.cymVolume = v*0.5;
+      k->state.cymDecayFactor = 1.0-k->state.cymTweak;
+      k->state.cymTones[0] = 48;
+      k->state.cymTones[1] = 59;
+      k->state.cymTones[2] = 71;
+      k->state.cymTones[3] = 85;
+      k->state.cymTones[4] = 101;
+      k->state.cymTones[5] = 121; // coprime evenly spaced spectrum 1
+     break;
+     case 120:
+      k->state.newCymbal = 1;
+      k->state.cymVolume = v;
+      k->state.cymDecayFactor = 1.0-k->state.cymTweak*0.1;
+      k->state.cymTones[3] = 85;
+      k->state.cymTones[4] = 101;
+      k->state.cymTones[5] = 121;
+      k->state.cymTones[0] = 148; // same as above, but deeper
+      k->state.cymTones[1] = 177;
+      k->state.cymTones[2] = 211;
+     break;
+     default:                         // Cowbells
+      k->state.cbVolume = v;
+      k->state.cbWaveScale = 120 - param;
+      k->state.cbDecayFactor = 1.0-k->state.cbTweak/k->state.cbWaveScale;
+      k->state.newCowbell = 1;
+    }
+   }
+  }
+ }
+ break;
+ case MIDI_NOTEOFF:
+  if (channel == 15) {
+   VoiceEvent ev = {VOICE_RELEASE};
+   ev.noteQW = k->qw[param];
+   ev.decay = k->state.atRelease;
+   PushVoiceEvent(k, &ev);
+  }
+ break;
+ case MIDI_PITCHBEND:
+ {
+  sample_t bend = exp(value*(-M_LN2/8192.0));
+  if (channel == 15) k->state.atBend = bend;
+  else k->state.tdBend = bend;
+ }
+ break;
+ case MIDI_CONTROLLER:
+  if (param == 7) {       // Master Volume (all channels)
+   k->state.masterVolume = (1.0/127.0/127.0)*value*value;
+  }
+  else if (param == 70 && channel != 15) {
+                                           // Sound Variation
+   k->state.tdSweepSpeed = (127-value)*((DCV_SWEEP_SPEED-1)/63.0)+1.5;
+  }
+  else if (param == 71) { // Sound Timbre
+   if (channel == 15) k->state.atDecay = -1.0 + (127-value)*(DCV_AUX_DECAY/63.0);
+  }
+  else if (param == 72) { // Sound Release Time
+   if (channel == 15) k->state.atRelease = -1.0 + DCV_AUX_RELEASE*1.5 - value * (DCV_AUX_RELEASE*0.5 / 64.0);
+   else k->state.tdDecayFactor = -1.0 + (127-value) * (DCV_DECAY/63.0);
+  }
+  else if (param == 75) { // Sound Control 6 (clap)
+   if (channel == 15)
+    k->state.cbTweak = DCV_COWBELL*1.5-value*(DCV_COWBELL*0.5/64.0);
+   else k->state.clapTweak = DCV_CLAP*1.5-value*(DCV_CLAP*0.5/64.0);
+  }
+  else if (param == 76) { // Sound Control 7 (high hats)
+   if (channel == 15)
+    k->state.cymTweak = DCV_CYMBAL*1.5-value*(DCV_CYMBAL*0.5/64.0);
+   else k->state.hhTweak = DCV_HH*1.5 - value * (DCV_HH*0.5 / 64.0);
+  }
+  else if (param == 121) { // All Controllers Off (all channels)
+   k->state.masterVolume = 1.0;
+   k->state.tdSweepSpeed = DCV_SWEEP_SPEED;
+   k->state.tdDecayFactor = -1.0 + DCV_DECAY;
+   k->state.tdBend = 1;
+   k->state.atBend = 1;
+   k->state.clapTweak = DCV_CLAP;
+   k->state.hhTweak = DCV_HH;
+   k->state.atDecay = -1.0+DCV_AUX_DECAY;
+   k->state.atRelease = -1.0+DCV_AUX_RELEASE;
+   k->state.cbTweak = DCV_COWBELL;
+   k->state.cymTweak = DCV_CYMBAL;
+  }
+  else if (param == 120) { // All Sound Off (all channels)
+   VoiceEvent ev = {VOICE_SOUNDOFF};
+   PushVoiceEvent(k, &ev);
+   k->state.clapVolume = k->state.hhVolume = k->state.cbVolume = k->state.cymVolume = 0;
+   k->state.newClap = k->state.newHighHat = k->state.newCowbell = k->state.newCymbal = 1;
+  }
+  if (param == 123) {      // All Notes Off (all channels)
+   VoiceEvent ev = {VOICE_NOTESOFF};
+   PushVoiceEvent(k, &ev);
+   k->state.clapDecayFactor = 0.999;           
+   k->state.hhDecayFactor = 0.998;
+   k->state.cbDecayFactor = 0.996;
+   k->state.cymDecayFactor = 0.998;
+  }
+ break;
+ }
+ ValidateParams(k);
+}
+
+// plays what a key on the computer keyboard plays (see main)
+static void ApplyKey(Kit *k, int key)
+{
+ if (key == '1' || key == '!') {
+  k->state.newClap = 1;
+  k->state.clapVolume = 0.2*k->state.masterVolume;
+ }
+ else if (key == '`' || key == '~') {
+  k->state.newHighHat = 1;
+  k->state.hhVolume = 0.2*k->state.masterVolume;
+ }
+ else if (key == '-') {
+  k->state.newCowbell = 1;
+  k->state.cbWaveScale = 8;
+  k->state.cbDecayFactor = 1.0 - DCV_COWBELL/k->state.cbWaveScale;
+  k->state.cbVolume = 0.5*k->state.masterVolume;
+ }
+ else if (key == '_') {
+  k->state.newCowbell = 1;
+  k->state.cbWaveScale = 6;
+  k->state.cbDecayFactor = 1.0 - DCV_COWBELL/k->state.cbWaveScale;
+  k->state.cbVolume = 0.5*k->state.masterVolume;
+ }
+ else if (key >= 0 && key < 128 && g_keys[key] > 0) {
+  int qw = k->qw[g_keys[key]];
+  if (qw > 0) {
+   VoiceEvent ev = {VOICE_TONEDRUM, ChokeGroup(k, VOICE_TONEDRUM, 0)};
+   ev.noteQW = ev.qw = qw;
+   ev.bend = k->state.tdBend;
+   ev.volume = 0.8*k->state.masterVolume;
+   PushVoiceEvent(k, &ev);
+  }
+ }
+}
+
+// nonzero if a message is in range for ApplyMIDI(), which indexes with
+// param (a note or a controller) and doesn't check any of it
+static int ValidMIDI(int status, int channel, int param, int value)
+{
+ if (channel < 0 || channel > 15 || param < 0 || param > 127) return 0;
+ if (status == MIDI_PITCHBEND) return value >= -8192 && value <= 8191;
+ return value >= 0 && value <= 127;
+}
+
+// function that responds to one MIDI message, from any thread. the thread
+// rendering the kit applies it right away; others queue it for that thread.
+// anything out of range is dropped
+void HandleMIDI(Kit *k, int status, int channel, int param, int value)
+{
+ if (!ValidMIDI(status, channel, param, value)) return;
+ if (OwnsKit(k)) ApplyMIDI(k, status, channel, param, value);
+ else {
+  ControlEvent ev = {status, channel, param, value};
+  PushControlEvent(k, &ev);
+ }
+}
+
+// same thing, for a key on the computer keyboard
+void HandleKey(Kit *k, int key)
+{
+ if (OwnsKit(k)) ApplyKey(k, key);
+ else {
+  ControlEvent ev = {CONTROL_KEY, 0, key};
+  PushControlEvent(k, &ev);
+ }
+}
+
+static void ApplyControlEvent(Kit *k, const ControlEvent *ev)
+{
+ if (ev->status == CONTROL_KEY) ApplyKey(k, ev->param);
+ else ApplyMIDI(k, ev->status, ev->channel, ev->param, ev->value);
+}
+
+// applies what the other threads have sent since the last call
+static void TakeControlEvents(Kit *k)
+{
+ unsigned in = __atomic_load_n(&k->controlQueueIn, __ATOMIC_ACQUIRE);
+ unsigned out = k->controlQueueOut;
+ if (out == in) return;
+ for (; out != in; out++) ApplyControlEvent(k, &k->controlQueue[out & (CONTROL_QUEUE_SIZE-1)]);
+ __atomic_store_n(&k->controlQueueOut, out, __ATOMIC_RELEASE);
+}
+
+int PendingMIDI(Kit *k)
+{
+ return __atomic_load_n(&k->controlQueueIn, __ATOMIC_ACQUIRE) != k->controlQueueOut;
+}
+
+// turns a raw MIDI message into HandleMIDI()'s numbers. returns 0 if it's
+// nothing the drums respond to (or not a proper message)
+static int ParseMIDIMessage(const unsigned char *msg, size_t size, ControlEvent *ev)
+{
+ if (size < 2) return 0;
+ int status = msg[0] & 0xF0, channel = msg[0] & 0x0F;
+ int data2 = (size > 2) ? msg[2] : 0;
+ if ((msg[1] | data2) & 0x80) return 0; // (data bytes are 0..127: it's broken)
+ switch (status) {
+ case MIDI_NOTEOFF: case MIDI_NOTEON: case MIDI_CONTROLLER:
+  *ev = (ControlEvent){status, channel, msg[1], data2};
+  return 1;
+ case MIDI_PITCHBEND:
+  *ev = (ControlEvent){status, channel, 0, (data2 << 7 | msg[1]) - 8192};
+  return 1;
+ }
+ return 0;
+}
+
+void HandleMIDIMessage(Kit *k, const unsigned char *msg, size_t size)
+{
+ ControlEvent ev;
+ if (ParseMIDIMessage(msg, size, &ev)) HandleMIDI(k, ev.status, ev.channel, ev.param, ev.value);
+}
+
+void ScheduleMIDI(Kit *k, long frame, int status, int channel, int param, int value)
+{
+ if (k->scheduledCount >= MAX_SCHEDULED) return; // (full: it's lost)
+ if (!ValidMIDI(status, channel, param, value)) return;
+ int i = k->scheduledCount++;
+ for (; i > 0 && k->scheduled[i-1].frame > frame; i--) k->scheduled[i] = k->scheduled[i-1];
+ k->scheduled[i].frame = frame;
+ k->scheduled[i].ev = (ControlEvent){status, channel, param, value};
+}
+
+void ScheduleMIDIMessage(Kit *k, long frame, const unsigned char *msg, size_t size)
+{
+ ControlEvent ev;
+ if (ParseMIDIMessage(msg, size, &ev)) ScheduleMIDI(k, frame, ev.status, ev.channel, ev.param, ev.value);
+}
+
+// applies the scheduled MIDI that's due by frame pos of this Synthesize()
+// call, and returns how many frames there are until the next is due
+static int TakeScheduledMIDI(Kit *k, int pos, int nframes)
+{
+ int i;
+ for (i=0; i<k->scheduledCount && k->scheduled[i].frame <= pos; i++)
+  ApplyControlEvent(k, &k->scheduled[i].ev);
+ if (i > 0) {
+  k->scheduledCount -= i;
+  memmove(k->scheduled, k->scheduled + i, k->scheduledCount*sizeof(ScheduledEvent));
+ }
+ if (k->scheduledCount && k->scheduled[0].frame < nframes) return k->scheduled[0].frame - pos;
+ return nframes - pos;
+}
+
+// what's still scheduled is for later calls: counts it from the next one
+static void EndScheduledMIDI(Kit *k, int nframes)
+{
+ int i;
+ for (i=0; i<k->scheduledCount; i++) k->scheduled[i].frame -= nframes;
+}
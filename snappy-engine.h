@@ -0,0 +1,433 @@
+/***
+ The sound engine of Elie's snappy drum machine, as a library.
+ snappy-drums.c (JACK, curses and the offline modes) and snappy-lv2.c are
+ both just programs that use it. each kit is a context of its own: the only
+ thing kits share is a few tables that never change once they're made, so
+ a program can run as many kits as it likes, each on its own thread.
+ MIDI can be scheduled at any frame of the next Synthesize() call, or sent
+ from another thread with HandleMIDI(), to apply at the start of the next.
+ --
+
+ How to use it:
+    Kit *k = calloc(1, sizeof(Kit)); // (or a static one: it starts out all zeros)
+    KitSettings s = DEFAULT_KIT_SETTINGS;
+    s.sampleRate = 44100;
+    SetUpKit(k, &s);
+    ScheduleMIDIMessage(k, 100, noteOn, 3); // a note, 100 frames from now
+    Synthesize(k, out, 256);                // the next 256 frames
+    ...
+    CleanUpKit(k);
+
+ To compile it in:
+    gcc yourprogram.c snappy-engine.c -lpthread -lm -O3 -ffast-math
+
+ (with -DSNAPPY_FIXED, the generators run in fixed point: see the manpage.
+ the program has to be compiled with the same flag, for the same Kit.)
+
+
+ Copyright 2019, Elie Goldman Smith
+
+ This program is FREE SOFTWARE: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+***/
+
+#ifndef SNAPPY_ENGINE_H
+#define SNAPPY_ENGINE_H
+
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef float sample_t; // the same as JACK's and LV2's
+
+
+// SIMD vectors, with GCC's vector extensions. these compile to SSE
+// by default, or to AVX etc. if you add -march=native
+#define VEC_N 8 // floats per vector
+typedef sample_t vec_t __attribute__((vector_size(sizeof(sample_t)*VEC_N)));
+typedef unsigned uvec_t __attribute__((vector_size(sizeof(unsigned)*VEC_N)));
+
+// the sound engine's own numbers. normally they're floats, the same as
+// JACK's, but built with -DSNAPPY_FIXED the generators run on integers only,
+// for boards with a slow (or no) FPU: see FIXED POINT in the manpage.
+// levels are signals and amplitudes; coefs are multipliers, like decays;
+// spans are lengths in samples, with a fraction (the tone drum's noisiness).
+// LEVEL() etc. convert from floating point, for the control code.
+#ifdef SNAPPY_FIXED
+#define LEVEL_BITS 24 // Q24: 1.0 is 1<<24, so there are 7 bits of headroom
+#define COEF_BITS  30 // Q30
+#define SPAN_BITS  16 // Q16
+typedef int32_t level_t;
+typedef int32_t coef_t;
+typedef int32_t span_t;
+#define LEVEL(x) ((level_t)lrint((x) * (double)(1<<LEVEL_BITS)))
+#define COEF(x)  ((coef_t)lrint((x) * (double)(1<<COEF_BITS)))
+#define SPAN(x)  ((span_t)lrint((x) * (double)(1<<SPAN_BITS)))
+#define COEF_ONE (1<<COEF_BITS) // 1.0 (COEF() is too slow for the generators)
+#define LEVEL_FLOAT(x) ((x) * (1.0f/(1<<LEVEL_BITS)))
+#define COEF_FLOAT(x)  ((x) * (1.0f/(1<<COEF_BITS)))
+#define LEVEL_ABS(x) abs(x)
+#define LEVEL_TINY 1 // (the smallest level that isn't 0)
+// x*c, rounded toward zero, so that anything that keeps decaying gets to 0
+static inline level_t MulCoef(level_t x, coef_t c)
+ { return (int64_t)x * c / (1<<COEF_BITS); }
+static inline level_t MulLevel(level_t x, level_t y)
+ { return ((int64_t)x * y) >> LEVEL_BITS; }
+#else
+typedef sample_t level_t;
+typedef sample_t coef_t;
+typedef sample_t span_t;
+#define LEVEL(x) (x)
+#define COEF(x)  (x)
+#define SPAN(x)  (x)
+#define COEF_ONE 1
+#define LEVEL_FLOAT(x) (x)
+#define COEF_FLOAT(x)  (x)
+#define LEVEL_ABS(x) fabsf(x)
+#define LEVEL_TINY 1e-20
+#define MulLevel(x, y) ((x) * (y))
+#endif
+typedef level_t lvec_t __attribute__((vector_size(sizeof(level_t)*VEC_N)));
+
+// MIDI message types (the high nibble of the status byte)
+#define MIDI_NOTEOFF    0x80
+#define MIDI_NOTEON     0x90
+#define MIDI_CONTROLLER 0xB0
+#define MIDI_PITCHBEND  0xE0
+
+// instrument families, each with its own output port in multi-out mode
+#define BUS_TONEDRUM 0
+#define BUS_CLAP     1
+#define BUS_HIGHHAT  2
+#define BUS_AUXTONE  3
+#define BUS_COWBELL  4
+#define BUS_CYMBAL   5
+#define NUM_BUSES    6
+
+// the sections the live stats time, when a kit's settings ask for it.
+// only the thread rendering a kit writes its times, with relaxed atomic
+// stores, so they cost a few clock reads and nothing else.
+#define STATS_VOICES   0 // tone drums & aux tones
+#define STATS_CLAPHAT  1
+#define STATS_COWBELL  2
+#define STATS_CYMBAL   3
+#define NUM_STATS      4
+
+// noise: the audio thread uses its own xorshift generators instead of rand(),
+// which takes a lock and can't be vectorized. they all start from the kit's
+// seed, so the same seed and the same notes always make the same sound.
+typedef struct {
+ uvec_t x;               // one xorshift32 state per vector lane
+ level_t left[VEC_N];    // made but not used yet, so the output doesn't
+ int nleft;              // depend on how the audio is split into blocks
+} Noise;
+
+
+// voices: tone drums and auxillary tones are played by a pool of voices
+#define MAX_VOICES 64 // size of the voice pool
+#define MAX_VOICE_EVENTS 256 // new voice events per Synthesize() call
+#define VOICE_TONEDRUM 1 // voice types / voice events
+#define VOICE_AUXTONE  2 //
+#define VOICE_RELEASE  3 // aux tone note-off
+#define VOICE_NOTESOFF 4 // all notes off
+#define VOICE_SOUNDOFF 5 // all sound off
+#define CHOKE_ALL     0 // one voice each for tone drums & aux tones (classic)
+#define CHOKE_CHANNEL 1 // one tone drum voice per MIDI channel
+#define CHOKE_NONE    2 // fully polyphonic
+
+typedef struct {
+ int type;       // VOICE_*
+ int group;      // choke group: a new hit retriggers the voice in its group
+ int noteQW;     // quarter wavelength of the note, before pitch bend
+ int qw;         // quarter wavelength, after pitch bend
+ sample_t bend;  // pitch bend that qw was calculated with
+ sample_t volume;
+ sample_t noisiness; // tone drums only
+ sample_t decay;     // aux tones only
+} VoiceEvent;
+
+typedef struct {
+ int type;   // VOICE_TONEDRUM or VOICE_AUXTONE
+ int group;  // choke group, or 0 for none
+ int noteQW; // quarter wavelength of the note, before pitch bend
+ int qw;     // current quarter wavelength
+ sample_t bend; // pitch bend that qw was calculated with
+ level_t s;   // audio signal
+ level_t ds;  // rate of change
+ level_t a;   // current peak amplitude of wave; oscillates between + and -
+ int n;       // current number of samples in a line
+ int count;   // sample counter within a line
+ int lines;   // line counter (resets every few lines)
+ int plateau; // boolean state: is line a plateau or a slope
+ int attack;  // boolean state: are we in the attack stage or the tone stage
+ span_t fm;    // frequency modulation for noisiness
+ span_t dfm;   // rate of change
+ span_t noisiness;
+ coef_t attf;  // for calcuating decays during sweep
+ coef_t decay; // aux tone decay factor
+ unsigned rng;   // random number generator state for this voice
+ int fresh;      // boolean: tone drum just started, may play from the cache
+ int cached;     // 1 + index into the kit's toneCache while playing from it, else 0
+ int cachePos;   // position in the cache table
+ level_t cacheScale; // volume & polarity of the hit
+} Voice;
+
+// tone drum cache: a hit with no noisiness always sounds the same, given its
+// quarter wavelength, sweep speed and decay, except for its volume. so the
+// start of each one gets rendered once at volume 1, then just gets scaled &
+// copied. the live generator takes over after the table, or as soon as
+// something changes the hit while it plays (pitch bend, controllers).
+#define TONE_CACHE_SIZE 64 // number of different hits kept
+typedef struct {
+ int qw, sweepSpeed;   // what the hit sounds like
+ sample_t decayFactor; //
+ unsigned lastUsed;    // for throwing out the least recently used one
+ int diesAway;         // boolean: the hit is (almost) gone by the end of the
+                       // table, so it plays live, to fade out exactly as always
+ Voice start, end;     // the voice before & after the table, at volume 1
+ level_t *table;
+} ToneCacheEntry;
+
+
+// MIDI from threads that don't render (the ALSA MIDI thread and the
+// keyboard) goes through a queue to the thread that does, which applies it
+// whole at the start of its next Synthesize() call. so everything in a kit
+// is only ever written by the thread rendering it: no half-set cymbals.
+#define CONTROL_QUEUE_SIZE 256 // MUST BE A POWER OF TWO
+#define CONTROL_KEY 0 // a control event from the keyboard: param is the key
+typedef struct {
+ int status, channel, param, value; // same as HandleMIDI()'s
+} ControlEvent;
+
+// MIDI for a frame of a later Synthesize() call (see ScheduleMIDI)
+#define MAX_SCHEDULED 512 // per kit
+typedef struct {
+ long frame; // from the start of the next Synthesize() call
+ ControlEvent ev;
+} ScheduledEvent;
+
+#define CYMBAL_N 6 // number of tones (square waves) in a cymbal
+
+// what a kit gets set up with. each kit has its own, so kits with
+// different sample rates (or anything else) can play side by side
+typedef struct {
+ long sampleRate;
+ unsigned seed;   // the same seed always gives the same noise
+ int voices;      // how many tone drums/aux tones can ring at once
+ int chokeMode;   // CHOKE_*
+ int toneCacheMs; // how much of each tone drum hit to keep pre-rendered (0 = none)
+ int timing;      // boolean: time each section, for the live stats (sectionNs)
+} KitSettings;
+#define DEFAULT_KIT_SETTINGS {48000, 1, 8, CHOKE_ALL, 250, 0}
+
+// everything in a kit that changes as it plays, but its scheduled MIDI:
+// the controllers and the state of all its generators. it's what a
+// snapshot of a kit keeps (see SaveKit). the voice pools go last, so a
+// snapshot can leave out the part of them that isn't in use
+typedef struct {
+ unsigned rng;    // for the audio thread's random choices (polarity etc)
+ Noise clapNoise; // white noise for claps and high hats
+
+ sample_t masterVolume;
+
+ // tone drums
+ sample_t tdBend;
+ int tdSweepSpeed;
+ sample_t tdDecayFactor;
+
+ // claps
+ int newClap; // boolean
+ sample_t clapDecayFactor;
+ sample_t clapVolume;
+
+ // high hats
+ int newHighHat; // boolean
+ sample_t hhDecayFactor;
+ sample_t hhVolume;
+
+ // auxillary tones
+ sample_t atBend;
+
+ // cowbells
+ int newCowbell; // boolean
+ int cbWaveScale;
+ sample_t cbDecayFactor;
+ sample_t cbVolume;
+
+ // cymbals
+ int newCymbal; // boolean
+ int cymTones[CYMBAL_N]; // half wavelengths
+ sample_t cymDecayFactor;
+ sample_t cymVolume;
+
+ // values affected by controllers (see HandleMIDI)
+ sample_t clapTweak, hhTweak, atDecay, atRelease, cbTweak, cymTweak;
+
+ // clap & high hat generator (see RenderClapsAndHats)
+ level_t n0, n1;   // the last 2 white noise samples, for convolutions
+ level_t f1s, f2s; // filter stages for clap noise
+ coef_t f2c;       // filter coefficient for clap noise
+ int clapTicks;    // number of clap ticks left
+ int clapTime;     // sample position within a clap tick
+ coef_t ca, ha;    // clap & high hat amplitudes
+
+ // cowbell generator
+ int cbS, cbP, cbCount; // line graph: level, segment, samples left in it
+ coef_t cbA;            // amplitude
+
+ // cymbal generator (see RenderCymbal)
+ int cymPhases[CYMBAL_N]; // -tone..-1: positive half, 0..tone-1: negative
+ level_t cymA;  // amplitude
+ coef_t cymF;   // lowpass filter coefficient
+ level_t cymS;  // lowpass filter state
+ level_t cymS2; // highpass filter state
+
+ // voices: the active ones are voices[0..activeVoices-1]
+ int activeVoices;
+ int voiceEventCount;
+ Voice voices[MAX_VOICES];
+ VoiceEvent voiceEvents[MAX_VOICE_EVENTS]; // new notes, for StartVoices()
+} KitState;
+
+// a kit is one whole drum machine: its voices, its controllers and the
+// state of all its generators. a program can have as many as it likes
+// (snappy-drums has several with -k, the LV2 plugin one per instance).
+// nothing in a kit is shared with another one, so kits can render at the
+// same time on different threads. (defaults are set by SetUpKit)
+typedef struct {
+ KitSettings settings;
+ int qw[128];         // midi note -> quarter wavelength, at the kit's sample rate
+ int quarterWaveFade; // used for removing frequencies that are too low
+ int quarterWaveMax;  //
+ int toneCacheLen;    // settings.toneCacheMs in samples
+
+ ControlEvent controlQueue[CONTROL_QUEUE_SIZE]; // from the MIDI/keyboard threads
+ unsigned controlQueueIn;  // written only by PushControlEvent()
+ unsigned controlQueueOut; // written only by the audio thread
+ pthread_mutex_t controlQueueLock; // for pushers
+ pthread_t owner; // the thread rendering the kit, if owned (see ClaimKit)
+ int owned;       //
+ ScheduledEvent scheduled[MAX_SCHEDULED]; // in frame order
+ int scheduledCount;
+
+ ToneCacheEntry toneCache[TONE_CACHE_SIZE];
+ unsigned toneCacheClock;
+ level_t *toneCacheScratch; // for catching up when leaving the cache
+
+ KitState state; // what it sounds like now (see SaveKit)
+
+ // times for the live stats (if settings.timing is on), in ns
+ unsigned long long sectionNs[NUM_STATS];
+} Kit;
+
+
+
+// sets up a kit, or resets it: everything goes back to how a fresh start
+// sounds. the first time, the kit has to be all zeros. returns -1 if the
+// sample rate is no good
+int SetUpKit(Kit *k, const KitSettings *settings);
+
+// frees what SetUpKit() allocated
+void CleanUpKit(Kit *k);
+
+// renders the next nframes samples of the whole drum machine, mixed into
+// out[]. only one thread at a time can render a kit
+void Synthesize(Kit *k, sample_t *out, int nframes);
+
+// same thing, with each instrument family in bus[BUS_...]. buses can share
+// a buffer, to get mixed together
+void SynthesizeBuses(Kit *k, sample_t *bus[NUM_BUSES], int nframes);
+
+// SynthesizeBuses() for many kits at once, on one thread: bus[n] is kit
+// n's buses, which can't be shared with another kit. the kits render
+// VEC_N at a time, with a kit in each lane of the vectors where that helps
+// (the claps and cowbells), so lots of small kits cost less than one at a
+// time. each kit's scheduled MIDI splits the period for the others in its
+// group too, so it isn't always the same to the last bit as rendering them
+// one by one
+void SynthesizeBatch(Kit *kits[], sample_t **bus[], int nkits, int nframes);
+
+// same as Synthesize(), in the engine's own numbers (only different from
+// floats with -DSNAPPY_FIXED)
+#ifdef SNAPPY_FIXED
+void SynthesizeLevels(Kit *k, level_t *out, int nframes);
+#else
+#define SynthesizeLevels Synthesize
+#endif
+
+// plays MIDI at a frame counted from the start of the next Synthesize()
+// call. a frame past the end of that call waits for the ones after it;
+// events on the same frame play in the order they were scheduled. only for
+// the thread rendering the kit (the others can use HandleMIDI).
+// status is one of the MIDI_* codes, channel is 0 to 15 and param and
+// value are 0 to 127, except for MIDI_PITCHBEND, whose value is centered
+// on zero (-8192 to 8191). a message out of range is dropped
+void ScheduleMIDI(Kit *k, long frame, int status, int channel, int param, int value);
+
+// same thing, for a raw MIDI message (JACK MIDI, LV2 atoms, MIDI files)
+void ScheduleMIDIMessage(Kit *k, long frame, const unsigned char *msg, size_t size);
+
+// plays MIDI now, from any thread: the thread rendering the kit applies it
+// right away, the others queue it for the start of the next Synthesize().
+// a message out of range (see ScheduleMIDI) is dropped
+void HandleMIDI(Kit *k, int status, int channel, int param, int value);
+void HandleMIDIMessage(Kit *k, const unsigned char *msg, size_t size);
+
+// same thing, for a key on the computer keyboard (see the manpage)
+void HandleKey(Kit *k, int key);
+
+// nonzero if MIDI from other threads is waiting for the next Synthesize()
+int PendingMIDI(Kit *k);
+
+// a snapshot of a kit is a copy of everything that makes its sound from
+// here on, so it can be rendered again from that point (snappy-drums uses
+// it to render ahead). RestoreKit() puts it back into a kit that was set
+// up with the same settings (timing aside), which keeps its own settings,
+// control queue, tone drum cache and stats. only for the thread rendering
+// the kit
+typedef struct {
+ KitState state; // (only the voices and voice events in use)
+ ScheduledEvent scheduled[MAX_SCHEDULED]; // (only the first scheduledCount)
+ int scheduledCount;
+ ToneCacheEntry cached[MAX_VOICES]; // the cache entry each voice playing from
+                                    // the cache plays (without its table)
+} KitSnapshot;
+void SaveKit(const Kit *k, KitSnapshot *snapshot);
+void RestoreKit(Kit *k, const KitSnapshot *snapshot);
+
+// renders into the kit's tone drum cache each hit a snapshot's voices play
+// from the cache that it doesn't have, so RestoreKit() finds them: up to
+// voices * toneCacheMs of audio, if they're all new. RestoreKit() itself
+// never renders one (a voice whose hit isn't there plays on live, the same
+// as after a pitch bend), so a real-time thread calls this ahead of time,
+// a little at a time. only for the thread rendering the kit
+void FillKitCache(Kit *k, const KitSnapshot *snapshot);
+
+// puts a kit back the way another one is, which was set up with the same
+// settings: its sound and its tone drum cache, so it plays on exactly the
+// same. much quicker than SetUpKit(), for starting over from the same
+// point again and again. only for the thread rendering the kit
+void CopyKit(Kit *k, const Kit *from);
+
+// makes this thread the one rendering the kit, so its HandleMIDI() calls
+// apply right away (every other thread's get queued). every Synthesize()
+// call does it too; a thread that sends MIDI before its first one calls it
+// first, so that MIDI isn't left for the queue. (SetUpKit() clears it)
+void ClaimKit(Kit *k);
+
+// clock for the live stats, in ns
+unsigned long long NowNs(void);
+
+#endif // SNAPPY_ENGINE_H
@@ -0,0 +1,170 @@
+/***
+ Elie's snappy drum machine, as an LV2 instrument plugin.
+ Same sound engine as snappy-drums, from snappy-engine.c; it runs inside
+ the host's own process call, with no JACK client and no threads of its
+ own. MIDI comes in as atom events, each handled at its exact frame.
+ --
+
+ To compile this:
+    gcc -shared -fPIC -fvisibility=hidden snappy-lv2.c snappy-engine.c -lpthread -lm -O3 -ffast-math \
+        -o snappy.lv2/snappy-drums.so
+
+ then copy the snappy.lv2 folder to ~/.lv2 (or anywhere else in LV2_PATH).
+
+ Ports:
+    midi_in      MIDI, mapped to the drums the same as in snappy-drums
+    out          mono audio
+    the rest     controls that do the same as the MIDI controllers in the
+                 manpage (0..127; the defaults sound the same as a fresh
+                 start): when a control moves, the plugin acts as if it
+                 got that controller.
+                 volume (CC 7), sweep (CC 70), decay (CC 72),
+                 clap (CC 75), hihat (CC 76) for the tone drums,
+                 aux_timbre (CC 71), aux_release (CC 72), cowbell (CC 75),
+                 cymbal (CC 76) for channel 16
+                 (a controller sent as MIDI works too; the last one wins)
+
+
+ Copyright 2019, Elie Goldman Smith
+
+ This program is FREE SOFTWARE: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+***/
+
+#include <stdio.h>
+#include <string.h>
+#include "snappy-engine.h"
+
+#include <lv2/atom/util.h>
+#include <lv2/core/lv2.h>
+#include <lv2/midi/midi.h>
+#include <lv2/urid/urid.h>
+
+#define SNAPPY_URI "https://github.com/Elie9001/musical-instruments/snappy-drums"
+
+// port numbers (the same as in snappy.lv2/snappy-drums.ttl)
+#define PORT_MIDI_IN  0
+#define PORT_OUT      1
+#define PORT_CONTROLS 2 // the first control
+
+// the controls, in port order, and the MIDI controllers they stand for
+typedef struct {
+ int channel, param;
+ int value; // the default, which is what a fresh kit already has
+} ControlCC;
+static const ControlCC g_controlCCs[] = {
+ { 0,  7, 127}, // volume (all channels)
+ { 0, 70,  64}, // sweep
+ { 0, 72,  64}, // decay
+ { 0, 75,  64}, // clap
+ { 0, 76,  64}, // hihat
+ {15, 71,  64}, // aux_timbre
+ {15, 72,  64}, // aux_release
+ {15, 75,  64}, // cowbell
+ {15, 76,  64}, // cymbal
+};
+#define NUM_CONTROLS (sizeof(g_controlCCs)/sizeof(ControlCC))
+
+typedef struct {
+ Kit kit;
+ const LV2_Atom_Sequence *midiIn;
+ float *out;
+ const float *controls[NUM_CONTROLS];
+ int lastValues[NUM_CONTROLS]; // what the kit has now
+ LV2_URID midiEvent;
+} Snappy;
+
+static LV2_Handle Instantiate(const LV2_Descriptor *descriptor, double rate,
+                              const char *bundlePath, const LV2_Feature *const *features)
+{
+ LV2_URID_Map *map = NULL;
+ int i;
+ for (i=0; features[i]; i++)
+  if (!strcmp(features[i]->URI, LV2_URID__map)) map = features[i]->data;
+ if (!map) {
+  fprintf(stderr, "snappy-drums: the host has no urid:map\n");
+  return NULL;
+ }
+
+ // each instance has its own kit, note tables and all, so instances
+ // at different sample rates can share a process
+ KitSettings settings = DEFAULT_KIT_SETTINGS;
+ settings.sampleRate = rate;
+ Snappy *p = calloc(1, sizeof(Snappy));
+ if (!p) return NULL;
+ if (SetUpKit(&p->kit, &settings)) {
+  free(p);
+  return NULL;
+ }
+ p->midiEvent = map->map(map->handle, LV2_MIDI__MidiEvent);
+ for (i=0; i<NUM_CONTROLS; i++) p->lastValues[i] = g_controlCCs[i].value;
+ return p;
+}
+
+static void ConnectPort(LV2_Handle instance, uint32_t port, void *data)
+{
+ Snappy *p = instance;
+ if      (port == PORT_MIDI_IN) p->midiIn = data;
+ else if (port == PORT_OUT)     p->out = data;
+ else if (port - PORT_CONTROLS < NUM_CONTROLS) p->controls[port - PORT_CONTROLS] = data;
+}
+
+// renders one period. like ProcessKit() in snappy-drums.c, each MIDI event
+// gets scheduled at its frame, then the whole period renders in one call
+static void Run(LV2_Handle instance, uint32_t nframes)
+{
+ Snappy *p = instance;
+ Kit *k = &p->kit;
+ int i;
+ ClaimKit(k);
+
+ for (i=0; i<NUM_CONTROLS; i++) {
+  if (!p->controls[i]) continue;
+  int value = lrintf(*p->controls[i]);
+  if (value < 0) value = 0;
+  if (value > 127) value = 127;
+  if (value == p->lastValues[i]) continue;
+  p->lastValues[i] = value;
+  HandleMIDI(k, MIDI_CONTROLLER, g_controlCCs[i].channel, g_controlCCs[i].param, value);
+ }
+
+ if (p->midiIn) LV2_ATOM_SEQUENCE_FOREACH(p->midiIn, ev) {
+  if (ev->body.type != p->midiEvent) continue;
+  long frame = (ev->time.frames < nframes) ? ev->time.frames : nframes;
+  ScheduleMIDIMessage(k, frame, LV2_ATOM_BODY_CONST(&ev->body), ev->body.size);
+ }
+ Synthesize(k, p->out, nframes);
+}
+
+static void Cleanup(LV2_Handle instance)
+{
+ Snappy *p = instance;
+ CleanUpKit(&p->kit);
+ free(p);
+}
+
+static const LV2_Descriptor g_descriptor = {
+ SNAPPY_URI,
+ Instantiate,
+ ConnectPort,
+ NULL, // activate
+ Run,
+ NULL, // deactivate
+ Cleanup,
+ NULL  // extension_data
+};
+
+LV2_SYMBOL_EXPORT const LV2_Descriptor* lv2_descriptor(uint32_t index)
+{
+ return index == 0 ? &g_descriptor : NULL;
+}
@@ -36,11 +36,14 @@
 #include <jack/jack.h>
 #include <math.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/times.h>
+#include <time.h>
 #include <unistd.h>
 
 // basic tone detail parameters
@@ -142,8 +145,38 @@ double formant_shift = 1;
 WINDOW* curses_window = NULL;
 
 
+// flight recorder: the last few seconds of output, the MIDI notes and keys
+// that came in, and how long each callback took, are always kept in memory.
+// after an xrun (or on SIGUSR1) a background thread writes them out as
+// SnoKoder_flight_<date>.wav and .json. the audio thread only copies each
+// period and fills in one slot; it never waits on a lock.
+#define FLIGHT_FRAMES 262144 // output samples kept: MUST BE A POWER OF TWO
+#define FLIGHT_CALLBACKS 8192 // callbacks kept: MUST BE A POWER OF TWO
+#define FLIGHT_EVENTS 1024 // notes & keys kept: MUST BE A POWER OF TWO
+#define FLIGHT_SLACK 8192 // the most frames JACK could write during a dump
+struct Flight_Callback {
+	jack_nframes_t frame; // JACK frame time at the start of the period
+	unsigned audio_in; // where it starts in flight_audio[]
+	unsigned nframes;
+	unsigned ns; // how long the callback took
+} flight_callbacks[FLIGHT_CALLBACKS];
+struct Flight_Event {
+	jack_nframes_t frame; // JACK frame time when it came in
+	int type; // 'n' note on, 'f' note off (MIDI), 'k' a key
+	int value; // the MIDI note, or the key
+} flight_events[FLIGHT_EVENTS];
+sample_t flight_audio[FLIGHT_FRAMES];
+unsigned flight_audio_in = 0; // counts of what has been put in
+unsigned flight_callbacks_in = 0; // (by the audio thread)
+unsigned flight_events_in = 0; // (under flight_lock)
+unsigned long long flight_ns = 0; // time the recorder took in the callbacks
+pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+sem_t flight_wake;
+int flight_reasons = 0; // 1 = xrun, 2 = signal
+
+
 // all AUDIO INPUT AND OUTPUT code in this next function:
-int My_Process (jack_nframes_t nframes, void *arg)
+int ProcessAudio (jack_nframes_t nframes, void *arg)
 {
 	// get the pointers to the input and output audio buffers
 	sample_t *out =(sample_t *) jack_port_get_buffer(output_port, nframes);
@@ -626,6 +659,38 @@ int My_Process (jack_nframes_t nframes, void *arg)
 	return 0;
 }
 
+// called by My_Process() after each period, with the time it took
+void FlightPeriod(const sample_t *out, jack_nframes_t nframes, unsigned ns)
+{
+	unsigned pos = flight_audio_in & (FLIGHT_FRAMES-1);
+	unsigned first = nframes < FLIGHT_FRAMES-pos ? nframes : FLIGHT_FRAMES-pos;
+	memcpy(flight_audio+pos, out, first*sizeof(sample_t));
+	memcpy(flight_audio, out+first, (nframes-first)*sizeof(sample_t));
+	struct Flight_Callback *c =
+		&flight_callbacks[flight_callbacks_in & (FLIGHT_CALLBACKS-1)];
+	c->frame = jack_last_frame_time(client);
+	c->audio_in = flight_audio_in;
+	c->nframes = nframes;
+	c->ns = ns;
+	__atomic_store_n(&flight_audio_in, flight_audio_in+nframes, __ATOMIC_RELEASE);
+	__atomic_store_n(&flight_callbacks_in, flight_callbacks_in+1, __ATOMIC_RELEASE);
+}
+
+// all AUDIO INPUT AND OUTPUT goes through here: the work is done in
+// ProcessAudio(), then the flight recorder keeps a copy
+int My_Process (jack_nframes_t nframes, void *arg)
+{
+	struct timespec t0, t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	int result = ProcessAudio(nframes, arg);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	FlightPeriod((sample_t *) jack_port_get_buffer(output_port, nframes), nframes,
+		(t1.tv_sec-t0.tv_sec)*1000000000LL + t1.tv_nsec-t0.tv_nsec);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	flight_ns += (t2.tv_sec-t1.tv_sec)*1000000000LL + t2.tv_nsec-t1.tv_nsec;
+	return result;
+}
+
 
 
 // function for dealing with any errors
@@ -643,6 +708,14 @@ int My_SampleRateChange (jack_nframes_t nframes, void *arg)
 	return 0;
 }
 
+// function for dealing with xruns (JACK calls this outside the process callback)
+int My_Xrun (void *arg)
+{
+	__atomic_or_fetch(&flight_reasons, 1, __ATOMIC_RELEASE);
+	sem_post(&flight_wake);
+	return 0;
+}
+
 // function for dealing with jack shutting down on you
 void My_JackShutdown (void *arg)
 {
@@ -811,6 +884,126 @@ void SetUpVocoder() // set up everything needed for the vocoder to work
 	plans_are_made = 1;
 }
 
+void FlightSignal(int sig) // SIGUSR1: write out the flight recorder
+{
+	__atomic_or_fetch(&flight_reasons, 2, __ATOMIC_RELEASE);
+	sem_post(&flight_wake);
+}
+
+void FlightNote(int type, int value) // log a note or key for the flight recorder
+{
+	pthread_mutex_lock(&flight_lock);
+	struct Flight_Event *ev = &flight_events[flight_events_in & (FLIGHT_EVENTS-1)];
+	ev->frame = jack_frame_time(client);
+	ev->type = type;
+	ev->value = value;
+	flight_events_in++;
+	pthread_mutex_unlock(&flight_lock);
+}
+
+// copy a ring that JACK is still writing: all of it, oldest first.
+// returns how many items at the end of the copy are still good, and
+// sets *up_to to how many had been put in when it started
+unsigned FlightCopy(void *to, const void *ring, unsigned size, size_t item,
+                    unsigned *in, unsigned slack, unsigned *up_to)
+{
+	unsigned in1 = *up_to = __atomic_load_n(in, __ATOMIC_ACQUIRE);
+	unsigned pos = in1 & (size-1);
+	memcpy(to, (const char*)ring + pos*item, (size-pos)*item);
+	memcpy((char*)to + (size-pos)*item, ring, pos*item);
+	unsigned lost = __atomic_load_n(in, __ATOMIC_ACQUIRE) - in1 + slack;
+	unsigned have = in1 < size ? in1 : size;
+	if (lost >= size) return 0;
+	return have < size-lost ? have : size-lost;
+}
+
+void* FlightThread(void* ptr) // writes out the flight recorder when asked
+{
+	static sample_t audio[FLIGHT_FRAMES];
+	static struct Flight_Callback callbacks[FLIGHT_CALLBACKS];
+	static struct Flight_Event events[FLIGHT_EVENTS];
+	short wav16[1024];
+	unsigned i, j, start, nframes, ncallbacks, nevents;
+	while (1)
+	{
+		while (sem_wait(&flight_wake)); // wait for an xrun or a signal
+		usleep(500000); // so the aftermath gets in too
+		while (sem_trywait(&flight_wake) == 0); // (one dump for a burst)
+		int reasons = __atomic_exchange_n(&flight_reasons,0,__ATOMIC_ACQUIRE);
+
+		// copy it all (the audio last, so it covers everything else)
+		ncallbacks = FlightCopy(callbacks, flight_callbacks, FLIGHT_CALLBACKS,
+			sizeof(*callbacks), &flight_callbacks_in, 1, &start);
+		pthread_mutex_lock(&flight_lock);
+		nevents = FlightCopy(events, flight_events, FLIGHT_EVENTS,
+			sizeof(*events), &flight_events_in, 0, &start);
+		pthread_mutex_unlock(&flight_lock);
+		nframes = FlightCopy(audio, flight_audio, FLIGHT_FRAMES,
+			sizeof(*audio), &flight_audio_in, FLIGHT_SLACK, &start);
+		start -= nframes; // where the wav file starts in flight_audio[]
+		struct Flight_Callback *c = callbacks + FLIGHT_CALLBACKS - ncallbacks;
+		struct Flight_Event *ev = events + FLIGHT_EVENTS - nevents;
+
+		// the audio, as a 16-bit wav file like the INSERT recording
+		char filename[80];
+		time_t t; time(&t);
+		strftime(filename,80,"SnoKoder_flight_%F_%T.wav",localtime(&t));
+		int handle = creat(filename,0644);
+		if (handle < 0) continue;
+		long value;
+		write(handle,"RIFF",4);
+		value=36+nframes*2;  write(handle,&value,4);
+		write(handle,"WAVE",4);
+		write(handle,"fmt ",4);
+		value=16;            write(handle,&value,4);
+		value=1;             write(handle,&value,2);
+		value=1;             write(handle,&value,2);
+		value=sample_rate;   write(handle,&value,4);
+		value=sample_rate*2; write(handle,&value,4);
+		value=2;             write(handle,&value,2);
+		value=16;            write(handle,&value,2);
+		write(handle,"data",4);
+		value=nframes*2;     write(handle,&value,4);
+		for (i=FLIGHT_FRAMES-nframes; i<FLIGHT_FRAMES; i+=j) {
+			for (j=0; j<1024 && i+j<FLIGHT_FRAMES; j++)
+				wav16[j] = audio[i+j]*32767;
+			write(handle, wav16, j*2);
+		}
+		close(handle);
+
+		// the timeline: every callback and event, with its JACK frame time
+		// and where it is in the wav file (negative if it's before it)
+		strcpy(filename+strlen(filename)-3, "json");
+		FILE *json = fopen(filename,"w");
+		if (json == NULL) continue;
+		filename[strlen(filename)-4] = 0;
+		fprintf(json, "{\n \"reason\": \"%s\",\n \"samplerate\": %ld,\n",
+			reasons==1 ? "xrun" : reasons==2 ? "signal" : "xrun signal", sample_rate);
+		fprintf(json, " \"wav\": \"%swav\",\n \"frames\": %u,\n", filename, nframes);
+		fprintf(json, " \"flight_ns\": %llu,\n \"callbacks_total\": %u,\n",
+			__atomic_load_n(&flight_ns,__ATOMIC_RELAXED), flight_callbacks_in);
+		fprintf(json, " \"callbacks\": [");
+		for (i=0; i<ncallbacks; i++) {
+			fprintf(json, "%s\n  {\"frame\": %u, \"offset\": %d, \"nframes\": %u, \"ns\": %u",
+				i ? "," : "", c[i].frame, (int)(c[i].audio_in-start), c[i].nframes, c[i].ns);
+			if (i && c[i].frame != c[i-1].frame+c[i-1].nframes) // (an xrun lost some)
+				fprintf(json, ", \"skipped\": %d", (int)(c[i].frame-c[i-1].frame-c[i-1].nframes));
+			fprintf(json, "}");
+		}
+		fprintf(json, "\n ],\n \"events\": [");
+		for (i=j=0; i<nevents; i++) {
+			while (j+1 < ncallbacks && (int)(ev[i].frame-c[j+1].frame) >= 0) j++;
+			fprintf(json, "%s\n  {\"frame\": %u, ", i ? "," : "", ev[i].frame);
+			if (ncallbacks && (int)(ev[i].frame-c[j].frame) >= 0)
+				fprintf(json, "\"offset\": %d, ", (int)(c[j].audio_in-start+ev[i].frame-c[j].frame));
+			fprintf(json, "\"type\": \"%s\", \"value\": %d}", ev[i].type=='n' ? "note_on" :
+				ev[i].type=='f' ? "note_off" : "key", ev[i].value);
+		}
+		fprintf(json, "\n ]\n}\n");
+		fclose(json);
+	}
+}
+
 void* WaitOnMIDI(void* ptr) // start a loop that responds to ALSA MIDI input
 {
 	int npfd;
@@ -825,6 +1018,8 @@ void* WaitOnMIDI(void* ptr) // start a loop that responds to ALSA MIDI input
 			switch (ev->type) {
 			case SND_SEQ_EVENT_NOTEON:
 				// set the note in the vocoder
+				FlightNote(ev->data.note.velocity > 0 ? 'n' : 'f',
+				           ev->data.note.note);
 				if (ev->data.note.velocity > 0) // normal note-on
 					NoteOn(ev->data.note.note - midi_LOW);
 				else // velocity 0 - some keyboards use as note-off
@@ -832,6 +1027,7 @@ void* WaitOnMIDI(void* ptr) // start a loop that responds to ALSA MIDI input
 			break;
 			case SND_SEQ_EVENT_NOTEOFF: 
 				// erase the note from the vocoder
+				FlightNote('f', ev->data.note.note);
 				NoteOff(ev->data.note.note - midi_LOW);
 			break;        
 			}
@@ -861,6 +1057,7 @@ Released under the GNU General Public License V3 (FREE!YEAH!)\n.\n");
 	jack_set_error_function (My_ErrorHandler);
 	jack_set_process_callback (client, My_Process, 0);
 	jack_set_sample_rate_callback (client, My_SampleRateChange, 0);
+	jack_set_xrun_callback (client, My_Xrun, 0);
 	jack_on_shutdown (client, My_JackShutdown, 0);
 	input_port = jack_port_register (client, "input", 
 	             JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
@@ -869,6 +1066,13 @@ Released under the GNU General Public License V3 (FREE!YEAH!)\n.\n");
 	// force a good buffer size
 	if (jack_get_buffer_size(client) < FFT_N)
 		jack_set_buffer_size (client, FFT_N);
+	// start the flight recorder (see FlightThread)
+	mlock(flight_audio, sizeof(flight_audio));
+	mlock(flight_callbacks, sizeof(flight_callbacks));
+	sem_init(&flight_wake, 0, 0);
+	signal(SIGUSR1, FlightSignal);
+	pthread_t flight_thread;
+	pthread_create(&flight_thread,NULL,FlightThread,NULL);
 	// activate the client
 	if (jack_activate (client))
 	{	fprintf (stderr, "cannot activate client\n");
@@ -928,6 +1132,7 @@ Released under the GNU General Public License V3 (FREE!YEAH!)\n.\n");
 
 		// get the next keypress
 		gotten = toupper(getch());
+		if (gotten >= 0) FlightNote('k', gotten);
 		switch(gotten)
 		{
 		case 27: // the Escape keys